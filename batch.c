@@ -0,0 +1,459 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "batch.h"
+#include "fileio.h"
+#include "yay0_sys.h"
+
+/* Suffix given to encoded files when encoding a directory tree */
+static const char *const batch_suffixes[YAY0_FORMAT_COUNT] =
+  { ".yay0", ".yaz0", ".mio0" };
+
+typedef struct
+{
+  char *in;
+  char *out;
+  size_t in_size;
+  size_t out_size;
+  int ok;
+  /* Taken from the cache instead of encoded */
+  int cached;
+} batch_item_t;
+
+typedef struct
+{
+  batch_item_t *items;
+  size_t count;
+  size_t cap;
+} batch_list_t;
+
+typedef struct
+{
+  int encode;
+  batch_item_t *items;
+  /* Items in the order workers pick them up, largest input first */
+  size_t *order;
+  yay0_encoder_t **encs;
+  /* For the preset dictionary, if any, when decoding */
+  const yay0_params *params;
+  /* What encodes are written as; decodes tell the formats apart */
+  yay0_format format;
+  const cache_t *cache;
+} batch_job_t;
+
+static char *batch_strdup(const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *copy = (char*)malloc(len);
+
+  if (copy)
+    memcpy(copy, s, len);
+
+  return copy;
+}
+
+static char *batch_join(const char *a, const char *b, const char *suffix)
+{
+  size_t la = strlen(a), lb = strlen(b), ls = strlen(suffix);
+  char *path = (char*)malloc(la + lb + ls + 2);
+
+  if (path)
+  {
+    memcpy(path, a, la);
+    path[la] = '/';
+    memcpy(path + la + 1, b, lb);
+    memcpy(path + la + 1 + lb, suffix, ls + 1);
+  }
+
+  return path;
+}
+
+static int batch_add(batch_list_t *list, char *in, char *out)
+{
+  struct stat st;
+
+  if (!in || !out)
+    goto error;
+  if (list->count == list->cap)
+  {
+    size_t cap = list->cap ? list->cap * 2 : 64;
+    batch_item_t *items = (batch_item_t*)realloc(list->items,
+      cap * sizeof(batch_item_t));
+
+    if (!items)
+      goto error;
+    list->items = items;
+    list->cap = cap;
+  }
+  list->items[list->count].in = in;
+  list->items[list->count].out = out;
+  list->items[list->count].in_size =
+    stat(in, &st) == 0 ? (size_t)st.st_size : 0;
+  list->items[list->count].out_size = 0;
+  list->items[list->count].ok = 0;
+  list->items[list->count].cached = 0;
+  list->count++;
+
+  return 1;
+
+error:
+  free(in);
+  free(out);
+  fprintf(stderr, "Error: out of memory\n");
+  return 0;
+}
+
+/**
+ * Read "input output" pairs, one per line. A tab separates the two paths
+ * if there is one, so paths may contain spaces; otherwise the first run of
+ * spaces does. Blank lines and lines starting with '#' are skipped.
+ */
+static int batch_read_manifest(const char *path, batch_list_t *list)
+{
+  size_t size, pos = 0;
+  char *text = (char*)read_file(path, &size), *grown;
+
+  if (!text)
+    return 0;
+  /* Room to end a last line that has no newline */
+  grown = (char*)realloc(text, size + 1);
+  if (!grown)
+  {
+    free(text);
+    fprintf(stderr, "Error: out of memory\n");
+    return 0;
+  }
+  text = grown;
+  text[size] = '\0';
+  while (pos < size)
+  {
+    char *line = text + pos, *sep, *out;
+    size_t len = 0;
+
+    while (pos + len < size && line[len] != '\n')
+      ++len;
+    pos += len + 1;
+    if (len && line[len - 1] == '\r')
+      --len;
+    line[len] = '\0';
+    if (!len || line[0] == '#')
+      continue;
+
+    sep = strchr(line, '\t');
+    if (!sep)
+      sep = strchr(line, ' ');
+    if (!sep)
+    {
+      fprintf(stderr, "Error: manifest line without output path: %s\n", line);
+      free(text);
+      return 0;
+    }
+    *sep = '\0';
+    out = sep + 1;
+    while (*out == ' ' || *out == '\t')
+      ++out;
+    if (!batch_add(list, batch_strdup(line), batch_strdup(out)))
+    {
+      free(text);
+      return 0;
+    }
+  }
+  free(text);
+
+  return 1;
+}
+
+/* Output name for a file found while walking a directory tree */
+static char *batch_out_name(const char *outdir, const char *rel, int encode,
+  yay0_format format)
+{
+  size_t len = strlen(rel), slen = 0;
+  char *stem, *path;
+  int i;
+
+  if (encode)
+    return batch_join(outdir, rel, batch_suffixes[format]);
+  for (i = 0; !slen && i < YAY0_FORMAT_COUNT; ++i)
+  {
+    slen = strlen(batch_suffixes[i]);
+    if (len <= slen || strcmp(rel + len - slen, batch_suffixes[i]) != 0)
+      slen = 0;
+  }
+  if (!slen)
+    return batch_join(outdir, rel, ".bin");
+
+  stem = batch_strdup(rel);
+  if (!stem)
+    return NULL;
+  stem[len - slen] = '\0';
+  path = batch_join(outdir, stem, "");
+  free(stem);
+
+  return path;
+}
+
+/* Add every regular file below dir; rel is dir relative to the root */
+static int batch_walk(const char *root, const char *rel, const char *outdir,
+  int encode, yay0_format format, batch_list_t *list)
+{
+  char *dir = *rel ? batch_join(root, rel, "") : batch_strdup(root);
+  DIR *d = dir ? opendir(dir) : NULL;
+  struct dirent *ent;
+  int ok = 1;
+
+  if (!d)
+  {
+    fprintf(stderr, "Error: cannot open directory %s\n", dir ? dir : root);
+    free(dir);
+    return 0;
+  }
+
+  while (ok && (ent = readdir(d)) != NULL)
+  {
+    char *child_rel, *child;
+    struct stat st;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    child_rel = *rel ? batch_join(rel, ent->d_name, "") :
+                       batch_strdup(ent->d_name);
+    child = child_rel ? batch_join(root, child_rel, "") : NULL;
+    if (!child || stat(child, &st) != 0)
+      ok = 0;
+    else if (S_ISDIR(st.st_mode))
+      ok = batch_walk(root, child_rel, outdir, encode, format, list);
+    else if (S_ISREG(st.st_mode))
+    {
+      ok = batch_add(list, child,
+                     batch_out_name(outdir, child_rel, encode, format));
+      child = NULL;
+    }
+    free(child);
+    free(child_rel);
+  }
+  closedir(d);
+  free(dir);
+
+  return ok;
+}
+
+/* Create every missing parent directory of path */
+static int batch_make_parents(const char *path)
+{
+  char *copy = batch_strdup(path), *p;
+  int ok = 1;
+
+  if (!copy)
+    return 0;
+  for (p = copy + 1; *p && ok; ++p)
+  {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    if (mkdir(copy, 0777) != 0 && errno != EEXIST)
+      ok = 0;
+    *p = '/';
+  }
+  free(copy);
+
+  return ok;
+}
+
+static void batch_task(void *arg, size_t index, unsigned int worker)
+{
+  batch_job_t *job = (batch_job_t*)arg;
+  batch_item_t *item = &job->items[job->order[index]];
+  unsigned char *input, *output = NULL;
+  size_t input_size, output_size = 0;
+  yay0_encoder_t *enc = job->encs[worker];
+  cache_key_t key;
+  yay0_result ret;
+
+  input = read_file(item->in, &input_size);
+  if (!input)
+    return;
+  item->in_size = input_size;
+
+  if (job->encode && job->cache)
+  {
+    cache_key(job->cache, input, input_size, &key);
+    item->cached = cache_get(job->cache, &key, input_size, &output,
+                             &output_size);
+    ret = item->cached ? YAY0_OK
+                       : yay0_compress_formats(enc, input, input_size,
+                                               &job->format, 1, &output,
+                                               &output_size);
+    if (ret == YAY0_OK && !item->cached)
+      cache_put(job->cache, &key, output, output_size);
+  }
+  else if (job->encode)
+    ret = yay0_compress_formats(enc, input, input_size, &job->format, 1,
+                                &output, &output_size);
+  else
+  {
+    /* Only trust the header's size once the tokens can produce it */
+    ret = job->params->dict
+          ? yay0_measure_dict(input, input_size, job->params->dict_size, NULL,
+                              &output_size)
+          : yay0_measure_any(input, input_size, NULL, NULL, &output_size);
+    if (ret == YAY0_OK)
+    {
+      output = (unsigned char*)malloc(output_size ? output_size : 1);
+      if (!output)
+        ret = YAY0_ERR_FORMAT;
+      else if (job->params->dict)
+        ret = yay0_decompress_dict(input, input_size, job->params->dict,
+                                   job->params->dict_size, output,
+                                   &output_size);
+      else
+        ret = yay0_decompress_any(input, input_size, output, &output_size);
+    }
+  }
+
+  if (ret != YAY0_OK)
+    fprintf(stderr, "Error: %s failed for %s (code %d)\n",
+            job->encode ? "compression" : "decompression", item->in, ret);
+  else if (!batch_make_parents(item->out))
+    fprintf(stderr, "Error: cannot create directories for %s\n", item->out);
+  else if (write_file(item->out, output, output_size))
+  {
+    item->out_size = output_size;
+    item->ok = 1;
+  }
+  free(input);
+  free(output);
+}
+
+static int batch_by_size(const void *a, const void *b)
+{
+  const batch_item_t *x = *(const batch_item_t* const*)a;
+  const batch_item_t *y = *(const batch_item_t* const*)b;
+
+  if (x->in_size != y->in_size)
+    return x->in_size < y->in_size ? 1 : -1;
+
+  return x < y ? -1 : x > y;
+}
+
+static int batch_by_path(const void *a, const void *b)
+{
+  return strcmp(((const batch_item_t*)a)->in, ((const batch_item_t*)b)->in);
+}
+
+int batch_main(int argc, char **argv, const yay0_params *params,
+  yay0_format format, unsigned int threads, const cache_t *cache)
+{
+  batch_list_t list = { NULL, 0, 0 };
+  batch_job_t job;
+  batch_item_t **sorted = NULL;
+  size_t i, failed = 0, hits = 0, bytes_in = 0, bytes_out = 0;
+  unsigned int t;
+  struct stat st;
+  double start, elapsed;
+  int ok;
+
+  if (argc < 2 || argc > 3 ||
+      (strcmp(argv[0], "encode") != 0 && strcmp(argv[0], "decode") != 0))
+  {
+    fprintf(stderr, "Usage: batch <encode|decode> <manifest>\n"
+                    "       batch <encode|decode> <indir> <outdir>\n");
+    return 1;
+  }
+  memset(&job, 0, sizeof(job));
+  job.encode = strcmp(argv[0], "encode") == 0;
+  job.params = params;
+  job.format = format;
+  job.cache = job.encode ? cache : NULL;
+
+  if (stat(argv[1], &st) == 0 && S_ISDIR(st.st_mode))
+  {
+    if (argc != 3)
+    {
+      fprintf(stderr, "Error: an output directory is needed for %s\n",
+              argv[1]);
+      return 1;
+    }
+    ok = batch_walk(argv[1], "", argv[2], job.encode, format, &list);
+    /* readdir order is arbitrary; keep reports stable */
+    if (ok && list.count)
+      qsort(list.items, list.count, sizeof(batch_item_t), batch_by_path);
+  }
+  else
+    ok = argc == 2 && batch_read_manifest(argv[1], &list);
+
+  threads = yay0_parallel_threads(threads, list.count);
+  job.items = list.items;
+  job.order = (size_t*)malloc((list.count + 1) * sizeof(size_t));
+  sorted = (batch_item_t**)malloc((list.count + 1) * sizeof(batch_item_t*));
+  job.encs = (yay0_encoder_t**)calloc(threads, sizeof(yay0_encoder_t*));
+  ok = ok && job.order && sorted && job.encs;
+  for (t = 0; ok && t < threads; ++t)
+  {
+    job.encs[t] = yay0_encoder_create();
+    ok = job.encs[t] != NULL;
+    if (ok)
+      yay0_encoder_set_params(job.encs[t], params);
+  }
+
+  if (ok)
+  {
+    /* Largest files first so the last few workers are not left waiting */
+    for (i = 0; i < list.count; ++i)
+      sorted[i] = &list.items[i];
+    qsort(sorted, list.count, sizeof(batch_item_t*), batch_by_size);
+    for (i = 0; i < list.count; ++i)
+      job.order[i] = (size_t)(sorted[i] - list.items);
+
+    start = yay0_time_now();
+    yay0_parallel_for(threads, list.count, batch_task, &job);
+    elapsed = yay0_time_now() - start;
+
+    for (i = 0; i < list.count; ++i)
+    {
+      batch_item_t *item = &list.items[i];
+
+      if (!item->ok)
+      {
+        ++failed;
+        continue;
+      }
+      bytes_in += item->in_size;
+      bytes_out += item->out_size;
+      hits += (size_t)item->cached;
+      printf("%s %s -> %s (%lu -> %lu bytes)\n",
+             job.encode ? "Compressed" : "Decompressed", item->in,
+             item->out, (unsigned long)item->in_size,
+             (unsigned long)item->out_size);
+    }
+    printf("Batch: %lu files, %lu failed, %lu -> %lu bytes, %.3f s, "
+           "%.2f MB/s on %u threads\n",
+           (unsigned long)list.count, (unsigned long)failed,
+           (unsigned long)bytes_in, (unsigned long)bytes_out, elapsed,
+           elapsed > 0 ? (double)bytes_in / elapsed / 1e6 : 0.0, threads);
+    if (job.cache)
+      printf("Cache: %lu hits, %lu misses\n", (unsigned long)hits,
+             (unsigned long)(list.count - failed - hits));
+  }
+
+  for (i = 0; i < list.count; ++i)
+  {
+    free(list.items[i].in);
+    free(list.items[i].out);
+  }
+  if (job.encs)
+    for (t = 0; t < threads; ++t)
+      yay0_encoder_destroy(job.encs[t]);
+  free(job.encs);
+  free(job.order);
+  free(sorted);
+  free(list.items);
+
+  return ok && !failed ? 0 : 1;
+}
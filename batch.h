@@ -0,0 +1,18 @@
+#ifndef YAY0_BATCH_H
+#define YAY0_BATCH_H
+
+#include "cache.h"
+#include "yay0.h"
+
+/**
+ * Runs "batch <encode|decode> <manifest>" or
+ * "batch <encode|decode> <indir> <outdir>", with argv pointing at the mode.
+ * Files are processed on 'threads' workers (0 for one per CPU), each with
+ * its own encoder context. Encodes are written in 'format', and decodes
+ * take any format. With a cache (or NULL), encodes of unchanged inputs are
+ * taken from it. Returns the process exit code.
+ */
+int batch_main(int argc, char **argv, const yay0_params *params,
+  yay0_format format, unsigned int threads, const cache_t *cache);
+
+#endif
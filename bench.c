@@ -0,0 +1,470 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fileio.h"
+#include "yay0.h"
+#include "yay0_sys.h"
+
+/**
+ * Benchmark driver for "make bench". Every input is compressed and
+ * decompressed 'runs' times; the round trip is checked once per input.
+ * Results go to stdout as a table and optionally to CSV or JSON files.
+ * Rates are MB/s; p10 is the slow end. Peak memory is the most the codec
+ * had allocated at once for that input alone, counted through
+ * yay0_set_allocator; the bench's own copies of the data are left out.
+ */
+
+#define BENCH_RUNS_DEFAULT 5
+#define BENCH_MAX_RUNS 1000
+
+typedef struct
+{
+  const char *name;
+  size_t size;
+  size_t packed;
+  double enc[BENCH_MAX_RUNS];
+  double dec[BENCH_MAX_RUNS];
+  unsigned int runs;
+  long peak_kb;
+} bench_result_t;
+
+static unsigned long bench_seed;
+
+static unsigned int bench_rand(void)
+{
+  bench_seed = bench_seed * 1103515245ul + 12345ul;
+  return (unsigned int)(bench_seed >> 16) & 0x7FFF;
+}
+
+/* English-like text built from a small vocabulary */
+static void gen_text(unsigned char *buf, size_t size)
+{
+  static const char *words[] =
+  {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+    "with", "was", "on", "be", "by", "this", "are", "from", "or", "have",
+    "compression", "window", "texture", "cartridge", "segment", "pointer",
+    "display", "list", "vertex", "audio", "sample", "bank", "overlay"
+  };
+  size_t pos = 0;
+
+  while (pos < size)
+  {
+    const char *w = words[bench_rand() % (sizeof(words) / sizeof(*words))];
+    size_t len = strlen(w);
+
+    if (pos + len + 1 > size)
+      len = size - pos;
+    else
+      buf[pos + len] = bench_rand() % 12 ? ' ' : (bench_rand() & 1 ? '\n' : '.');
+    memcpy(buf + pos, w, len);
+    pos += len + 1;
+  }
+}
+
+/* 32x32 RGBA5551 tiles: blocky gradients from a few shared tiles, with a
+ * little noise */
+static void gen_texture(unsigned char *buf, size_t size)
+{
+  size_t i;
+  unsigned int tile = 0;
+
+  for (i = 0; i + 1 < size; i += 2)
+  {
+    unsigned int texel = (unsigned int)(i / 2) & 1023;
+    unsigned int x = texel & 31, y = texel >> 5, px;
+
+    if (!texel)
+      tile = (bench_rand() % 16) * 0x9E5;
+    px = ((((x >> 1) + tile) & 31) << 11) |
+         ((((y >> 2) + (tile >> 5)) & 31) << 6) | ((tile & 31) << 1) | 1;
+    if (bench_rand() % 32 == 0)
+      px ^= bench_rand() & 0x842;
+    buf[i] = (unsigned char)(px >> 8);
+    buf[i + 1] = (unsigned char)px;
+  }
+  if (i < size)
+    buf[i] = 0;
+}
+
+static void gen_zero(unsigned char *buf, size_t size)
+{
+  memset(buf, 0, size);
+}
+
+static void gen_random(unsigned char *buf, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; ++i)
+    buf[i] = (unsigned char)(bench_rand() >> 3);
+}
+
+/* A ROM-like mix: code-ish text, textures, padding and noise in 64 KB runs */
+static void gen_mixed(unsigned char *buf, size_t size)
+{
+  size_t pos;
+
+  for (pos = 0; pos < size; pos += 0x10000)
+  {
+    size_t len = size - pos < 0x10000 ? size - pos : 0x10000;
+
+    switch (bench_rand() % 4)
+    {
+    case 0: gen_text(buf + pos, len); break;
+    case 1: gen_texture(buf + pos, len); break;
+    case 2: gen_zero(buf + pos, len); break;
+    default: gen_random(buf + pos, len); break;
+    }
+  }
+}
+
+typedef struct
+{
+  const char *name;
+  void (*gen)(unsigned char *buf, size_t size);
+} bench_kind_t;
+
+static const bench_kind_t bench_kinds[] =
+{
+  { "text", gen_text },
+  { "texture", gen_texture },
+  { "zero", gen_zero },
+  { "random", gen_random },
+  { "mixed", gen_mixed }
+};
+
+static const size_t bench_sizes[] =
+{
+  0x10000, 0x100000, 0x1000000, 0x4000000
+};
+
+/* Bytes the codec has allocated now and at most since the last reset */
+static size_t bench_live, bench_peak;
+
+/* Each block starts with its size, padded to keep malloc's alignment */
+#define BENCH_BLOCK_HEADER 16
+
+static void *bench_alloc(void *ctx, size_t size)
+{
+  unsigned char *p = (unsigned char*)malloc(BENCH_BLOCK_HEADER + size);
+
+  (void)ctx;
+  if (!p)
+    return NULL;
+  memcpy(p, &size, sizeof(size));
+  bench_live += size;
+  if (bench_live > bench_peak)
+    bench_peak = bench_live;
+
+  return p + BENCH_BLOCK_HEADER;
+}
+
+static void bench_free(void *ctx, void *ptr)
+{
+  unsigned char *p = (unsigned char*)ptr - BENCH_BLOCK_HEADER;
+  size_t size;
+
+  (void)ctx;
+  memcpy(&size, p, sizeof(size));
+  bench_live -= size;
+  free(p);
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Percentile of a run series by linear interpolation, in MB/s */
+static double bench_rate(const double *times, unsigned int runs, size_t size,
+  double pct)
+{
+  double sorted[BENCH_MAX_RUNS], at, t;
+  unsigned int lo;
+
+  memcpy(sorted, times, runs * sizeof(double));
+  qsort(sorted, runs, sizeof(double), bench_cmp);
+  /* The slowest time gives the lowest rate */
+  at = (1.0 - pct / 100.0) * (runs - 1);
+  lo = (unsigned int)at;
+  t = lo + 1 < runs ? sorted[lo] + (sorted[lo + 1] - sorted[lo]) * (at - lo)
+                    : sorted[lo];
+
+  return t > 0 ? (double)size / t / 1e6 : 0.0;
+}
+
+static int bench_run(bench_result_t *r, const unsigned char *data,
+  const yay0_params *params)
+{
+  unsigned char *packed = NULL, *out;
+  size_t packed_size = 0, out_size;
+  unsigned int i;
+  double start;
+  int ok = 1;
+
+  out = (unsigned char*)malloc(r->size ? r->size : 1);
+  if (!out)
+    return 0;
+  bench_peak = bench_live;
+
+  for (i = 0; ok && i < r->runs; ++i)
+  {
+    if (packed)
+      bench_free(NULL, packed);
+    packed = NULL;
+    start = yay0_time_now();
+    ok = yay0_compress_ex(data, r->size, params, &packed, &packed_size) ==
+         YAY0_OK;
+    r->enc[i] = yay0_time_now() - start;
+  }
+
+  for (i = 0; ok && i < r->runs; ++i)
+  {
+    out_size = r->size;
+    start = yay0_time_now();
+    ok = yay0_decompress(packed, packed_size, out, &out_size) == YAY0_OK;
+    r->dec[i] = yay0_time_now() - start;
+  }
+
+  if (ok && (out_size != r->size || memcmp(out, data, r->size) != 0))
+    ok = 0;
+  if (!ok)
+    fprintf(stderr, "Error: round trip failed for %s\n", r->name);
+  r->packed = packed_size;
+  r->peak_kb = (long)((bench_peak + 1023) >> 10);
+  if (packed)
+    bench_free(NULL, packed);
+  free(out);
+
+  return ok;
+}
+
+static void bench_print(const bench_result_t *r)
+{
+  printf("%-24s %10lu %7.2f%% %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9ld\n",
+         r->name, (unsigned long)r->size,
+         r->size ? 100.0 * r->packed / r->size : 0.0,
+         bench_rate(r->enc, r->runs, r->size, 50),
+         bench_rate(r->enc, r->runs, r->size, 10),
+         bench_rate(r->enc, r->runs, r->size, 90),
+         bench_rate(r->dec, r->runs, r->size, 50),
+         bench_rate(r->dec, r->runs, r->size, 10),
+         bench_rate(r->dec, r->runs, r->size, 90),
+         r->peak_kb);
+}
+
+static void bench_csv(FILE *f, const bench_result_t *r, size_t count,
+  int level)
+{
+  size_t i;
+
+  fprintf(f, "name,size,packed,level,runs,enc_p50,enc_p10,enc_p90,"
+             "dec_p50,dec_p10,dec_p90,peak_kb\n");
+  for (i = 0; i < count; ++i, ++r)
+    fprintf(f, "%s,%lu,%lu,%d,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%ld\n",
+            r->name, (unsigned long)r->size, (unsigned long)r->packed, level,
+            r->runs, bench_rate(r->enc, r->runs, r->size, 50),
+            bench_rate(r->enc, r->runs, r->size, 10),
+            bench_rate(r->enc, r->runs, r->size, 90),
+            bench_rate(r->dec, r->runs, r->size, 50),
+            bench_rate(r->dec, r->runs, r->size, 10),
+            bench_rate(r->dec, r->runs, r->size, 90), r->peak_kb);
+}
+
+static void bench_json_series(FILE *f, const char *key, const double *t,
+  unsigned int runs)
+{
+  unsigned int i;
+
+  fprintf(f, "\"%s\": [", key);
+  for (i = 0; i < runs; ++i)
+    fprintf(f, "%s%.6f", i ? ", " : "", t[i]);
+  fprintf(f, "]");
+}
+
+static void bench_json(FILE *f, const bench_result_t *r, size_t count,
+  int level)
+{
+  size_t i;
+
+  fprintf(f, "{\n  \"level\": %d,\n  \"results\": [\n", level);
+  for (i = 0; i < count; ++i, ++r)
+  {
+    fprintf(f, "    {\"name\": \"%s\", \"size\": %lu, \"packed\": %lu, "
+               "\"peak_kb\": %ld,\n     \"enc_mbps\": {\"p50\": %.3f, "
+               "\"p10\": %.3f, \"p90\": %.3f},\n     \"dec_mbps\": "
+               "{\"p50\": %.3f, \"p10\": %.3f, \"p90\": %.3f},\n     ",
+            r->name, (unsigned long)r->size, (unsigned long)r->packed,
+            r->peak_kb, bench_rate(r->enc, r->runs, r->size, 50),
+            bench_rate(r->enc, r->runs, r->size, 10),
+            bench_rate(r->enc, r->runs, r->size, 90),
+            bench_rate(r->dec, r->runs, r->size, 50),
+            bench_rate(r->dec, r->runs, r->size, 10),
+            bench_rate(r->dec, r->runs, r->size, 90));
+    bench_json_series(f, "enc_seconds", r->enc, r->runs);
+    fprintf(f, ",\n     ");
+    bench_json_series(f, "dec_seconds", r->dec, r->runs);
+    fprintf(f, "}%s\n", i + 1 < count ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+static int bench_save(const char *path, const bench_result_t *r, size_t count,
+  int level, int json)
+{
+  FILE *f = fopen(path, "w");
+
+  if (!f)
+  {
+    fprintf(stderr, "Error: cannot open %s for writing\n", path);
+    return 0;
+  }
+  if (json)
+    bench_json(f, r, count, level);
+  else
+    bench_csv(f, r, count, level);
+
+  return fclose(f) == 0;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [-1..-9] [-r runs] [-m max_size] [-c out.csv] [-J out.json] "
+    "[files...]\n"
+    "  Benchmarks the synthetic corpus (text, texture, zero, random, mixed\n"
+    "  at 64 KB, 1 MB, 16 MB and 64 MB, up to max_size) and any given files.\n",
+    prog);
+}
+
+int main(int argc, char **argv)
+{
+  bench_result_t *results;
+  size_t count = 0, cap, max_size = (size_t)-1, i, k;
+  const char *csv = NULL, *json = NULL;
+  unsigned int runs = BENCH_RUNS_DEFAULT;
+  yay0_allocator allocator;
+  yay0_params params;
+  int level = YAY0_LEVEL_DEFAULT, argi = 1, ok = 1;
+  char names[sizeof(bench_sizes) / sizeof(*bench_sizes)]
+            [sizeof(bench_kinds) / sizeof(*bench_kinds)][32];
+
+  for (; argi < argc && argv[argi][0] == '-'; ++argi)
+  {
+    const char *opt = argv[argi];
+
+    if (opt[1] >= '1' && opt[1] <= '9' && opt[2] == '\0')
+      level = opt[1] - '0';
+    else if (opt[2] == '\0' && argi + 1 < argc &&
+             (opt[1] == 'r' || opt[1] == 'm' || opt[1] == 'c' || opt[1] == 'J'))
+    {
+      const char *val = argv[++argi];
+
+      if (opt[1] == 'r')
+        runs = (unsigned int)strtoul(val, NULL, 10);
+      else if (opt[1] == 'm')
+      {
+        char *end;
+
+        max_size = (size_t)strtoul(val, &end, 10);
+        if (*end == 'k' || *end == 'K')
+          max_size <<= 10;
+        else if (*end == 'm' || *end == 'M')
+          max_size <<= 20;
+      }
+      else if (opt[1] == 'c')
+        csv = val;
+      else
+        json = val;
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (runs < 1 || runs > BENCH_MAX_RUNS)
+  {
+    fprintf(stderr, "Error: runs must be 1 to %d\n", BENCH_MAX_RUNS);
+    return 1;
+  }
+  yay0_params_init(&params, level);
+  /* Serial encodes, so the counters need no lock */
+  allocator.alloc = bench_alloc;
+  allocator.free = bench_free;
+  allocator.ctx = NULL;
+  yay0_set_allocator(&allocator);
+
+  cap = sizeof(names) / sizeof(**names) + (size_t)(argc - argi);
+  results = (bench_result_t*)calloc(cap, sizeof(bench_result_t));
+  if (!results)
+    return 1;
+
+  printf("%-24s %10s %8s %9s %9s %9s %9s %9s %9s %9s\n", "input", "bytes",
+         "ratio", "enc p50", "enc p10", "enc p90", "dec p50", "dec p10",
+         "dec p90", "peak KB");
+
+  for (i = 0; ok && i < sizeof(bench_sizes) / sizeof(*bench_sizes); ++i)
+  {
+    size_t size = bench_sizes[i];
+    unsigned char *data;
+
+    if (size > max_size)
+      break;
+    data = (unsigned char*)malloc(size);
+    if (!data)
+    {
+      fprintf(stderr, "Error: cannot allocate %lu bytes\n",
+              (unsigned long)size);
+      ok = 0;
+      break;
+    }
+    for (k = 0; ok && k < sizeof(bench_kinds) / sizeof(*bench_kinds); ++k)
+    {
+      bench_result_t *r = &results[count++];
+
+      bench_seed = (unsigned long)(i * 16 + k + 1);
+      bench_kinds[k].gen(data, size);
+      sprintf(names[i][k], "%s-%luk", bench_kinds[k].name,
+              (unsigned long)(size >> 10));
+      r->name = names[i][k];
+      r->size = size;
+      r->runs = runs;
+      ok = bench_run(r, data, &params);
+      bench_print(r);
+      fflush(stdout);
+    }
+    free(data);
+  }
+
+  for (; ok && argi < argc; ++argi)
+  {
+    bench_result_t *r = &results[count++];
+    mapped_file_t file;
+
+    if (!map_input(argv[argi], &file))
+    {
+      ok = 0;
+      break;
+    }
+    r->name = argv[argi];
+    r->size = file.size;
+    r->runs = runs;
+    ok = bench_run(r, file.data, &params);
+    unmap_file(&file);
+    bench_print(r);
+  }
+
+  if (csv && !bench_save(csv, results, count, level, 0))
+    ok = 0;
+  if (json && !bench_save(json, results, count, level, 1))
+    ok = 0;
+  free(results);
+
+  return ok ? 0 : 1;
+}
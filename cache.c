@@ -0,0 +1,349 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "cache.h"
+
+/* Part of every key; bump it whenever the encoder's output changes */
+#define CACHE_VERSION 1u
+
+#define CACHE_SUFFIX ".yay0"
+#define CACHE_TMP_PREFIX ".tmp-"
+
+/* Temporary files left behind this long are from writers that died */
+#define CACHE_TMP_STALE (60 * 60)
+
+/* 64-bit constants from 32-bit halves, as C89 has no long long literals */
+#define CACHE_P1 ((uint64_t)0x9E3779B1u << 32 | 0x85EBCA87u)
+#define CACHE_P2 ((uint64_t)0xC2B2AE3Du << 32 | 0x27D4EB4Fu)
+#define CACHE_P3 ((uint64_t)0x165667B1u << 32 | 0x9E3779F9u)
+
+typedef struct
+{
+  char *path;
+  uint64_t size;
+  time_t mtime;
+} cache_entry_t;
+
+static uint64_t cache_rotl(uint64_t v, unsigned int r)
+{
+  return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t cache_final(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= CACHE_P2;
+  h ^= h >> 29;
+  h *= CACHE_P3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+/**
+ * Two 64-bit hashes of data in one pass, eight bytes per step on each of
+ * two independent multiply chains. Keys only have to agree on one
+ * machine, so words are read in native byte order.
+ */
+static void cache_hash(const unsigned char *data, size_t size, uint64_t seed,
+  uint64_t *h1, uint64_t *h2)
+{
+  uint64_t a = seed ^ ((uint64_t)size * CACHE_P1);
+  uint64_t b = cache_rotl(seed, 32) ^ CACHE_P3;
+  uint64_t v;
+  size_t i;
+
+  for (i = 0; i + 8 <= size; i += 8)
+  {
+    memcpy(&v, data + i, 8);
+    a = cache_rotl(a ^ (v * CACHE_P2), 31) * CACHE_P1;
+    b = cache_rotl(b ^ (v * CACHE_P1), 29) * CACHE_P3;
+  }
+  v = 0;
+  memcpy(&v, data + i, size - i);
+  a = cache_rotl(a ^ (v * CACHE_P2), 31) * CACHE_P1;
+  b = cache_rotl(b ^ (v * CACHE_P1), 29) * CACHE_P3;
+
+  *h1 = cache_final(a);
+  *h2 = cache_final(b ^ a);
+}
+
+static void cache_hex(char *out, uint64_t v, unsigned int digits)
+{
+  while (digits--)
+  {
+    out[digits] = "0123456789abcdef"[v & 15];
+    v >>= 4;
+  }
+}
+
+static char *cache_path(const char *dir, const char *name)
+{
+  size_t ld = strlen(dir), ln = strlen(name);
+  char *path = (char*)malloc(ld + ln + 2);
+
+  if (path)
+  {
+    memcpy(path, dir, ld);
+    path[ld] = '/';
+    memcpy(path + ld + 1, name, ln + 1);
+  }
+
+  return path;
+}
+
+int cache_open(cache_t *cache, const char *dir, const yay0_params *params,
+  yay0_format format, uint64_t limit)
+{
+  uint64_t fields[9], h1, h2;
+  size_t len = strlen(dir);
+
+  memset(cache, 0, sizeof(*cache));
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "Error: cannot create cache directory %s\n", dir);
+    return 0;
+  }
+  cache->dir = (char*)malloc(len + 1);
+  if (!cache->dir)
+    return 0;
+  memcpy(cache->dir, dir, len + 1);
+  cache->limit = limit;
+  cache->format = format;
+
+  /* Everything that changes the encoded bytes; threads and stats do not */
+  fields[0] = CACHE_VERSION;
+  fields[1] = (uint64_t)params->search;
+  fields[2] = (uint64_t)params->parse;
+  fields[3] = params->max_chain;
+  fields[4] = params->lazy_depth;
+  fields[5] = params->nice_len;
+  fields[6] = params->block_size;
+  fields[7] = params->dict ? params->dict_size : 0;
+  fields[8] = (uint64_t)format;
+  cache_hash((const unsigned char*)fields, sizeof(fields), 0, &h1, &h2);
+  cache->seed = h1;
+  if (fields[7])
+  {
+    cache_hash(params->dict, params->dict_size, h1, &h1, &h2);
+    cache->seed ^= h2;
+  }
+
+  return 1;
+}
+
+void cache_key(const cache_t *cache, const unsigned char *input, size_t size,
+  cache_key_t *key)
+{
+  uint64_t h1, h2;
+
+  cache_hash(input, size, cache->seed, &h1, &h2);
+  /* ab/ab...: 256 subdirectories keep directories small */
+  cache_hex(key->name, h1 >> 56, 2);
+  key->name[2] = '/';
+  cache_hex(key->name + 3, h1, 16);
+  cache_hex(key->name + 19, h2, 16);
+  memcpy(key->name + 35, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+}
+
+int cache_get(const cache_t *cache, const cache_key_t *key,
+  size_t input_size, unsigned char **output, size_t *output_size)
+{
+  char *path = cache_path(cache->dir, key->name);
+  unsigned char *data = NULL;
+  yay0_format found;
+  size_t decoded;
+  long len;
+  FILE *f;
+  int hit = 0;
+
+  /* A missing file is the common case, so nothing is reported */
+  f = path ? fopen(path, "rb") : NULL;
+  if (f && fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 &&
+      fseek(f, 0, SEEK_SET) == 0)
+  {
+    data = (unsigned char*)malloc((size_t)len);
+    hit = data && fread(data, 1, (size_t)len, f) == (size_t)len &&
+          yay0_format_detect(data, (size_t)len, &found, &decoded) ==
+            YAY0_OK && found == cache->format && decoded == input_size;
+  }
+  if (f)
+    fclose(f);
+
+  if (hit)
+  {
+    /* Recently used entries are evicted last */
+    utime(path, NULL);
+    *output = data;
+    *output_size = (size_t)len;
+  }
+  else
+    free(data);
+  free(path);
+
+  return hit;
+}
+
+int cache_put(const cache_t *cache, const cache_key_t *key,
+  const unsigned char *data, size_t size)
+{
+  char *path = cache_path(cache->dir, key->name), *tmp;
+  size_t dirlen = strlen(cache->dir) + 3;
+  int fd, ok = 0;
+
+  tmp = path ? (char*)malloc(dirlen + sizeof(CACHE_TMP_PREFIX "XXXXXX") + 1)
+             : NULL;
+  if (!tmp)
+  {
+    free(path);
+    return 0;
+  }
+  memcpy(tmp, path, dirlen);
+  tmp[dirlen] = '\0';
+  if (mkdir(tmp, 0777) == 0 || errno == EEXIST)
+  {
+    memcpy(tmp + dirlen, "/" CACHE_TMP_PREFIX "XXXXXX",
+           sizeof("/" CACHE_TMP_PREFIX "XXXXXX"));
+    fd = mkstemp(tmp);
+    if (fd >= 0)
+    {
+      size_t done = 0;
+      ssize_t n = 0;
+
+      while (done < size && (n = write(fd, data + done, size - done)) > 0)
+        done += (size_t)n;
+      ok = close(fd) == 0 && done == size;
+      /* Readers only ever see a complete entry under the final name */
+      ok = ok && rename(tmp, path) == 0;
+      if (!ok)
+        unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(path);
+
+  return ok;
+}
+
+static int cache_by_age(const void *a, const void *b)
+{
+  const cache_entry_t *x = (const cache_entry_t*)a;
+  const cache_entry_t *y = (const cache_entry_t*)b;
+
+  return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* Adds the entries of one subdirectory to the list */
+static int cache_list(const char *sub, cache_entry_t **list, size_t *count,
+  size_t *cap, uint64_t *total)
+{
+  DIR *d = opendir(sub);
+  struct dirent *de;
+  struct stat st;
+  time_t now = time(NULL);
+  int ok = 1;
+
+  if (!d)
+    return 1;
+  while (ok && (de = readdir(d)) != NULL)
+  {
+    char *path;
+
+    if (de->d_name[0] == '.' && strncmp(de->d_name, CACHE_TMP_PREFIX,
+                                        sizeof(CACHE_TMP_PREFIX) - 1) != 0)
+      continue;
+    path = cache_path(sub, de->d_name);
+    if (!path || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      free(path);
+      continue;
+    }
+    if (de->d_name[0] == '.')
+    {
+      if (now - st.st_mtime > CACHE_TMP_STALE)
+        unlink(path);
+      free(path);
+      continue;
+    }
+    if (*count == *cap)
+    {
+      size_t n = *cap ? *cap * 2 : 256;
+      cache_entry_t *grown = (cache_entry_t*)realloc(*list,
+        n * sizeof(cache_entry_t));
+
+      if (!grown)
+      {
+        free(path);
+        ok = 0;
+        break;
+      }
+      *list = grown;
+      *cap = n;
+    }
+    (*list)[*count].path = path;
+    (*list)[*count].size = (uint64_t)st.st_size;
+    (*list)[*count].mtime = st.st_mtime;
+    ++*count;
+    *total += (uint64_t)st.st_size;
+  }
+  closedir(d);
+
+  return ok;
+}
+
+unsigned long cache_close(cache_t *cache)
+{
+  cache_entry_t *list = NULL;
+  size_t count = 0, cap = 0, i;
+  uint64_t total = 0;
+  unsigned long evicted = 0;
+  struct dirent *de;
+  DIR *d;
+  int ok = 1;
+
+  if (!cache->dir)
+    return 0;
+  d = opendir(cache->dir);
+  while (ok && d && (de = readdir(d)) != NULL)
+  {
+    char *sub;
+
+    if (strlen(de->d_name) != 2 || de->d_name[0] == '.')
+      continue;
+    sub = cache_path(cache->dir, de->d_name);
+    ok = sub && cache_list(sub, &list, &count, &cap, &total);
+    free(sub);
+  }
+  if (d)
+    closedir(d);
+
+  /* Oldest first; other processes may be deleting the same files */
+  if (ok && total > cache->limit)
+  {
+    qsort(list, count, sizeof(cache_entry_t), cache_by_age);
+    for (i = 0; i < count && total > cache->limit; ++i)
+    {
+      if (unlink(list[i].path) == 0)
+        ++evicted;
+      total -= list[i].size;
+    }
+  }
+
+  for (i = 0; i < count; ++i)
+    free(list[i].path);
+  free(list);
+  free(cache->dir);
+  cache->dir = NULL;
+
+  return evicted;
+}
@@ -0,0 +1,62 @@
+#ifndef YAY0_CACHE_H
+#define YAY0_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "yay0.h"
+
+/* Size the cache directory is trimmed back to when none is given */
+#define CACHE_LIMIT_DEFAULT (256ul * 1024ul * 1024ul)
+
+/**
+ * On-disk cache of compressed files, keyed by a hash of the input bytes
+ * and of the encoder parameters and output format that affect the output. Entries are
+ * written under a temporary name and renamed into place, so any number of
+ * threads and processes can share a directory: readers see a whole entry
+ * or none. Hits refresh an entry's modification time, and closing the
+ * cache deletes the least recently used entries until it fits its limit.
+ * Nothing in the cache is shared between threads, so the caller counts
+ * hits and misses.
+ */
+typedef struct
+{
+  char *dir;
+  uint64_t limit;
+  /* Hash of the parameters, mixed into every key */
+  uint64_t seed;
+  /* Format every entry is written in */
+  yay0_format format;
+} cache_t;
+
+/* Where an input's entry lives, relative to the cache directory */
+typedef struct
+{
+  char name[48];
+} cache_key_t;
+
+/* Creates the directory if needed; returns 0 on failure */
+int cache_open(cache_t *cache, const char *dir, const yay0_params *params,
+  yay0_format format, uint64_t limit);
+
+void cache_key(const cache_t *cache, const unsigned char *input, size_t size,
+  cache_key_t *key);
+
+/**
+ * Looks up the compressed form of an input of input_size bytes, returning
+ * 1 and a malloc'd copy on a hit
+ */
+int cache_get(const cache_t *cache, const cache_key_t *key,
+  size_t input_size, unsigned char **output, size_t *output_size);
+
+/* Stores an entry, best effort; returns 0 if it could not be written */
+int cache_put(const cache_t *cache, const cache_key_t *key,
+  const unsigned char *data, size_t size);
+
+/**
+ * Evicts down to the limit and frees the cache. Returns the number of
+ * entries evicted.
+ */
+unsigned long cache_close(cache_t *cache);
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef YAY0_NO_MMAP
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef YAY0_NO_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "fileio.h"
+
+/* Reads f to the end when its size cannot be found by seeking */
+static unsigned char *read_stream(FILE *f, const char *path, size_t *out_size)
+{
+  unsigned char *buf = NULL, *grown;
+  size_t size = 0, cap = 0, n;
+
+  do
+  {
+    if (size == cap)
+    {
+      cap = cap ? cap * 2 : 65536;
+      grown = (unsigned char*)realloc(buf, cap);
+      if (!grown)
+      {
+        fprintf(stderr, "Error: cannot allocate %lu bytes\n",
+                (unsigned long)cap);
+        free(buf);
+        return NULL;
+      }
+      buf = grown;
+    }
+    n = fread(buf + size, 1, cap - size, f);
+    size += n;
+  } while (n);
+
+  if (ferror(f))
+  {
+    fprintf(stderr, "Error: failed to read %s\n", path);
+    free(buf);
+    return NULL;
+  }
+  *out_size = size;
+
+  return buf;
+}
+
+unsigned char *read_file(const char *path, size_t *out_size)
+{
+  FILE *f;
+  unsigned char *buf;
+  long len;
+
+  *out_size = 0;
+  if (strcmp(path, "-") == 0)
+    return read_stream(stdin, "stdin", out_size);
+  f = fopen(path, "rb");
+  if (!f)
+  {
+    fprintf(stderr, "Error: cannot open %s\n", path);
+    return NULL;
+  }
+
+  /* Pipes cannot seek; read them in chunks instead */
+  if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0)
+  {
+    clearerr(f);
+    buf = read_stream(f, path, out_size);
+    fclose(f);
+    return buf;
+  }
+
+  buf = (unsigned char*)malloc(len ? (size_t)len : 1);
+  if (!buf)
+    goto error;
+
+  if (fread(buf, 1, (size_t)len, f) != (size_t)len)
+  {
+    fprintf(stderr, "Error: failed to read %s\n", path);
+    free(buf);
+    goto error;
+  }
+  fclose(f);
+  *out_size = (size_t)len;
+
+  return buf;
+
+error:
+  fclose(f);
+  return NULL;
+}
+
+int write_file(const char *path, const unsigned char *data, size_t size)
+{
+  FILE *f;
+
+  if (strcmp(path, "-") == 0)
+  {
+    if (fwrite(data, 1, size, stdout) != size || fflush(stdout) != 0)
+    {
+      fprintf(stderr, "Error: failed to write to stdout\n");
+      return 0;
+    }
+    return 1;
+  }
+  f = fopen(path, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "Error: cannot open %s for writing\n", path);
+    return 0;
+  }
+  else if (fwrite(data, 1, size, f) != size)
+  {
+    fprintf(stderr, "Error: failed to write to %s\n", path);
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+
+  return 1;
+}
+
+int map_input(const char *path, mapped_file_t *file)
+{
+#ifndef YAY0_NO_MMAP
+  struct stat st;
+  void *data;
+  int fd;
+
+  memset(file, 0, sizeof(*file));
+  file->fd = -1;
+  fd = strcmp(path, "-") == 0 ? -1 : open(path, O_RDONLY);
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0 && (off_t)(size_t)st.st_size == st.st_size)
+  {
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED)
+    {
+      /* The codecs read front to back */
+      posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+      close(fd);
+      file->data = (unsigned char*)data;
+      file->size = (size_t)st.st_size;
+      file->mapped = 1;
+      return 1;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+#else
+  memset(file, 0, sizeof(*file));
+  file->fd = -1;
+#endif
+  file->data = read_file(path, &file->size);
+
+  return file->data != NULL;
+}
+
+int map_output(const char *path, size_t size, mapped_file_t *file)
+{
+#ifndef YAY0_NO_MMAP
+  struct stat st;
+  void *data;
+  int fd;
+
+  memset(file, 0, sizeof(*file));
+  file->fd = -1;
+  /* Only regular files can be sized and mapped; leave pipes and devices
+   * to the stdio path so they are opened just once */
+  if (size && strcmp(path, "-") != 0 &&
+      (stat(path, &st) != 0 || S_ISREG(st.st_mode)))
+  {
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+      fprintf(stderr, "Error: cannot open %s for writing\n", path);
+      return 0;
+    }
+    if (ftruncate(fd, (off_t)size) == 0)
+    {
+      data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        file->data = (unsigned char*)data;
+        file->size = size;
+        file->fd = fd;
+        file->mapped = 1;
+        return 1;
+      }
+    }
+    /* The heap fallback writes the file on commit; do not leave a
+     * full-size one behind in the meantime */
+    close(fd);
+    remove(path);
+  }
+#else
+  memset(file, 0, sizeof(*file));
+  file->fd = -1;
+#endif
+  file->data = (unsigned char*)malloc(size ? size : 1);
+  file->size = size;
+  if (!file->data)
+  {
+    fprintf(stderr, "Error: cannot allocate %lu bytes\n", (unsigned long)size);
+    return 0;
+  }
+
+  return 1;
+}
+
+int map_output_over(const char *path, const char *input, size_t size,
+  mapped_file_t *file)
+{
+#ifndef YAY0_NO_MMAP
+  struct stat out_st, in_st;
+
+  /* Truncating the input while it is mapped would lose it; write the
+   * output from memory after decoding instead */
+  if (strcmp(path, "-") != 0 && strcmp(input, "-") != 0 &&
+      stat(path, &out_st) == 0 && stat(input, &in_st) == 0 &&
+      out_st.st_dev == in_st.st_dev && out_st.st_ino == in_st.st_ino)
+  {
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    file->data = (unsigned char*)malloc(size ? size : 1);
+    file->size = size;
+    if (!file->data)
+    {
+      fprintf(stderr, "Error: cannot allocate %lu bytes\n",
+              (unsigned long)size);
+      return 0;
+    }
+    return 1;
+  }
+#else
+  (void)input;
+#endif
+
+  return map_output(path, size, file);
+}
+
+int close_output(const char *path, mapped_file_t *file, size_t size,
+  int commit)
+{
+  int ok = 1;
+
+#ifndef YAY0_NO_MMAP
+  if (file->mapped)
+  {
+    munmap(file->data, file->size);
+    if (!commit)
+      size = 0;
+    if (size != file->size && ftruncate(file->fd, (off_t)size) != 0)
+      ok = 0;
+    if (close(file->fd) != 0)
+      ok = 0;
+    if (!ok)
+      fprintf(stderr, "Error: failed to write to %s\n", path);
+    if (!commit)
+      remove(path);
+    file->data = NULL;
+    return ok && commit;
+  }
+#endif
+  if (commit)
+    ok = write_file(path, file->data, size);
+  free(file->data);
+  file->data = NULL;
+
+  return ok && commit;
+}
+
+void unmap_file(mapped_file_t *file)
+{
+#ifndef YAY0_NO_MMAP
+  if (file->mapped)
+    munmap(file->data, file->size);
+  else
+#endif
+    free(file->data);
+  file->data = NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef YAY0_FILEIO_H
+#define YAY0_FILEIO_H
+
+#include <stddef.h>
+
+/* Every function here takes "-" as a path for stdin or stdout */
+
+/* Reads a whole file into a malloc'd buffer, printing errors to stderr */
+unsigned char *read_file(const char *path, size_t *out_size);
+
+/* Writes a buffer to a file, printing errors to stderr; returns 0 on failure */
+int write_file(const char *path, const unsigned char *data, size_t size);
+
+/**
+ * A file's contents, either mapped into memory or held in a heap buffer
+ * when mapping is not possible (pipes, empty files, YAY0_NO_MMAP builds).
+ */
+typedef struct
+{
+  unsigned char *data;
+  size_t size;
+  int fd;
+  int mapped;
+} mapped_file_t;
+
+/* Maps a file read-only, falling back to read_file; returns 0 on failure */
+int map_input(const char *path, mapped_file_t *file);
+
+/**
+ * Creates a file of 'size' bytes and maps it writable, falling back to a
+ * heap buffer that is written out by close_output; returns 0 on failure.
+ */
+int map_output(const char *path, size_t size, mapped_file_t *file);
+
+/**
+ * Like map_output, for output that may be the same file as 'input', which
+ * is still mapped: then the output is kept in memory and only replaces
+ * the file when close_output commits it, so a failed decode leaves the
+ * input alone.
+ */
+int map_output_over(const char *path, const char *input, size_t size,
+  mapped_file_t *file);
+
+/**
+ * Finishes a file from map_output, keeping its first 'size' bytes. Pass 0
+ * for 'commit' to drop the output after an error. Returns 0 on failure.
+ */
+int close_output(const char *path, mapped_file_t *file, size_t size,
+  int commit);
+
+/* Releases a file from map_input */
+void unmap_file(mapped_file_t *file);
+
+#endif
@@ -2,162 +2,590 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "batch.h"
+#include "cache.h"
+#include "fileio.h"
+#include "pipeline.h"
+#include "scan.h"
+#include "server.h"
 #include "yay0.h"
+#include "yay0_sys.h"
 
-static unsigned char *read_file(const char *path, size_t *out_size)
+/* Human-readable report of the statistics of one run */
+static void print_stats(FILE *out, const yay0_stats *s)
 {
-  FILE *f;
-  unsigned char *buf;
-  long len;
-
-  *out_size = 0;
-  f = fopen(path, "rb");
-  if (!f)
-  {
-    fprintf(stderr, "Error: cannot open %s\n", path);
-    return NULL;
-  }
-
-  if (fseek(f, 0, SEEK_END) != 0)
-    goto error;
-
-  len = ftell(f);
-  if (len < 0)
-    goto error;
-
-  if (fseek(f, 0, SEEK_SET) != 0)
-    goto error;
-
-  buf = (unsigned char*)malloc((size_t)len);
-  if (!buf)
-    goto error;
-
-  if (fread(buf, 1, (size_t)len, f) != (size_t)len)
-  {
-    fprintf(stderr, "Error: failed to read %s\n", path);
-    free(buf);
-    goto error;
-  }
-  fclose(f);
-  *out_size = (size_t)len;
-
-  return buf;
-
-error:
-  fclose(f);
-  return NULL;
+    unsigned long tokens = s->literals + s->matches;
+    unsigned int i;
+
+    fprintf(out, "Tokens: %lu literals, %lu matches covering %lu bytes (%.1f%% literals)\n",
+            s->literals, s->matches, s->match_bytes,
+            tokens ? 100.0 * s->literals / tokens : 0.0);
+    if (s->matches)
+    {
+        fprintf(out, "Match lengths:\n");
+        for (i = 0; i < YAY0_STATS_LEN_BUCKETS; ++i)
+            if (s->len_hist[i])
+                fprintf(out, "  %s%-6u %10lu  %5.1f%%\n",
+                        i == YAY0_STATS_LEN_BUCKETS - 1 ? ">=" : "  ",
+                        i + 3, s->len_hist[i], 100.0 * s->len_hist[i] / s->matches);
+        fprintf(out, "Match distances:\n");
+        for (i = 0; i < YAY0_STATS_DIST_BUCKETS; ++i)
+            if (s->dist_hist[i])
+                fprintf(out, "  %4u..%-4u %10lu  %5.1f%%\n", 1u << i,
+                        i + 1 < YAY0_STATS_DIST_BUCKETS ? (2u << i) - 1 : 1u << i,
+                        s->dist_hist[i], 100.0 * s->dist_hist[i] / s->matches);
+    }
+    if (s->searches)
+        fprintf(out, "Search: %lu match finder calls, %lu scans, %lu lazy wins\n",
+                s->searches, s->mischar_searches, s->lazy_wins);
+    if (s->reallocs)
+        fprintf(out, "Memory: %lu reallocs, %lu bytes\n", s->reallocs, s->realloc_bytes);
+    fprintf(out, "Time: search %.3f s, emit %.3f s, serialize %.3f s, decode %.3f s\n",
+            s->time_search, s->time_emit, s->time_serialize, s->time_decode);
+}
+
+static void print_hist_json(FILE *out, const char *key, const unsigned long *hist,
+                            unsigned int count)
+{
+    unsigned int i;
+
+    fprintf(out, "  \"%s\": [", key);
+    for (i = 0; i < count; ++i)
+        fprintf(out, "%s%lu", i ? ", " : "", hist[i]);
+    fprintf(out, "],\n");
+}
+
+static void print_stats_json(FILE *out, const yay0_stats *s)
+{
+    fprintf(out, "{\n  \"literals\": %lu,\n  \"matches\": %lu,\n  \"match_bytes\": %lu,\n",
+            s->literals, s->matches, s->match_bytes);
+    /* len_hist[i] counts length i + 3, with the last bucket 18 and up;
+     * dist_hist[i] counts distances 2^i to 2^(i+1) - 1 */
+    print_hist_json(out, "len_hist", s->len_hist, YAY0_STATS_LEN_BUCKETS);
+    print_hist_json(out, "dist_hist", s->dist_hist, YAY0_STATS_DIST_BUCKETS);
+    fprintf(out, "  \"searches\": %lu,\n  \"mischar_searches\": %lu,\n  \"lazy_wins\": %lu,\n",
+            s->searches, s->mischar_searches, s->lazy_wins);
+    fprintf(out, "  \"reallocs\": %lu,\n  \"realloc_bytes\": %lu,\n", s->reallocs, s->realloc_bytes);
+    fprintf(out, "  \"time_search\": %.6f,\n  \"time_emit\": %.6f,\n"
+            "  \"time_serialize\": %.6f,\n  \"time_decode\": %.6f\n}\n",
+            s->time_search, s->time_emit, s->time_serialize, s->time_decode);
+}
+
+static void print_evicted(FILE *out, unsigned long evicted)
+{
+    if (evicted)
+        fprintf(out, "Cache: %lu entries evicted\n", evicted);
 }
 
-static int write_file(const char *path, const unsigned char *data, size_t size)
+/* index <in> <out.idx> [interval]: save a checkpoint index for range reads */
+static int index_main(int argc, char **argv)
 {
-  FILE *f = fopen(path, "wb");
+    mapped_file_t input;
+    yay0_index_t *index = NULL;
+    unsigned char *data = NULL;
+    size_t size = 0, interval = 0;
+    int ret;
 
-  if (!f)
-  {
-    fprintf(stderr, "Error: cannot open %s for writing\n", path);
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: index <inputfile> <indexfile> [interval]\n");
+        return 1;
+    }
+    if (argc == 3)
+        interval = (size_t)strtoul(argv[2], NULL, 0);
+    if (!map_input(argv[0], &input))
+        return 1;
+
+    ret = yay0_index_build(input.data, input.size, interval, &index);
+    unmap_file(&input);
+    if (ret == YAY0_OK)
+    {
+        data = (unsigned char *)malloc(yay0_index_serialized_size(index));
+        ret = data ? yay0_index_save(index, data, yay0_index_serialized_size(index), &size)
+                   : YAY0_ERR_FORMAT;
+    }
+    yay0_index_destroy(index);
+    if (ret != YAY0_OK) {
+        fprintf(stderr, "Error: cannot index %s (code %d)\n", argv[0], ret);
+        free(data);
+        return 1;
+    }
+    ret = write_file(argv[1], data, size);
+    free(data);
+    if (!ret)
+        return 1;
+
+    printf("Indexed %s -> %s (%lu bytes)\n", argv[0], argv[1], (unsigned long)size);
     return 0;
-  }
-  else if (fwrite(data, 1, size, f) != size)
-  {
-    fprintf(stderr, "Error: failed to write to %s\n", path);
-    fclose(f);
+}
+
+/* train <out.dict> <sample>...: build a preset dictionary from samples */
+static int train_main(int argc, char **argv)
+{
+    mapped_file_t *samples;
+    const uint8_t **data;
+    size_t *sizes, dict_size = 0;
+    unsigned char dict[YAY0_DICT_SIZE_MAX];
+    int i, loaded = 0, ret = YAY0_ERR_FORMAT;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: train <dictfile> <sample>...\n");
+        return 1;
+    }
+    samples = (mapped_file_t *)calloc((size_t)argc, sizeof(mapped_file_t));
+    data = (const uint8_t **)calloc((size_t)argc, sizeof(uint8_t *));
+    sizes = (size_t *)calloc((size_t)argc, sizeof(size_t));
+    if (samples && data && sizes)
+    {
+        for (loaded = 0; loaded < argc - 1; ++loaded)
+        {
+            if (!map_input(argv[loaded + 1], &samples[loaded]))
+                break;
+            data[loaded] = samples[loaded].data;
+            sizes[loaded] = samples[loaded].size;
+        }
+        if (loaded == argc - 1)
+            ret = yay0_dict_train(data, sizes, (size_t)loaded, dict, sizeof(dict), &dict_size);
+    }
+    for (i = 0; i < loaded; ++i)
+        unmap_file(&samples[i]);
+    free(samples);
+    free(data);
+    free(sizes);
+    if (ret != YAY0_OK) {
+        fprintf(stderr, "Error: cannot train a dictionary (code %d)\n", ret);
+        return 1;
+    }
+    if (!write_file(argv[0], dict, dict_size))
+        return 1;
+
+    printf("Trained %s from %d samples (%lu bytes)\n", argv[0], argc - 1,
+           (unsigned long)dict_size);
     return 0;
-  }
-  fclose(f);
+}
+
+/* validate <file>...: strictly check files without decoding them */
+static int validate_main(int argc, char **argv)
+{
+    mapped_file_t input;
+    size_t size;
+    int i, ret, failed = 0;
 
-  return 1;
+    if (argc < 1)
+    {
+        fprintf(stderr, "Usage: validate <inputfile>...\n");
+        return 1;
+    }
+    for (i = 0; i < argc; ++i)
+    {
+        if (!map_input(argv[i], &input)) {
+            ++failed;
+            continue;
+        }
+        ret = yay0_validate(input.data, input.size, &size);
+        unmap_file(&input);
+        if (ret == YAY0_OK)
+            printf("%s: valid (%lu bytes)\n", argv[i], (unsigned long)size);
+        else {
+            printf("%s: invalid (code %d)\n", argv[i], ret);
+            ++failed;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
+
+/* range <in> <offset> <length> <out> [index]: decode part of a file */
+static int range_main(int argc, char **argv)
+{
+    mapped_file_t input, saved;
+    yay0_index_t *index = NULL;
+    unsigned char *output;
+    size_t offset, length;
+    int ret;
+
+    if (argc < 4 || argc > 5)
+    {
+        fprintf(stderr, "Usage: range <inputfile> <offset> <length> <outputfile> [indexfile]\n");
+        return 1;
+    }
+    offset = (size_t)strtoul(argv[1], NULL, 0);
+    length = (size_t)strtoul(argv[2], NULL, 0);
+    if (!map_input(argv[0], &input))
+        return 1;
+
+    /* Without a saved index, build one just for this read */
+    if (argc == 5)
+    {
+        if (!map_input(argv[4], &saved)) {
+            unmap_file(&input);
+            return 1;
+        }
+        ret = yay0_index_load(saved.data, saved.size, &index);
+        unmap_file(&saved);
+    }
+    else
+        ret = yay0_index_build(input.data, input.size, 0, &index);
+
+    output = (unsigned char *)malloc(length ? length : 1);
+    if (ret == YAY0_OK)
+        ret = output ? yay0_decompress_range(input.data, input.size, index, offset, length, output)
+                     : YAY0_ERR_FORMAT;
+    yay0_index_destroy(index);
+    unmap_file(&input);
+    if (ret != YAY0_OK) {
+        fprintf(stderr, "Error: range decompression failed (code %d)\n", ret);
+        free(output);
+        return 1;
+    }
+    ret = write_file(argv[3], output, length);
+    free(output);
+    if (!ret)
+        return 1;
+
+    printf("Decompressed bytes %lu..%lu of %s -> %s\n", (unsigned long)offset,
+           (unsigned long)(offset + length), argv[0], argv[3]);
+    return 0;
+}
+
+/* Format named on the command line; returns 0 for an unknown name */
+static int parse_format(const char *name, yay0_format *format)
+{
+    static const char *const names[YAY0_FORMAT_COUNT] = { "yay0", "yaz0", "mio0" };
+    int i;
+
+    for (i = 0; i < YAY0_FORMAT_COUNT; ++i)
+        if (strcmp(name, names[i]) == 0) {
+            *format = (yay0_format)i;
+            return 1;
+        }
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-1..-9] [-j N] <encode|decode> <inputfile> <outputfile>\n", prog);
+    fprintf(stderr, "       %s [-1..-9] [-j N] batch <encode|decode> <manifest>\n", prog);
+    fprintf(stderr, "       %s [-1..-9] [-j N] batch <encode|decode> <indir> <outdir>\n", prog);
+    fprintf(stderr, "       %s [-j N] scan <image> [outdir]\n", prog);
+    fprintf(stderr, "       %s index <inputfile> <indexfile> [interval]\n", prog);
+    fprintf(stderr, "       %s train <dictfile> <sample>...\n", prog);
+    fprintf(stderr, "       %s validate <inputfile>...\n", prog);
+    fprintf(stderr, "       %s [-j N] serve <socket>\n", prog);
+    fprintf(stderr, "       %s --server <socket> stop\n", prog);
+    fprintf(stderr, "       %s range <inputfile> <offset> <length> <outputfile> [indexfile]\n", prog);
+    fprintf(stderr, "  -1 .. -9  compression level, fastest to smallest "
+                    "(default: match the original encoder)\n");
+    fprintf(stderr, "  -j N      encode in 1 MB blocks, or decode in segments, on N threads "
+                    "(0: one per CPU); in batch mode, N files at once; "
+                    "scan extracts on every CPU unless given\n");
+    fprintf(stderr, "  --stats[=json]  report token, search and timing "
+                    "statistics\n");
+    fprintf(stderr, "  --dict F  preset dictionary F, needed again to decode\n");
+    fprintf(stderr, "  --format F  encode as yay0 (default), yaz0 or mio0; "
+                    "decode tells them apart itself\n");
+    fprintf(stderr, "  --cache D reuse earlier encodes of the same input from directory D\n");
+    fprintf(stderr, "  --cache-size MB  trim the cache to MB megabytes (default: %lu)\n",
+            CACHE_LIMIT_DEFAULT >> 20);
+    fprintf(stderr, "  --server S  have the server on socket S encode or decode "
+                    "(default: $YAY0_SERVER if it answers)\n");
+    fprintf(stderr, "  -         as <inputfile> or <outputfile>: stdin or stdout; plain "
+                    "decodes then read, decode and write at once\n");
+    fprintf(stderr, "  manifest  lines of '<input> <output>', tab separated "
+                    "if paths contain spaces\n");
 }
 
 int main(int argc, char **argv)
 {
-    unsigned char *input_data = NULL, *output_data = NULL;
-    size_t input_size = 0, output_size = 0;
+    unsigned char *output_data = NULL;
+    size_t output_size = 0;
+    mapped_file_t input, dict = { NULL, 0, -1, 0 };
+    yay0_stats stats;
+    int stats_mode = 0; /* 1 for text, 2 for JSON */
+    yay0_params params;
+    int level = YAY0_LEVEL_DEFAULT;
+    int threads = 1, threads_given = 0;
+    yay0_format format = YAY0_FORMAT_YAY0, found = YAY0_FORMAT_YAY0;
+    const char *server = NULL;
+    const char *cache_dir = NULL;
+    unsigned long cache_mb = CACHE_LIMIT_DEFAULT >> 20;
+    cache_t cache;
+    cache_key_t key;
+    int argi = 1;
     int ret;
 
-    if (argc != 4)
+    /* Options come before the mode */
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0')
     {
-        fprintf(stderr, "Usage: %s <encode|decode> <inputfile> <outputfile>\n", argv[0]);
+        const char *opt = argv[argi];
+
+        if (opt[1] >= '1' && opt[1] <= '9' && opt[2] == '\0')
+            level = opt[1] - '0';
+        else if (strcmp(opt, "--stats") == 0)
+            stats_mode = 1;
+        else if (strcmp(opt, "--stats=json") == 0)
+            stats_mode = 2;
+        else if (strcmp(opt, "--server") == 0 && argi + 1 < argc)
+            server = argv[++argi];
+        else if (strcmp(opt, "--format") == 0 && argi + 1 < argc)
+        {
+            if (!parse_format(argv[++argi], &format))
+            {
+                fprintf(stderr, "Unknown format '%s'\n", argv[argi]);
+                return 1;
+            }
+        }
+        else if (strcmp(opt, "--cache") == 0 && argi + 1 < argc)
+            cache_dir = argv[++argi];
+        else if (strcmp(opt, "--cache-size") == 0 && argi + 1 < argc)
+            cache_mb = strtoul(argv[++argi], NULL, 10);
+        else if (strcmp(opt, "--dict") == 0 && argi + 1 < argc && !dict.data)
+        {
+            if (!map_input(argv[++argi], &dict))
+                return 1;
+        }
+        else if (opt[1] == 'j')
+        {
+            const char *val = opt[2] ? opt + 2 : (argi + 1 < argc ? argv[++argi] : "");
+            char *end;
+
+            threads = (int)strtol(val, &end, 10);
+            threads_given = 1;
+            if (!*val || *end || threads < 0)
+            {
+                fprintf(stderr, "Invalid thread count '%s'\n", val);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option '%s'\n", opt);
+            usage(argv[0]);
+            return 1;
+        }
+        argi++;
+    }
+
+    if (argi < argc && strcmp(argv[argi], "batch") == 0)
+    {
+        if (stats_mode)
+        {
+            fprintf(stderr, "--stats is not supported in batch mode\n");
+            return 1;
+        }
+        if (format != YAY0_FORMAT_YAY0 && dict.data && argi + 1 < argc &&
+            strcmp(argv[argi + 1], "encode") == 0)
+        {
+            fprintf(stderr, "--dict only works with Yay0\n");
+            return 1;
+        }
+        /* Parallelism comes from running files side by side */
+        yay0_params_init(&params, level);
+        params.dict = dict.data;
+        params.dict_size = dict.size;
+        if (cache_dir && !cache_open(&cache, cache_dir, &params, format,
+                                     (uint64_t)cache_mb << 20))
+            return 1;
+        ret = batch_main(argc - argi - 1, argv + argi + 1, &params, format,
+                         (unsigned int)threads, cache_dir ? &cache : NULL);
+        if (cache_dir)
+            print_evicted(stdout, cache_close(&cache));
+        if (dict.data)
+            unmap_file(&dict);
+        return ret;
+    }
+
+    if (argi < argc && strcmp(argv[argi], "index") == 0)
+        return index_main(argc - argi - 1, argv + argi + 1);
+    if (argi < argc && strcmp(argv[argi], "range") == 0)
+        return range_main(argc - argi - 1, argv + argi + 1);
+    if (argi < argc && strcmp(argv[argi], "scan") == 0)
+        return scan_main(argc - argi - 1, argv + argi + 1,
+                         threads_given ? (unsigned int)threads : 0);
+    if (argi < argc && strcmp(argv[argi], "train") == 0)
+        return train_main(argc - argi - 1, argv + argi + 1);
+    if (argi < argc && strcmp(argv[argi], "validate") == 0)
+        return validate_main(argc - argi - 1, argv + argi + 1);
+    if (argi < argc && strcmp(argv[argi], "serve") == 0)
+        return server_main(argc - argi - 1, argv + argi + 1,
+                           threads_given ? (unsigned int)threads : 0);
+    if (server && argc - argi == 1 && strcmp(argv[argi], "stop") == 0)
+    {
+        ret = server_request(server, "stop", 0, NULL, NULL);
+        if (ret < 0)
+            fprintf(stderr, "Error: no server on %s\n", server);
+        return ret < 0 ? 1 : ret;
+    }
+
+    if (argc - argi != 3)
+    {
+        usage(argv[0]);
         return 1;
     }
 
-    const char *mode = argv[1];
-    const char *input_path = argv[2];
-    const char *output_path = argv[3];
+    const char *mode = argv[argi];
+    const char *input_path = argv[argi + 1];
+    const char *output_path = argv[argi + 2];
+    /* Reports must not end up in the data on stdout */
+    FILE *msg = strcmp(output_path, "-") == 0 ? stderr : stdout;
+    int piped = strcmp(input_path, "-") == 0 || msg == stderr;
+
+    yay0_stats_init(&stats);
+
+    /* Plain encodes and decodes can go to a running server instead */
+    if (!stats_mode && !dict.data && !cache_dir && threads == 1 && !piped &&
+        (strcmp(mode, "encode") == 0 ? format == YAY0_FORMAT_YAY0 :
+         strcmp(mode, "decode") == 0))
+    {
+        const char *socket_path = server ? server : getenv("YAY0_SERVER");
+
+        ret = socket_path && *socket_path ?
+              server_request(socket_path, mode, level, input_path, output_path) : -1;
+        if (ret >= 0)
+            return ret;
+        if (server) {
+            fprintf(stderr, "Error: no server on %s\n", server);
+            return 1;
+        }
+    }
+
+    if (strcmp(mode, "decode") == 0 && piped && !dict.data && !stats_mode && threads == 1) {
+        /* Decode: read, decode and write side by side, for shell pipelines */
+        if (!pipeline_decode(input_path, output_path, &output_size))
+            return 1;
+
+        fprintf(msg, "Decompressed %s -> %s (%lu bytes)\n",
+                input_path, output_path, (unsigned long)output_size);
 
-    if (strcmp(mode, "decode") == 0) {
-        /* Decode: decompress Yay0 */
+    } else if (strcmp(mode, "decode") == 0) {
+        /* Decode: decompress straight into the mapped output file */
+        mapped_file_t output;
 
-        input_data = read_file(input_path, &input_size);
-        if (!input_data) return 1;
+        if (!map_input(input_path, &input)) return 1;
 
-        ret = yay0_get_decompressed_size(input_data, input_size, &output_size);
+        /* Walk the tokens first, so a bogus header cannot size the output */
+        if (dict.data)
+            ret = yay0_measure_dict(input.data, input.size, dict.size, NULL,
+                                    &output_size);
+        else
+            ret = yay0_measure_any(input.data, input.size, &found, NULL, &output_size);
         if (ret != YAY0_OK) {
             fprintf(stderr, "Error: failed to get decompressed size (code %d)\n", ret);
-            free(input_data);
+            unmap_file(&input);
             return 1;
         }
 
-        output_data = (unsigned char *)malloc(output_size);
-        if (!output_data) {
-            fprintf(stderr, "Error: cannot allocate %lu bytes\n", (unsigned long)output_size);
-            free(input_data);
+        if (!map_output_over(output_path, input_path, output_size, &output)) {
+            unmap_file(&input);
             return 1;
         }
 
-        ret = yay0_decompress(input_data, input_size, output_data, output_size);
+        if (found != YAY0_FORMAT_YAY0)
+            ret = yay0_decompress_any(input.data, input.size, output.data, &output_size);
+        else if (dict.data)
+            ret = yay0_decompress_dict(input.data, input.size, dict.data, dict.size,
+                                       output.data, &output_size);
+        else if (threads != 1 && !stats_mode)
+            ret = yay0_decompress_parallel(input.data, input.size, output.data, &output_size,
+                                           (unsigned int)threads, 0);
+        else
+            ret = yay0_decompress_ex(input.data, input.size, output.data, &output_size,
+                                     stats_mode ? &stats : NULL);
+        unmap_file(&input);
+        if (dict.data)
+            unmap_file(&dict);
         if (ret != YAY0_OK) {
             fprintf(stderr, "Error: decompression failed (code %d)\n", ret);
-            free(input_data);
-            free(output_data);
+            close_output(output_path, &output, 0, 0);
             return 1;
         }
 
-        if (!write_file(output_path, output_data, output_size)) {
-            free(input_data);
-            free(output_data);
+        if (!close_output(output_path, &output, output_size, 1))
             return 1;
-        }
 
-        printf("Decompressed %s -> %s (%lu bytes)\n",
-               input_path, output_path, (unsigned long)output_size);
+        fprintf(msg, "Decompressed %s -> %s (%lu bytes)\n",
+                input_path, output_path, (unsigned long)output_size);
 
     } else if (strcmp(mode, "encode") == 0) {
-        /* Encode: compress into Yay0 */
+        /* Encode: compress into Yay0, or the format asked for */
+        if (format != YAY0_FORMAT_YAY0 && dict.data) {
+            fprintf(stderr, "--dict only works with Yay0\n");
+            return 1;
+        }
 
-	output_size = input_size * 2;
-        input_data = read_file(input_path, &input_size);
-        if (!input_data) return 1;
+        if (!map_input(input_path, &input)) return 1;
 
-        output_data = (unsigned char *)malloc(output_size);
-        if (!output_data) {
-            fprintf(stderr, "Error: cannot allocate %lu bytes\n", (unsigned long)output_size);
-            free(input_data);
-            return 1;
+        yay0_params_init(&params, level);
+        if (threads != 1)
+        {
+            /* Blocks, and so the output, stay the same for any thread count */
+            params.block_size = YAY0_BLOCK_SIZE_DEFAULT;
+            params.threads = (unsigned int)threads;
+        }
+        if (stats_mode)
+            params.stats = &stats;
+        params.dict = dict.data;
+        params.dict_size = dict.size;
+        if (cache_dir) {
+            if (!cache_open(&cache, cache_dir, &params, format, (uint64_t)cache_mb << 20)) {
+                unmap_file(&input);
+                return 1;
+            }
+            cache_key(&cache, input.data, input.size, &key);
         }
+        if (cache_dir && cache_get(&cache, &key, input.size, &output_data, &output_size)) {
+            fprintf(msg, "Cache: hit\n");
+            ret = YAY0_OK;
+        } else if (format != YAY0_FORMAT_YAY0) {
+            /* A serial parse, written out in the other format */
+            yay0_encoder_t *enc = yay0_encoder_create();
 
-        ret = yay0_compress(input_data, input_size, &output_data, &output_size);
+            yay0_encoder_set_params(enc, &params);
+            ret = enc ? yay0_compress_formats(enc, input.data, input.size, &format, 1,
+                                              &output_data, &output_size)
+                      : YAY0_ERR_FORMAT;
+            yay0_encoder_destroy(enc);
+            if (cache_dir && ret == YAY0_OK) {
+                fprintf(msg, "Cache: miss\n");
+                cache_put(&cache, &key, output_data, output_size);
+            }
+        } else {
+            ret = yay0_compress_ex(input.data, input.size, &params, &output_data, &output_size);
+            if (cache_dir && ret == YAY0_OK) {
+                fprintf(msg, "Cache: miss\n");
+                cache_put(&cache, &key, output_data, output_size);
+            }
+        }
+        if (cache_dir)
+            print_evicted(msg, cache_close(&cache));
+        unmap_file(&input);
+        if (dict.data)
+            unmap_file(&dict);
         if (ret != YAY0_OK) {
             fprintf(stderr, "Error: compression failed (code %d)\n", ret);
-            free(input_data);
-            free(output_data);
             return 1;
         }
 
         if (!write_file(output_path, output_data, output_size)) {
-            free(input_data);
             free(output_data);
             return 1;
         }
+        free(output_data);
 
-        printf("Compressed %s -> %s (%lu bytes)\n",
-               input_path, output_path, (unsigned long)output_size);
+        fprintf(msg, "Compressed %s -> %s (%lu bytes)\n",
+                input_path, output_path, (unsigned long)output_size);
 
     } else {
         fprintf(stderr, "Invalid mode '%s', use encode or decode\n", mode);
         return 1;
     }
 
-    free(input_data);
-    free(output_data);
+    if (stats_mode == 1)
+        print_stats(msg, &stats);
+    else if (stats_mode == 2)
+        print_stats_json(msg, &stats);
+
     return 0;
 }
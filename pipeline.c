@@ -0,0 +1,504 @@
+#define _POSIX_C_SOURCE 200112L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef YAY0_NO_THREADS
+#include <pthread.h>
+#endif
+
+#include "pipeline.h"
+#include "yay0.h"
+
+/* Size of input pieces and of output buffers */
+#define PIPE_CHUNK (64u * 1024u)
+
+/* Output buffers in flight between the decoder and the writer */
+#define PIPE_BUFFERS 4u
+
+#ifndef YAY0_NO_THREADS
+#define PIPE_LOCK(p) pthread_mutex_lock(&(p)->lock)
+#define PIPE_UNLOCK(p) pthread_mutex_unlock(&(p)->lock)
+#define PIPE_WAIT(p) pthread_cond_wait(&(p)->cond, &(p)->lock)
+#define PIPE_WAKE(p) pthread_cond_broadcast(&(p)->cond)
+#else
+#define PIPE_LOCK(p) ((void)0)
+#define PIPE_UNLOCK(p) ((void)0)
+#define PIPE_WAIT(p) ((void)0)
+#define PIPE_WAKE(p) ((void)0)
+#endif
+
+/**
+ * State shared by the stages. One lock and one condition cover it all;
+ * every change is broadcast and each stage rechecks what it waits for.
+ */
+typedef struct
+{
+#ifndef YAY0_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+  const char *in_path;
+  const char *out_path;
+  int in_fd;
+  int out_fd;
+  /* Stages without a thread of their own run on the decoder's */
+  int reader_thread;
+  int writer_thread;
+
+  /* Input read so far, in PIPE_CHUNK pieces that never move */
+  unsigned char **chunks;
+  size_t nchunks;
+  size_t cap;
+  size_t received;
+  /* 1 at the end of input, -1 after a read error */
+  int eof;
+
+  /* Ring of output buffers; 'ready' of them, from 'head', await writing */
+  unsigned char *bufs[PIPE_BUFFERS];
+  size_t lens[PIPE_BUFFERS];
+  unsigned int head;
+  unsigned int ready;
+  size_t written;
+  /* The decoder has handed over its last buffer */
+  int finished;
+  /* A stage failed and the others should stop */
+  int failed;
+} pipeline_t;
+
+/* Reads once into the input; returns 0 at the end of input or on error */
+static int pipe_read(pipeline_t *p)
+{
+  size_t fill = p->received % PIPE_CHUNK;
+  unsigned char *chunk;
+  ssize_t n;
+
+  /* Only this stage changes the chunk table, so it reads it unlocked */
+  if (!fill)
+  {
+    chunk = (unsigned char*)malloc(PIPE_CHUNK);
+    PIPE_LOCK(p);
+    if (chunk && p->nchunks == p->cap)
+    {
+      size_t cap = p->cap ? p->cap * 2 : 64;
+      unsigned char **grown = (unsigned char**)realloc(p->chunks,
+        cap * sizeof(unsigned char*));
+
+      if (grown)
+      {
+        p->chunks = grown;
+        p->cap = cap;
+      }
+    }
+    if (!chunk || p->nchunks == p->cap)
+    {
+      free(chunk);
+      fprintf(stderr, "Error: out of memory reading %s\n", p->in_path);
+      p->eof = -1;
+      PIPE_WAKE(p);
+      PIPE_UNLOCK(p);
+      return 0;
+    }
+    p->chunks[p->nchunks++] = chunk;
+    PIPE_UNLOCK(p);
+  }
+  chunk = p->chunks[p->received / PIPE_CHUNK];
+
+#ifndef YAY0_NO_THREADS
+  /* Blocked here on a pipe is the only place the reader can be stopped */
+  if (p->reader_thread)
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+#endif
+  do
+    n = read(p->in_fd, chunk + fill, PIPE_CHUNK - fill);
+  while (n < 0 && errno == EINTR);
+#ifndef YAY0_NO_THREADS
+  if (p->reader_thread)
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+#endif
+
+  PIPE_LOCK(p);
+  if (n > 0)
+    p->received += (size_t)n;
+  else
+  {
+    if (n < 0)
+      fprintf(stderr, "Error: failed to read %s\n", p->in_path);
+    p->eof = n < 0 ? -1 : 1;
+  }
+  PIPE_WAKE(p);
+  PIPE_UNLOCK(p);
+
+  return n > 0;
+}
+
+/**
+ * Points *data at input from 'offset' on, waiting for it to be read.
+ * Returns how many bytes there are, 0 past the end of input.
+ */
+static size_t pipe_input(pipeline_t *p, size_t offset,
+  const unsigned char **data)
+{
+  size_t avail = 0;
+
+  PIPE_LOCK(p);
+  while (p->received <= offset && !p->eof && !p->failed)
+  {
+    if (p->reader_thread)
+      PIPE_WAIT(p);
+    else
+    {
+      PIPE_UNLOCK(p);
+      pipe_read(p);
+      PIPE_LOCK(p);
+    }
+  }
+  if (p->received > offset)
+  {
+    *data = p->chunks[offset / PIPE_CHUNK] + offset % PIPE_CHUNK;
+    avail = PIPE_CHUNK - offset % PIPE_CHUNK;
+    if (avail > p->received - offset)
+      avail = p->received - offset;
+  }
+  PIPE_UNLOCK(p);
+
+  return avail;
+}
+
+/* Whether input at 'offset' can be had without waiting */
+static int pipe_has_input(pipeline_t *p, size_t offset)
+{
+  int has;
+
+  PIPE_LOCK(p);
+  has = p->received > offset || p->eof;
+  PIPE_UNLOCK(p);
+
+  return has;
+}
+
+/* Writes the oldest waiting buffer; returns 0 once there will be no more */
+static int pipe_write(pipeline_t *p)
+{
+  const unsigned char *buf;
+  size_t len, done = 0;
+  ssize_t n = 0;
+
+  PIPE_LOCK(p);
+  while (!p->ready && !p->finished && !p->failed)
+    PIPE_WAIT(p);
+  if (!p->ready || p->failed)
+  {
+    PIPE_UNLOCK(p);
+    return 0;
+  }
+  buf = p->bufs[p->head];
+  len = p->lens[p->head];
+  PIPE_UNLOCK(p);
+
+  while (done < len)
+  {
+    n = write(p->out_fd, buf + done, len - done);
+    if (n > 0)
+      done += (size_t)n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else
+      break;
+  }
+
+  PIPE_LOCK(p);
+  if (done == len)
+  {
+    p->head = (p->head + 1) % PIPE_BUFFERS;
+    p->ready--;
+    p->written += len;
+  }
+  else
+  {
+    fprintf(stderr, "Error: failed to write to %s\n", p->out_path);
+    p->failed = 1;
+  }
+  PIPE_WAKE(p);
+  PIPE_UNLOCK(p);
+
+  return done == len;
+}
+
+/* Waits for an output buffer to fill; NULL if the pipeline failed */
+static unsigned char *pipe_slot(pipeline_t *p)
+{
+  unsigned char *buf = NULL;
+
+  PIPE_LOCK(p);
+  while (p->ready == PIPE_BUFFERS && !p->failed)
+    PIPE_WAIT(p);
+  if (!p->failed)
+    buf = p->bufs[(p->head + p->ready) % PIPE_BUFFERS];
+  PIPE_UNLOCK(p);
+
+  return buf;
+}
+
+/* Hands the buffer from pipe_slot to the writer with 'len' bytes in it */
+static void pipe_push(pipeline_t *p, size_t len)
+{
+  PIPE_LOCK(p);
+  p->lens[(p->head + p->ready) % PIPE_BUFFERS] = len;
+  p->ready++;
+  PIPE_WAKE(p);
+  PIPE_UNLOCK(p);
+
+  if (!p->writer_thread)
+    while (pipe_write(p) && p->ready)
+      ;
+}
+
+#ifndef YAY0_NO_THREADS
+static void *pipe_reader(void *arg)
+{
+  pipeline_t *p = (pipeline_t*)arg;
+  int failed = 0;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  while (!failed && pipe_read(p))
+  {
+    PIPE_LOCK(p);
+    failed = p->failed;
+    PIPE_UNLOCK(p);
+  }
+
+  return NULL;
+}
+
+static void *pipe_writer(void *arg)
+{
+  pipeline_t *p = (pipeline_t*)arg;
+
+  while (pipe_write(p))
+    ;
+
+  return NULL;
+}
+#endif
+
+/* Decodes Yay0 as it arrives with the streaming decoder */
+static yay0_result pipe_stream(pipeline_t *p, yay0_decoder_t *dec)
+{
+  const unsigned char *data = NULL;
+  unsigned char *buf = pipe_slot(p);
+  size_t len = 0, n, avail, offset;
+  yay0_result ret = YAY0_ERR_FORMAT;
+
+  while (buf)
+  {
+    ret = yay0_decoder_pull(dec, buf + len, PIPE_CHUNK - len, &n);
+    len += n;
+    if (ret == YAY0_NEED_INPUT)
+    {
+      /* Pass on what is decoded before waiting, as it may be a while */
+      offset = yay0_decoder_want(dec);
+      if (len && !pipe_has_input(p, offset))
+      {
+        pipe_push(p, len);
+        len = 0;
+        buf = pipe_slot(p);
+        if (!buf)
+          break;
+      }
+      avail = pipe_input(p, offset, &data);
+      yay0_decoder_feed(dec, avail ? data : NULL, avail);
+      continue;
+    }
+    if (ret != YAY0_OK)
+      break;
+    if (len == PIPE_CHUNK || yay0_decoder_done(dec))
+    {
+      if (len)
+        pipe_push(p, len);
+      len = 0;
+      if (yay0_decoder_done(dec))
+        break;
+      buf = pipe_slot(p);
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * Yaz0 and MIO0 have no streaming decoder, so they are read to the end,
+ * decoded whole and handed to the writer in chunks.
+ */
+static yay0_result pipe_whole(pipeline_t *p, size_t *output_size)
+{
+  const unsigned char *data = NULL;
+  unsigned char *input = NULL, *output = NULL, *buf;
+  size_t total = 0, size = 0, pos, n;
+  yay0_result ret;
+
+  while ((n = pipe_input(p, total, &data)) != 0)
+    total += n;
+  input = (unsigned char*)malloc(total ? total : 1);
+  for (pos = 0; input && pos < total; pos += n)
+  {
+    n = pipe_input(p, pos, &data);
+    memcpy(input + pos, data, n);
+  }
+  /* The tokens, not the header, decide how much output to allocate */
+  ret = input ? yay0_measure_any(input, total, NULL, NULL, &size)
+              : YAY0_ERR_FORMAT;
+  if (ret == YAY0_OK)
+  {
+    output = (unsigned char*)malloc(size ? size : 1);
+    ret = output ? yay0_decompress_any(input, total, output, &size)
+                 : YAY0_ERR_FORMAT;
+  }
+  free(input);
+  for (pos = 0; ret == YAY0_OK && pos < size; pos += n)
+  {
+    buf = pipe_slot(p);
+    if (!buf)
+      break;
+    n = size - pos < PIPE_CHUNK ? size - pos : PIPE_CHUNK;
+    memcpy(buf, output + pos, n);
+    pipe_push(p, n);
+  }
+  free(output);
+  *output_size = size;
+
+  return ret;
+}
+
+/* Runs the decoder stage; returns 0 on failure */
+static int pipe_decode(pipeline_t *p, size_t *output_size)
+{
+  yay0_decoder_t *dec = NULL;
+  const unsigned char *head = NULL;
+  yay0_result ret = YAY0_ERR_FORMAT;
+  int eof;
+
+  /* The magic is enough to tell whether the input can be streamed */
+  if (pipe_input(p, 3, &head) && pipe_input(p, 0, &head) &&
+      memcmp(head, "Yay0", 4) != 0)
+    ret = pipe_whole(p, output_size);
+  else if ((dec = yay0_decoder_create()) != NULL)
+  {
+    ret = pipe_stream(p, dec);
+    yay0_decoder_size(dec, output_size);
+    yay0_decoder_destroy(dec);
+  }
+
+  PIPE_LOCK(p);
+  eof = p->eof;
+  if (ret != YAY0_OK)
+  {
+    /* A failed read already said why */
+    if (eof >= 0 && !p->failed)
+      fprintf(stderr, "Error: decompression failed (code %d)\n", (int)ret);
+    p->failed = 1;
+  }
+  p->finished = 1;
+  PIPE_WAKE(p);
+  PIPE_UNLOCK(p);
+
+  if (!p->writer_thread)
+    while (pipe_write(p))
+      ;
+
+  return !p->failed;
+}
+
+int pipeline_decode(const char *in_path, const char *out_path,
+  size_t *output_size)
+{
+  pipeline_t p;
+#ifndef YAY0_NO_THREADS
+  pthread_t reader, writer;
+#endif
+  int to_stdout = strcmp(out_path, "-") == 0;
+  unsigned int i;
+  size_t size = 0;
+  int ok = 1;
+
+  memset(&p, 0, sizeof(p));
+  p.in_path = strcmp(in_path, "-") == 0 ? "stdin" : in_path;
+  p.out_path = to_stdout ? "stdout" : out_path;
+  p.in_fd = strcmp(in_path, "-") == 0 ? STDIN_FILENO : open(in_path, O_RDONLY);
+  if (p.in_fd < 0)
+  {
+    fprintf(stderr, "Error: cannot open %s\n", in_path);
+    return 0;
+  }
+  p.out_fd = to_stdout ? STDOUT_FILENO :
+             open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (p.out_fd < 0)
+  {
+    fprintf(stderr, "Error: cannot open %s for writing\n", out_path);
+    if (p.in_fd != STDIN_FILENO)
+      close(p.in_fd);
+    return 0;
+  }
+  for (i = 0; i < PIPE_BUFFERS; ++i)
+    ok = (p.bufs[i] = (unsigned char*)malloc(PIPE_CHUNK)) != NULL && ok;
+  if (!ok)
+    fprintf(stderr, "Error: cannot allocate output buffers\n");
+
+#ifndef YAY0_NO_THREADS
+  if (ok && pthread_mutex_init(&p.lock, NULL) == 0)
+  {
+    if (pthread_cond_init(&p.cond, NULL) == 0)
+    {
+      /* Either stage runs inline if its thread cannot be started */
+      p.reader_thread = 1;
+      if (pthread_create(&reader, NULL, pipe_reader, &p) != 0)
+        p.reader_thread = 0;
+      p.writer_thread = pthread_create(&writer, NULL, pipe_writer, &p) == 0;
+      ok = pipe_decode(&p, &size);
+      if (p.writer_thread)
+        pthread_join(writer, NULL);
+      if (p.reader_thread)
+      {
+        /* Input may go on past the end of the file, or never end */
+        pthread_cancel(reader);
+        pthread_join(reader, NULL);
+      }
+      pthread_cond_destroy(&p.cond);
+    }
+    else
+      ok = pipe_decode(&p, &size);
+    pthread_mutex_destroy(&p.lock);
+  }
+  else
+#endif
+  if (ok)
+    ok = pipe_decode(&p, &size);
+
+  if (ok && p.written != size)
+  {
+    fprintf(stderr, "Error: decompression failed (code %d)\n",
+            (int)YAY0_ERR_FORMAT);
+    ok = 0;
+  }
+  *output_size = p.written;
+
+  for (i = 0; i < PIPE_BUFFERS; ++i)
+    free(p.bufs[i]);
+  for (size = 0; size < p.nchunks; ++size)
+    free(p.chunks[size]);
+  free(p.chunks);
+  if (p.in_fd != STDIN_FILENO)
+    close(p.in_fd);
+  if (!to_stdout && close(p.out_fd) != 0 && ok)
+  {
+    fprintf(stderr, "Error: failed to write to %s\n", out_path);
+    ok = 0;
+  }
+  if (!ok && !to_stdout)
+    remove(out_path);
+
+  return ok;
+}
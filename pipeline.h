@@ -0,0 +1,23 @@
+#ifndef YAY0_PIPELINE_H
+#define YAY0_PIPELINE_H
+
+#include <stddef.h>
+
+/**
+ * Decodes in_path to out_path, either of which may be "-" for stdin or
+ * stdout, as three stages running side by side: one thread reads input as
+ * it arrives, the calling thread runs the streaming decoder, and another
+ * writes output in chunks through a small fixed set of buffers. Decoded
+ * bytes are handed to the writer whenever the decoder has to wait for
+ * input, so nothing sits in the pipeline longer than needed.
+ *
+ * The raw stream comes last in a Yay0 file, so the compressed input is
+ * kept in memory until the end; the output never is. Yaz0 and MIO0 input
+ * is read whole and decoded in one go instead. Builds without
+ * threads run the stages in turn. Returns 0 on failure, after printing
+ * the reason, and sets *output_size to the number of bytes written.
+ */
+int pipeline_decode(const char *in_path, const char *out_path,
+  size_t *output_size);
+
+#endif
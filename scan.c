@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200112L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fileio.h"
+#include "scan.h"
+#include "yay0.h"
+#include "yay0_sys.h"
+
+/* Most bytes one flag bit can stand for */
+#define SCAN_MAX_RUN 273u
+
+typedef struct
+{
+  size_t offset;
+  size_t packed;
+  size_t size;
+  int ok;
+} scan_blob_t;
+
+typedef struct
+{
+  const unsigned char *image;
+  const char *outdir;
+  scan_blob_t *blobs;
+  /* Blobs in the order workers pick them up, largest first */
+  size_t *order;
+} scan_job_t;
+
+static unsigned long scan_be32(const unsigned char *p)
+{
+  return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+         ((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+/**
+ * Header checks that turn away almost every stray "Yay0" before walking
+ * its tokens. Encoders lay the file out as header, whole 32-bit flag
+ * words, 16-bit tokens, raw bytes, and the flag words must have enough
+ * bits to cover the decompressed size.
+ */
+static int scan_header_ok(const unsigned char *p, size_t avail)
+{
+  unsigned long size, comp_off, raw_off;
+
+  if (avail < 16)
+    return 0;
+  size = scan_be32(p + 4);
+  comp_off = scan_be32(p + 8);
+  raw_off = scan_be32(p + 12);
+
+  return size && comp_off >= 16 && comp_off <= raw_off && raw_off <= avail &&
+         (comp_off & 3) == 0 && ((raw_off - comp_off) & 1) == 0 &&
+         (size - 1) / (SCAN_MAX_RUN * 8) < comp_off - 16;
+}
+
+/* Find every Yay0 file in the image, skipping over the ones found */
+static scan_blob_t *scan_image(const unsigned char *image, size_t size,
+  size_t *count)
+{
+  scan_blob_t *blobs = NULL, *grown;
+  size_t cap = 0, pos = 0, packed, unpacked;
+  const unsigned char *hit;
+
+  *count = 0;
+  while (pos + 16 <= size &&
+         (hit = (const unsigned char*)memchr(image + pos, 'Y',
+                                             size - pos - 15)) != NULL)
+  {
+    size_t off = (size_t)(hit - image);
+
+    pos = off + 1;
+    if (memcmp(hit, "Yay0", 4) != 0 || !scan_header_ok(hit, size - off) ||
+        yay0_measure(hit, size - off, &packed, &unpacked) != YAY0_OK)
+      continue;
+
+    if (*count == cap)
+    {
+      cap = cap ? cap * 2 : 64;
+      grown = (scan_blob_t*)realloc(blobs, cap * sizeof(scan_blob_t));
+      if (!grown)
+      {
+        fprintf(stderr, "Error: out of memory\n");
+        free(blobs);
+        return NULL;
+      }
+      blobs = grown;
+    }
+    blobs[*count].offset = off;
+    blobs[*count].packed = packed;
+    blobs[*count].size = unpacked;
+    blobs[*count].ok = 0;
+    ++*count;
+    /* Anything inside a file is its data, not another file */
+    pos = off + packed;
+  }
+  if (!blobs)
+    blobs = (scan_blob_t*)malloc(sizeof(scan_blob_t));
+
+  return blobs;
+}
+
+static void scan_extract(void *arg, size_t index, unsigned int worker)
+{
+  scan_job_t *job = (scan_job_t*)arg;
+  scan_blob_t *blob = &job->blobs[job->order[index]];
+  size_t size = blob->size;
+  mapped_file_t out;
+  char path[4096];
+
+  (void)worker;
+  if (strlen(job->outdir) > sizeof(path) - 32)
+    return;
+  sprintf(path, "%s/%08lx.bin", job->outdir, (unsigned long)blob->offset);
+  if (!map_output(path, size, &out))
+    return;
+  if (yay0_decompress(job->image + blob->offset, blob->packed, out.data,
+                      &size) != YAY0_OK)
+  {
+    fprintf(stderr, "Error: failed to decode the file at 0x%lx\n",
+            (unsigned long)blob->offset);
+    close_output(path, &out, 0, 0);
+    return;
+  }
+  blob->ok = close_output(path, &out, size, 1);
+}
+
+static const scan_blob_t *scan_sort_base;
+
+static int scan_by_size(const void *a, const void *b)
+{
+  size_t x = *(const size_t*)a, y = *(const size_t*)b;
+
+  if (scan_sort_base[x].size != scan_sort_base[y].size)
+    return scan_sort_base[x].size < scan_sort_base[y].size ? 1 : -1;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Index of the files found: offset, compressed size, decompressed size */
+static void scan_write_index(FILE *f, const scan_blob_t *blobs, size_t count)
+{
+  size_t i;
+
+  fprintf(f, "offset\tcompressed\tdecompressed\n");
+  for (i = 0; i < count; ++i)
+    fprintf(f, "0x%08lx\t%lu\t%lu\n", (unsigned long)blobs[i].offset,
+            (unsigned long)blobs[i].packed, (unsigned long)blobs[i].size);
+}
+
+int scan_main(int argc, char **argv, unsigned int threads)
+{
+  const char *outdir = argc > 1 ? argv[1] : NULL;
+  scan_blob_t *blobs;
+  scan_job_t job;
+  mapped_file_t image;
+  size_t count, i, failed = 0, total = 0;
+  double start, scanned;
+  char path[4096];
+  FILE *index;
+
+  if (argc < 1 || argc > 2)
+  {
+    fprintf(stderr, "Usage: scan <image> [outdir]\n");
+    return 1;
+  }
+  if (!map_input(argv[0], &image))
+    return 1;
+
+  start = yay0_time_now();
+  blobs = scan_image(image.data, image.size, &count);
+  scanned = yay0_time_now() - start;
+  if (!blobs)
+  {
+    unmap_file(&image);
+    return 1;
+  }
+
+  if (!outdir)
+  {
+    scan_write_index(stdout, blobs, count);
+    for (i = 0; i < count; ++i)
+      total += blobs[i].size;
+  }
+  else
+  {
+    job.order = (size_t*)malloc((count + 1) * sizeof(size_t));
+    if (!job.order || (mkdir(outdir, 0777) != 0 && errno != EEXIST) ||
+        strlen(outdir) > sizeof(path) - 32)
+    {
+      fprintf(stderr, "Error: cannot create directory %s\n", outdir);
+      failed = count ? count : 1;
+    }
+    else
+    {
+      job.image = image.data;
+      job.outdir = outdir;
+      job.blobs = blobs;
+      for (i = 0; i < count; ++i)
+        job.order[i] = i;
+      scan_sort_base = blobs;
+      qsort(job.order, count, sizeof(size_t), scan_by_size);
+      yay0_parallel_for(threads, count, scan_extract, &job);
+
+      for (i = 0; i < count; ++i)
+      {
+        if (blobs[i].ok)
+          total += blobs[i].size;
+        else
+          ++failed;
+      }
+      sprintf(path, "%s/index.tsv", outdir);
+      index = fopen(path, "w");
+      if (!index)
+      {
+        fprintf(stderr, "Error: cannot open %s for writing\n", path);
+        ++failed;
+      }
+      else
+      {
+        scan_write_index(index, blobs, count);
+        fclose(index);
+      }
+    }
+    free(job.order);
+  }
+
+  fprintf(outdir ? stdout : stderr,
+          "Found %lu Yay0 files (%lu bytes decompressed) in %s in %.1f ms",
+          (unsigned long)count, (unsigned long)total, argv[0],
+          scanned * 1000.0);
+  if (outdir)
+    printf(", extracted to %s in %.1f ms, %lu failed",
+           outdir, (yay0_time_now() - start - scanned) * 1000.0,
+           (unsigned long)failed);
+  fprintf(outdir ? stdout : stderr, "\n");
+
+  free(blobs);
+  unmap_file(&image);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,12 @@
+#ifndef YAY0_SCAN_H
+#define YAY0_SCAN_H
+
+/**
+ * Runs "scan <image> [outdir]", with argv pointing at the image path.
+ * Lists every Yay0 file found inside the image and, given an output
+ * directory, extracts them there on 'threads' workers (0 for one per CPU)
+ * along with an index. Returns the process exit code.
+ */
+int scan_main(int argc, char **argv, unsigned int threads);
+
+#endif
@@ -0,0 +1,421 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "server.h"
+#include "yay0.h"
+#include "yay0_sys.h"
+
+/* Largest request accepted: the mode, level and two paths */
+#define SERVER_REQUEST_MAX 16384u
+
+/* Seconds a client may take to send its request */
+#define SERVER_TIMEOUT 10
+
+/* Status for failures outside the codec, such as unreadable files */
+#define SERVER_ERR_IO (-1)
+
+typedef struct
+{
+  yay0_encoder_t *enc;
+  /* Level the context was last set up for, -1 before the first encode */
+  int level;
+  /* Output buffer for encodes, kept at the largest size needed so far */
+  unsigned char *buf;
+  size_t cap;
+  unsigned long requests;
+  unsigned long failed;
+} server_worker_t;
+
+typedef struct
+{
+  int fd;
+  /* Set by the worker that takes a stop request */
+  volatile int stop;
+  server_worker_t *workers;
+} server_t;
+
+/* Either end of a connection: move exactly len bytes or fail */
+static int server_read_full(int fd, void *data, size_t len)
+{
+  unsigned char *p = (unsigned char*)data;
+  ssize_t n;
+
+  while (len)
+  {
+    n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    len -= (size_t)n;
+  }
+
+  return 1;
+}
+
+static int server_write_full(int fd, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char*)data;
+  ssize_t n;
+
+  while (len)
+  {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    len -= (size_t)n;
+  }
+
+  return 1;
+}
+
+static int server_address(const char *path, struct sockaddr_un *addr)
+{
+  size_t len = strlen(path);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (len >= sizeof(addr->sun_path))
+  {
+    fprintf(stderr, "Error: socket path too long: %s\n", path);
+    return 0;
+  }
+  memcpy(addr->sun_path, path, len + 1);
+
+  return 1;
+}
+
+static int server_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (!server_address(path, &addr))
+    return -1;
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+
+  return fd;
+}
+
+static int server_encode(server_worker_t *w, int level, const char *in,
+  const char *out, size_t *in_size, size_t *out_size)
+{
+  mapped_file_t input;
+  yay0_params params;
+  size_t bound;
+  int ret;
+
+  if (!map_input(in, &input))
+    return SERVER_ERR_IO;
+  *in_size = input.size;
+
+  if (w->level != level)
+  {
+    yay0_params_init(&params, level);
+    yay0_encoder_set_params(w->enc, &params);
+    w->level = level;
+  }
+  bound = yay0_compress_bound(input.size);
+  if (bound > w->cap)
+  {
+    unsigned char *grown = (unsigned char*)realloc(w->buf, bound);
+
+    if (!grown)
+    {
+      unmap_file(&input);
+      return YAY0_ERR_FORMAT;
+    }
+    w->buf = grown;
+    w->cap = bound;
+  }
+
+  ret = yay0_compress_ctx_to(w->enc, input.data, input.size, w->buf, w->cap,
+                             out_size);
+  unmap_file(&input);
+  if (ret == YAY0_OK && !write_file(out, w->buf, *out_size))
+    ret = SERVER_ERR_IO;
+
+  return ret;
+}
+
+static int server_decode(const char *in, const char *out, size_t *in_size,
+  size_t *out_size)
+{
+  mapped_file_t input, output;
+  int ret;
+
+  if (!map_input(in, &input))
+    return SERVER_ERR_IO;
+  *in_size = input.size;
+
+  /* Only trust the header's size once the tokens can produce it */
+  ret = yay0_measure_any(input.data, input.size, NULL, NULL, out_size);
+  if (ret == YAY0_OK && !map_output_over(out, in, *out_size, &output))
+    ret = SERVER_ERR_IO;
+  else if (ret == YAY0_OK)
+  {
+    ret = yay0_decompress_any(input.data, input.size, output.data, out_size);
+    if (!close_output(out, &output, *out_size, ret == YAY0_OK) &&
+        ret == YAY0_OK)
+      ret = SERVER_ERR_IO;
+  }
+  unmap_file(&input);
+
+  return ret;
+}
+
+/**
+ * One request per connection: a 4-byte big-endian length, then the mode,
+ * level, input and output path, each ending in a NUL. The answer is one
+ * line, "<status> <input size> <output size>", where status is a
+ * yay0_result or SERVER_ERR_IO.
+ */
+static void server_handle(server_t *srv, server_worker_t *w, int fd)
+{
+  unsigned char len_be[4];
+  char request[SERVER_REQUEST_MAX + 1], reply[64];
+  const char *field[4];
+  size_t len, pos = 0, in_size = 0, out_size = 0;
+  unsigned int n;
+  int ret = YAY0_ERR_FORMAT;
+
+  if (!server_read_full(fd, len_be, 4))
+    return;
+  len = ((size_t)len_be[0] << 24) | ((size_t)len_be[1] << 16) |
+        ((size_t)len_be[2] << 8) | (size_t)len_be[3];
+  if (len > SERVER_REQUEST_MAX || !server_read_full(fd, request, len))
+    return;
+  request[len] = '\0';
+  for (n = 0; n < 4; ++n)
+  {
+    field[n] = request + pos;
+    while (pos < len && request[pos])
+      ++pos;
+    if (pos < len)
+      ++pos;
+  }
+
+  ++w->requests;
+  if (strcmp(field[0], "stop") == 0)
+  {
+    ret = YAY0_OK;
+    srv->stop = 1;
+    /* Wakes every worker blocked in accept */
+    shutdown(srv->fd, SHUT_RDWR);
+  }
+  else if (strcmp(field[0], "encode") == 0 && *field[2] && *field[3])
+    ret = server_encode(w, atoi(field[1]), field[2], field[3], &in_size,
+                        &out_size);
+  else if (strcmp(field[0], "decode") == 0 && *field[2] && *field[3])
+    ret = server_decode(field[2], field[3], &in_size, &out_size);
+  if (ret != YAY0_OK)
+    ++w->failed;
+
+  sprintf(reply, "%d %lu %lu\n", ret, (unsigned long)in_size,
+          (unsigned long)out_size);
+  server_write_full(fd, reply, strlen(reply));
+}
+
+/* Each worker takes connections off the shared socket until stopped */
+static void server_worker(void *arg, size_t index, unsigned int worker)
+{
+  server_t *srv = (server_t*)arg;
+  server_worker_t *w = &srv->workers[worker];
+  struct timeval timeout;
+  int fd;
+
+  (void)index;
+  while (!srv->stop)
+  {
+    fd = accept(srv->fd, NULL, NULL);
+    if (fd < 0)
+    {
+      if (!srv->stop && (errno == EINTR || errno == ECONNABORTED))
+        continue;
+      break;
+    }
+    /* A stalled client only ties up its worker for so long */
+    timeout.tv_sec = SERVER_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    server_handle(srv, w, fd);
+    close(fd);
+  }
+}
+
+int server_main(int argc, char **argv, unsigned int threads)
+{
+  struct sockaddr_un addr;
+  server_t srv;
+  unsigned long requests = 0, failed = 0;
+  unsigned int t;
+  int fd, ok = 1;
+
+  if (argc != 1)
+  {
+    fprintf(stderr, "Usage: serve <socket>\n");
+    return 1;
+  }
+  if (!server_address(argv[0], &addr))
+    return 1;
+
+  /* A socket file nobody answers on is left over from an earlier run */
+  fd = server_connect(argv[0]);
+  if (fd >= 0)
+  {
+    close(fd);
+    fprintf(stderr, "Error: a server is already listening on %s\n", argv[0]);
+    return 1;
+  }
+  unlink(argv[0]);
+
+  memset(&srv, 0, sizeof(srv));
+  srv.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (srv.fd < 0 || bind(srv.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(srv.fd, 128) != 0)
+  {
+    fprintf(stderr, "Error: cannot listen on %s\n", argv[0]);
+    if (srv.fd >= 0)
+      close(srv.fd);
+    return 1;
+  }
+  /* Clients that hang up early must not take the server down */
+  signal(SIGPIPE, SIG_IGN);
+
+  threads = yay0_parallel_threads(threads, (size_t)-1);
+  srv.workers = (server_worker_t*)calloc(threads, sizeof(server_worker_t));
+  ok = srv.workers != NULL;
+  for (t = 0; ok && t < threads; ++t)
+  {
+    srv.workers[t].enc = yay0_encoder_create();
+    srv.workers[t].level = -1;
+    ok = srv.workers[t].enc != NULL;
+  }
+
+  if (ok)
+  {
+    printf("Serving on %s with %u threads\n", argv[0], threads);
+    fflush(stdout);
+    yay0_parallel_for(threads, threads, server_worker, &srv);
+  }
+
+  close(srv.fd);
+  unlink(argv[0]);
+  if (srv.workers)
+    for (t = 0; t < threads; ++t)
+    {
+      requests += srv.workers[t].requests;
+      failed += srv.workers[t].failed;
+      yay0_encoder_destroy(srv.workers[t].enc);
+      free(srv.workers[t].buf);
+    }
+  free(srv.workers);
+  if (ok)
+    printf("Served %lu requests, %lu failed\n", requests, failed);
+
+  return ok ? 0 : 1;
+}
+
+/* Paths go to a server with another working directory, so make them absolute */
+static size_t server_put_path(char *dst, size_t room, const char *path)
+{
+  size_t len = strlen(path), cwd_len = 0;
+
+  if (path[0] != '/')
+  {
+    if (!getcwd(dst, room))
+      return 0;
+    cwd_len = strlen(dst);
+    if (cwd_len + 1 >= room)
+      return 0;
+    dst[cwd_len++] = '/';
+  }
+  if (cwd_len + len + 1 > room)
+    return 0;
+  memcpy(dst + cwd_len, path, len + 1);
+
+  return cwd_len + len + 1;
+}
+
+int server_request(const char *socket_path, const char *mode, int level,
+  const char *in, const char *out)
+{
+  unsigned char request[4 + SERVER_REQUEST_MAX];
+  char reply[64];
+  size_t len, n, pos = 0;
+  unsigned long in_size = 0, out_size = 0;
+  int fd, ret = SERVER_ERR_IO, stop = strcmp(mode, "stop") == 0;
+
+  fd = server_connect(socket_path);
+  if (fd < 0)
+    return -1;
+
+  len = strlen(mode) + 1;
+  memcpy(request + 4, mode, len);
+  len += (size_t)sprintf((char*)request + 4 + len, "%d", level) + 1;
+  if (!stop)
+  {
+    n = server_put_path((char*)request + 4 + len, SERVER_REQUEST_MAX - len, in);
+    len += n;
+    n = n ? server_put_path((char*)request + 4 + len, SERVER_REQUEST_MAX - len, out)
+          : 0;
+    len += n;
+    if (!n)
+    {
+      fprintf(stderr, "Error: paths too long for the server\n");
+      close(fd);
+      return 1;
+    }
+  }
+  request[0] = (unsigned char)(len >> 24);
+  request[1] = (unsigned char)(len >> 16);
+  request[2] = (unsigned char)(len >> 8);
+  request[3] = (unsigned char)len;
+
+  /* Read the one-line reply up to the server closing the connection */
+  if (server_write_full(fd, request, 4 + len))
+  {
+    while (pos + 1 < sizeof(reply) && server_read_full(fd, reply + pos, 1) &&
+           reply[pos] != '\n')
+      ++pos;
+    reply[pos] = '\0';
+    if (sscanf(reply, "%d %lu %lu", &ret, &in_size, &out_size) != 3)
+      ret = SERVER_ERR_IO;
+  }
+  close(fd);
+
+  if (ret != YAY0_OK)
+  {
+    fprintf(stderr, "Error: server failed to %s %s (code %d)\n", mode,
+            stop ? socket_path : in, ret);
+    return 1;
+  }
+  if (stop)
+    printf("Stopped server on %s\n", socket_path);
+  else if (strcmp(mode, "encode") == 0)
+    printf("Compressed %s -> %s (%lu bytes)\n", in, out, out_size);
+  else
+    printf("Decompressed %s -> %s (%lu bytes)\n", in, out, out_size);
+
+  return 0;
+}
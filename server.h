@@ -0,0 +1,21 @@
+#ifndef YAY0_SERVER_H
+#define YAY0_SERVER_H
+
+/**
+ * Runs "serve <socket>": listens on a Unix domain socket and handles
+ * encode and decode requests naming files until asked to stop, on
+ * 'threads' workers (0 for one per CPU) that each keep their encoder
+ * context and output buffer between requests. Returns the process exit
+ * code.
+ */
+int server_main(int argc, char **argv, unsigned int threads);
+
+/**
+ * Has the server at socket_path run "encode" or "decode" from in to out
+ * at the given level, or "stop", printing what the local tool would.
+ * Returns the process exit code, or -1 if no server answered.
+ */
+int server_request(const char *socket_path, const char *mode, int level,
+  const char *in, const char *out);
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "yay0.h"
+#include "yay0_sys.h"
 
 static const unsigned char dec_data[] = "MP7 is an absolute mess. The boards are gimmicky again, but this time there's more bad gimmicks than good. The boards are either effective but boring, like Grand Canal and Bowser's Enchanted Inferno, or held back by either a bad gimmick or Bowser Time. The bonus stars are randomly chosen from a pool of 6, which makes one of the most strategic elements of the series dependent on random chance. Rewards for duels are decided by roulette after the minigame is over, which can potentially give you nothing, and will never give you stars. Bowser Time is a random penalty that absolutely destroys the strategy of some boards, notably Windmillville and Neon Heights, severely shaking up what it means to have a lead and plan around the board gimmick. Mic spaces function as a free doubling of your coins when on, and as worthless spaces that only waste time playing the same animation when off. Mic games turned on don't tell you to press R to make buttons show up, and turned off the variety of minigames is reduced. Character-specific orbs create a tier list, and with only 2 characters per orb that means that a 4 player game will be imbalanced from the start no matter what. Good items like Flutter Orbs can be as cheap as 5 coins in a shop and aren't horribly rare. As is the case in the previous couple games, coins earned from battle minigames influence coin star total, but the random bonus stars offset this effect (the \"idiot savant\" school of balance).";
 
@@ -85,6 +86,1224 @@ unsigned char enc_data[] = {
   0x34, 0x00, 0xe3, 0xd6, 0x9b, 0x40, 0x1f, 0xff, 0xd9, 0x00
 };
 
+/* Compress with the given context and check the data decompresses back */
+static int roundtrip(yay0_encoder_t *enc, const uint8_t *src, size_t size)
+{
+  uint8_t *comp = NULL, *dec;
+  size_t comp_size, dec_size = size;
+  int ok;
+
+  if (yay0_compress_ctx(enc, src, size, &comp, &comp_size) != YAY0_OK)
+    return 0;
+  dec = (uint8_t*)malloc(size + 1);
+  ok = dec && yay0_decompress(comp, comp_size, dec, &dec_size) == YAY0_OK &&
+       dec_size == size && memcmp(dec, src, size) == 0;
+  free(comp);
+  free(dec);
+
+  return ok;
+}
+
+/* Hash chain match finder at a few depths, including the default */
+static int test_chain_search(void)
+{
+  static const unsigned int depths[] = { 0, 1, 16, 4096 };
+  yay0_encoder_t *enc = yay0_encoder_create();
+  unsigned int i;
+  int ok = enc != NULL;
+
+  for (i = 0; ok && i < sizeof(depths) / sizeof(depths[0]); ++i)
+  {
+    yay0_encoder_set_search(enc, YAY0_SEARCH_CHAIN, depths[i]);
+    ok = roundtrip(enc, dec_data, sizeof(dec_data));
+  }
+  yay0_encoder_destroy(enc);
+  printf("Hash chain round trip %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+static uint32_t test_rng = 1;
+
+static unsigned int test_rand(void)
+{
+  test_rng = test_rng * 1103515245u + 12345u;
+  return (unsigned int)(test_rng >> 16) & 0x7FFF;
+}
+
+/* Number of kinds make_corpus_entry() knows */
+#define TEST_CORPUS_KINDS 6
+
+/**
+ * Fill buf with one of several synthetic inputs meant to stress the match
+ * finder: ties between equally long matches, runs around the length limit
+ * and repeats right at the edge of the 4 KB window.
+ */
+static void make_corpus_entry(int kind, uint8_t *buf, size_t size)
+{
+  size_t i, j;
+
+  for (i = 0; i < size; ++i)
+  {
+    switch (kind)
+    {
+    case 0: /* text with small edits */
+      buf[i] = dec_data[i % (sizeof(dec_data) - 1)];
+      if (test_rand() % 97 == 0)
+        buf[i] = (uint8_t)('a' + test_rand() % 26);
+      break;
+    case 1: /* tiny alphabet, lots of tied candidates */
+      buf[i] = (uint8_t)"ab"[test_rand() % 2];
+      break;
+    case 2: /* zero fill broken up by short noise */
+      buf[i] = 0;
+      if (test_rand() % 300 == 0)
+        for (j = test_rand() % 8; j > 0 && i + 1 < size; --j)
+          buf[++i] = (uint8_t)test_rand();
+      break;
+    case 3: /* period one off either side of the window size */
+      buf[i] = i < 4095 ? (uint8_t)test_rand() :
+               buf[i - 4095 - (i / 5000) % 3];
+      break;
+    case 5: /* fills longer than the window, switching byte now and then */
+      buf[i] = (uint8_t)((i / 5000) % 2 ? 0xFF : 0);
+      if (test_rand() % 9000 == 0)
+        buf[i] = (uint8_t)test_rand();
+      break;
+    default: /* incompressible */
+      buf[i] = (uint8_t)test_rand();
+    }
+  }
+}
+
+/**
+ * The exact match finder must reproduce the Boyer-Moore scan's output byte
+ * for byte on every corpus entry, including the empty and tiny inputs.
+ */
+static int test_exact_search(void)
+{
+  static const size_t sizes[] = { 0, 1, 2, 3, 4, 5, 18, 300, 5000, 12000 };
+  yay0_encoder_t *scan = yay0_encoder_create();
+  yay0_encoder_t *exact = yay0_encoder_create();
+  uint8_t *buf = (uint8_t*)malloc(12000);
+  uint8_t *a = NULL, *b = NULL;
+  size_t a_size, b_size;
+  unsigned int kind, i;
+  int ok = scan && exact && buf;
+
+  if (ok)
+  {
+    yay0_encoder_set_search(scan, YAY0_SEARCH_SCAN, 0);
+    yay0_encoder_set_search(exact, YAY0_SEARCH_EXACT, 0);
+  }
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    for (i = 0; ok && i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+      make_corpus_entry((int)kind, buf, sizes[i]);
+      ok = yay0_compress_ctx(scan, buf, sizes[i], &a, &a_size) == YAY0_OK &&
+           yay0_compress_ctx(exact, buf, sizes[i], &b, &b_size) == YAY0_OK &&
+           a_size == b_size && memcmp(a, b, a_size) == 0;
+      if (!ok)
+        printf("Exact search differs: kind %u, %lu bytes\n", kind,
+          (unsigned long)sizes[i]);
+      free(a);
+      free(b);
+      a = b = NULL;
+    }
+  }
+
+  yay0_encoder_destroy(scan);
+  yay0_encoder_destroy(exact);
+  free(buf);
+  printf("Exact search differential %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* FNV-1a, to pin down encoder output too long to spell out */
+static uint32_t test_hash(const uint8_t *data, size_t size)
+{
+  uint32_t h = 2166136261u;
+
+  while (size--)
+    h = (h ^ *data++) * 16777619u;
+
+  return h;
+}
+
+/**
+ * Output of the encoder from before the word-at-a-time match extension
+ * and fill short cuts, which must not change it: fill-heavy inputs and
+ * repeats just past the window, at every level, one context per level.
+ * The scan and exact searchers now share their run handling, so the
+ * differential test above cannot catch a change in it on its own.
+ */
+static int test_golden(void)
+{
+  static const struct
+  {
+    int kind, level;
+    size_t size;
+    uint32_t hash;
+  } golden[] =
+  {
+    { 2, 0, 633, 0x966F66A3u },
+    { 3, 0, 10381, 0x8E05277Fu },
+    { 5, 0, 268, 0x960217EFu },
+    { 2, 1, 769, 0x5984F903u },
+    { 3, 1, 10381, 0x8E05277Fu },
+    { 5, 1, 272, 0x119F000Au },
+    { 2, 2, 764, 0xE6B0078Au },
+    { 3, 2, 10381, 0x8E05277Fu },
+    { 5, 2, 272, 0xA2F7B0CAu },
+    { 2, 3, 705, 0x83E8FB3Eu },
+    { 3, 3, 10381, 0x8E05277Fu },
+    { 5, 3, 271, 0x121702A8u },
+    { 2, 4, 701, 0x94C0B96Eu },
+    { 3, 4, 10381, 0x8E05277Fu },
+    { 5, 4, 271, 0x121702A8u },
+    { 2, 5, 695, 0x4A7910FCu },
+    { 3, 5, 10381, 0x8E05277Fu },
+    { 5, 5, 271, 0x121702A8u },
+    { 2, 6, 675, 0x1127135Du },
+    { 3, 6, 10381, 0x8E05277Fu },
+    { 5, 6, 271, 0x121702A8u },
+    { 2, 7, 636, 0xFB4BCC10u },
+    { 3, 7, 10381, 0x8E05277Fu },
+    { 5, 7, 268, 0x5F75B867u },
+    { 2, 8, 633, 0x966F66A3u },
+    { 3, 8, 10381, 0x8E05277Fu },
+    { 5, 8, 268, 0x960217EFu },
+    { 2, 9, 632, 0x6630258Au },
+    { 3, 9, 10381, 0x8E05277Fu },
+    { 5, 9, 268, 0x960217EFu }
+  };
+  /* A fill of each byte, both longer than the longest match */
+  static const uint8_t fill[] =
+  {
+    'Y', 'a', 'y', '0', 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x14,
+    0x00, 0x00, 0x00, 0x18, 0xA0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    'a', 0x15, 'b', 0x05
+  };
+  yay0_encoder_t *enc = NULL;
+  yay0_params params;
+  uint8_t *buf = (uint8_t*)malloc(20000), *out = NULL, small[64];
+  size_t out_size, i;
+  int ok = buf != NULL;
+
+  for (i = 0; ok && i < sizeof(golden) / sizeof(golden[0]); ++i)
+  {
+    if (!enc || golden[i].level != golden[i - 1].level)
+    {
+      yay0_encoder_destroy(enc);
+      enc = yay0_encoder_create();
+      yay0_params_init(&params, golden[i].level);
+      if (enc)
+        yay0_encoder_set_params(enc, &params);
+    }
+    test_rng = 22;
+    make_corpus_entry(golden[i].kind, buf, 20000);
+    ok = enc && yay0_compress_ctx(enc, buf, 20000, &out, &out_size) ==
+                  YAY0_OK &&
+         out_size == golden[i].size && test_hash(out, out_size) ==
+                                         golden[i].hash;
+    if (!ok)
+      printf("Output changed: kind %d, level %d\n", golden[i].kind,
+             golden[i].level);
+    free(out);
+    out = NULL;
+  }
+
+  memset(small, 'a', 40);
+  memset(small + 40, 'b', 24);
+  ok = ok && yay0_compress(small, 64, &out, &out_size) == YAY0_OK &&
+       out_size == sizeof(fill) && memcmp(out, fill, sizeof(fill)) == 0;
+
+  yay0_encoder_destroy(enc);
+  free(out);
+  free(buf);
+  printf("Golden output %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Optimal parse must round trip and never lose to the lazy parse */
+static int test_optimal_parse(void)
+{
+  yay0_encoder_t *lazy = yay0_encoder_create();
+  yay0_encoder_t *opt = yay0_encoder_create();
+  uint8_t *buf = (uint8_t*)malloc(12000);
+  uint8_t *a = NULL, *b = NULL;
+  size_t a_size, b_size;
+  unsigned int kind;
+  int ok = lazy && opt && buf;
+
+  if (ok)
+    yay0_encoder_set_parse(opt, YAY0_PARSE_OPTIMAL);
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry((int)kind, buf, 12000);
+    ok = roundtrip(opt, buf, 12000) &&
+         yay0_compress_ctx(lazy, buf, 12000, &a, &a_size) == YAY0_OK &&
+         yay0_compress_ctx(opt, buf, 12000, &b, &b_size) == YAY0_OK &&
+         b_size <= a_size;
+    free(a);
+    free(b);
+    a = b = NULL;
+  }
+
+  yay0_encoder_destroy(lazy);
+  yay0_encoder_destroy(opt);
+  free(buf);
+  printf("Optimal parse %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Every level round trips; the default level matches yay0_compress */
+static int test_levels(void)
+{
+  yay0_encoder_t *enc = yay0_encoder_create();
+  uint8_t *buf = (uint8_t*)malloc(12000);
+  uint8_t *a = NULL, *b = NULL;
+  size_t a_size, b_size;
+  yay0_params params;
+  int level, ok = enc && buf;
+
+  for (level = YAY0_LEVEL_DEFAULT; ok && level <= YAY0_LEVEL_MAX; ++level)
+  {
+    make_corpus_entry(level % 5, buf, 12000);
+    yay0_params_init(&params, level);
+    yay0_encoder_set_params(enc, &params);
+    ok = roundtrip(enc, buf, 12000);
+  }
+
+  yay0_params_init(&params, YAY0_LEVEL_DEFAULT);
+  ok = ok &&
+    yay0_compress(dec_data, sizeof(dec_data), &a, &a_size) == YAY0_OK &&
+    yay0_compress_ex(dec_data, sizeof(dec_data), &params, &b,
+                     &b_size) == YAY0_OK &&
+    a_size == b_size && memcmp(a, b, a_size) == 0;
+
+  free(a);
+  free(b);
+  free(buf);
+  yay0_encoder_destroy(enc);
+  printf("Compression levels %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/**
+ * Decode src through the streaming decoder, feeding input and taking output
+ * in small pseudo-random pieces. Returns the final pull result.
+ */
+static yay0_result stream_decode(yay0_decoder_t *dec, const uint8_t *src,
+  size_t size, uint8_t *out, size_t out_cap, size_t *out_size)
+{
+  yay0_result result;
+  size_t got, off, n;
+
+  yay0_decoder_reset(dec);
+  *out_size = 0;
+  for (;;)
+  {
+    n = 1 + test_rand() % 700;
+    if (n > out_cap - *out_size)
+      n = out_cap - *out_size;
+    result = yay0_decoder_pull(dec, out + *out_size, n, &got);
+    *out_size += got;
+    if (result == YAY0_NEED_INPUT)
+    {
+      off = yay0_decoder_want(dec);
+      n = 1 + test_rand() % 40;
+      if (off >= size)
+        n = 0;
+      else if (n > size - off)
+        n = size - off;
+      yay0_decoder_feed(dec, src + off, n);
+    }
+    else if (result != YAY0_OK || yay0_decoder_done(dec) ||
+             *out_size == out_cap)
+      return result;
+  }
+}
+
+/* Streaming decoder must agree with yay0_decompress, including errors */
+static int test_stream_decoder(void)
+{
+  yay0_decoder_t *dec = yay0_decoder_create();
+  uint8_t *buf = (uint8_t*)malloc(12000), *out = (uint8_t*)malloc(12000);
+  uint8_t *comp = NULL;
+  size_t comp_size, out_size;
+  unsigned int kind;
+  int ok = dec && buf && out;
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry((int)kind, buf, 12000);
+    ok = yay0_compress(buf, 12000, &comp, &comp_size) == YAY0_OK &&
+         stream_decode(dec, comp, comp_size, out, 12000,
+                       &out_size) == YAY0_OK &&
+         yay0_decoder_done(dec) && out_size == 12000 &&
+         memcmp(out, buf, 12000) == 0 &&
+         /* Cut off inside the raw stream */
+         stream_decode(dec, comp, comp_size - 1, out, 12000,
+                       &out_size) == YAY0_ERR_TRUNCATED;
+    free(comp);
+    comp = NULL;
+  }
+  ok = ok && stream_decode(dec, enc_data, sizeof(enc_data), out, 12000,
+                           &out_size) == YAY0_OK && out_size == 1038;
+
+  yay0_decoder_destroy(dec);
+  free(buf);
+  free(out);
+  printf("Streaming decoder %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/**
+ * Inputs big enough for the word-at-a-time decoder, cut off or with bits
+ * flipped, must give the same result and output as the byte-at-a-time
+ * streaming decoder, so the fast path's own bounds checks are exercised.
+ */
+static int test_fast_decode(void)
+{
+  yay0_decoder_t *dec = yay0_decoder_create();
+  uint8_t *buf = (uint8_t*)malloc(60000), *mut = NULL, *comp = NULL;
+  uint8_t *fast = (uint8_t*)malloc(60000), *slow = (uint8_t*)malloc(60000);
+  size_t comp_size = 0, size, fast_size, slow_size, pos;
+  yay0_result fast_result, slow_result;
+  unsigned int kind, i, flips = 0;
+  int ok = dec && buf && fast && slow;
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry((int)kind, buf, 60000);
+    ok = yay0_compress(buf, 60000, &comp, &comp_size) == YAY0_OK &&
+         (mut = (uint8_t*)malloc(comp_size)) != NULL;
+    for (i = 0; ok && i < 400; ++i)
+    {
+      memcpy(mut, comp, comp_size);
+      size = comp_size;
+      if (i == 0)
+        ;
+      else if (i % 4 == 0)
+        size = 16 + test_rand() % (comp_size - 16);
+      else
+      {
+        /* Leave the header alone so both decoders get past it */
+        pos = 16 + test_rand() % (comp_size - 16);
+        mut[pos] ^= (uint8_t)(1u << (test_rand() % 8));
+      }
+      fast_size = 60000;
+      fast_result = yay0_decompress(mut, size, fast, &fast_size);
+      slow_result = stream_decode(dec, mut, size, slow, 60000, &slow_size);
+      ok = fast_result == slow_result &&
+           (fast_result != YAY0_OK ||
+            (fast_size == slow_size && memcmp(fast, slow, fast_size) == 0));
+      if (!ok)
+        printf("Fast decode differs: kind %u, case %u (%d vs %d)\n", kind,
+               i, (int)fast_result, (int)slow_result);
+      flips += fast_result != YAY0_OK;
+    }
+    free(mut);
+    mut = NULL;
+    free(comp);
+    comp = NULL;
+  }
+
+  yay0_decoder_destroy(dec);
+  free(buf);
+  free(fast);
+  free(slow);
+  printf("Fast decoder matches careful decode (%u failing inputs) %s\n",
+         flips, ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Compressing into caller memory gives the same bytes as yay0_compress */
+static int test_compress_to(void)
+{
+  uint8_t *buf = (uint8_t*)malloc(12000);
+  uint8_t *out = (uint8_t*)malloc(yay0_compress_bound(12000));
+  size_t scratch_size = yay0_compress_scratch_size(12000);
+  void *scratch = malloc(scratch_size);
+  yay0_encoder_t *enc = yay0_encoder_create_in(scratch, scratch_size, 12000,
+    NULL);
+  uint8_t *ref = NULL;
+  size_t ref_size, written;
+  unsigned int kind;
+  int ok = buf && out && enc &&
+           !yay0_encoder_create_in(scratch, scratch_size - 1, 12000, NULL);
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry((int)kind, buf, 12000);
+    ok = yay0_compress(buf, 12000, &ref, &ref_size) == YAY0_OK &&
+         ref_size <= yay0_compress_bound(12000) &&
+         yay0_compress_to(buf, 12000, out, yay0_compress_bound(12000),
+                          &written) == YAY0_OK &&
+         written == ref_size && memcmp(out, ref, ref_size) == 0 &&
+         yay0_compress_ctx_to(enc, buf, 12000, out, ref_size,
+                              &written) == YAY0_OK &&
+         written == ref_size && memcmp(out, ref, ref_size) == 0 &&
+         yay0_compress_ctx_to(enc, buf, 12000, out, ref_size - 1,
+                              &written) == YAY0_ERR_OUTPUT_SMALL;
+    free(ref);
+    ref = NULL;
+  }
+
+  yay0_encoder_destroy(enc);
+  free(scratch);
+  free(buf);
+  free(out);
+  printf("Compress into caller memory %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Block-parallel encodes round trip and do not depend on the thread count */
+static int test_blocks(void)
+{
+  uint8_t *buf = (uint8_t*)malloc(40000), *dec = (uint8_t*)malloc(40000);
+  uint8_t *a = NULL, *b = NULL;
+  size_t a_size, b_size, dec_size;
+  yay0_params params;
+  unsigned int kind;
+  int level, ok = buf && dec;
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    /* Levels that parse the two different ways */
+    for (level = 6; ok && level <= 9; level += 3)
+    {
+      make_corpus_entry((int)kind, buf, 40000);
+      yay0_params_init(&params, level);
+      params.block_size = 4096 + kind * 1000;
+      params.threads = 1;
+      ok = yay0_compress_ex(buf, 40000, &params, &a, &a_size) == YAY0_OK;
+      params.threads = 4;
+      ok = ok &&
+        yay0_compress_ex(buf, 40000, &params, &b, &b_size) == YAY0_OK &&
+        a_size == b_size && memcmp(a, b, a_size) == 0;
+      dec_size = 40000;
+      ok = ok && yay0_decompress(a, a_size, dec, &dec_size) == YAY0_OK &&
+           dec_size == 40000 && memcmp(dec, buf, 40000) == 0;
+      free(a);
+      free(b);
+      a = b = NULL;
+    }
+  }
+
+  free(buf);
+  free(dec);
+  printf("Block-parallel compression %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* yay0_measure finds the end of a file followed by other data */
+static int test_measure(void)
+{
+  uint8_t *buf = (uint8_t*)malloc(20000), *out = NULL, *padded = NULL;
+  size_t out_size = 0, packed, size;
+  int ok = buf != NULL;
+
+  if (ok)
+  {
+    make_corpus_entry(1, buf, 20000);
+    ok = yay0_compress(buf, 20000, &out, &out_size) == YAY0_OK;
+  }
+  padded = ok ? (uint8_t*)malloc(out_size + 100) : NULL;
+  ok = ok && padded;
+  if (ok)
+  {
+    memcpy(padded, out, out_size);
+    memset(padded + out_size, 0xA5, 100);
+    ok = yay0_measure(padded, out_size + 100, &packed, &size) == YAY0_OK &&
+         packed == out_size && size == 20000 &&
+         yay0_measure(padded, out_size - 1, &packed, &size) ==
+           YAY0_ERR_TRUNCATED;
+    /* A first token reaching back before the start of the output */
+    padded[16] &= 0x7F;
+    ok = ok && yay0_measure(padded, out_size + 100, &packed, &size) ==
+                 YAY0_ERR_BACKREF;
+  }
+
+  free(buf);
+  free(out);
+  free(padded);
+  printf("Measure %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Ranges decoded through an index, fresh and reloaded, match a full decode */
+static int test_range(void)
+{
+  const size_t size = 150000;
+  uint8_t *buf = (uint8_t*)malloc(size), *part = (uint8_t*)malloc(size);
+  uint8_t *out = NULL, *saved = NULL;
+  size_t out_size = 0, saved_size = 0, off, len;
+  yay0_index_t *index = NULL, *loaded = NULL, *bad = NULL;
+  yay0_arena arena;
+  uint8_t bogus[64];
+  int i, kind, ok = buf && part;
+
+  if (ok)
+  {
+    make_corpus_entry(4, buf, size);
+    ok = yay0_compress(buf, size, &out, &out_size) == YAY0_OK &&
+         yay0_index_build(out, out_size, 4096, &index) == YAY0_OK;
+  }
+  if (ok)
+  {
+    saved = (uint8_t*)malloc(yay0_index_serialized_size(index));
+    ok = saved &&
+         yay0_index_save(index, saved, yay0_index_serialized_size(index),
+                         &saved_size) == YAY0_OK &&
+         yay0_index_load(saved, saved_size, &loaded) == YAY0_OK;
+  }
+
+  test_rng = 7;
+  for (i = 0; ok && i < 200; ++i)
+  {
+    off = (size_t)test_rand() * 5 % size;
+    len = i < 100 ? (size_t)test_rand() % 300 : (size_t)test_rand() * 3 % 20000;
+    if (len > size - off)
+      len = size - off;
+    ok = yay0_decompress_range(out, out_size, i & 1 ? index : loaded, off,
+                               len, part) == YAY0_OK &&
+         memcmp(part, buf + off, len) == 0;
+  }
+  ok = ok &&
+    yay0_decompress_range(out, out_size, index, 0, size, part) == YAY0_OK &&
+    memcmp(part, buf, size) == 0 &&
+    yay0_decompress_range(out, out_size, index, size - 1, 2, part) ==
+      YAY0_ERR_OUTPUT_SMALL &&
+    yay0_index_load(saved, saved_size - 1, &bad) == YAY0_ERR_TRUNCATED;
+
+  /* Windows carried from checkpoint to checkpoint, on data that reaches
+   * back into them */
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    yay0_index_destroy(index);
+    index = NULL;
+    free(out);
+    out = NULL;
+    make_corpus_entry(kind, buf, size);
+    ok = yay0_compress(buf, size, &out, &out_size) == YAY0_OK &&
+         yay0_index_build(out, out_size, 5000, &index) == YAY0_OK;
+    for (off = 0; ok && off < size; off += 4999)
+    {
+      len = size - off < 300 ? size - off : 300;
+      ok = yay0_decompress_range(out, out_size, index, off, len, part) ==
+             YAY0_OK && memcmp(part, buf + off, len) == 0;
+    }
+  }
+
+  /* A header claiming far more output fails the walk, before anything
+   * is allocated for it */
+  memcpy(bogus, "Yay0\xF0\0\0\0\0\0\0\x14\0\0\0\x14\0\0\0\0", 20);
+  yay0_arena_init(&arena, bogus + 20, sizeof(bogus) - 20);
+  yay0_set_allocator(&arena.allocator);
+  ok = ok && yay0_index_build(bogus, 20, 0, &bad) == YAY0_ERR_TRUNCATED &&
+       arena.peak == 0;
+  yay0_set_allocator(NULL);
+
+  yay0_index_destroy(index);
+  yay0_index_destroy(loaded);
+  free(buf);
+  free(part);
+  free(out);
+  free(saved);
+  printf("Range decompression %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Segmented parallel decoding gives the same output as the serial decoder */
+static int test_parallel_decode(void)
+{
+  const size_t size = 120000;
+  uint8_t *buf = (uint8_t*)malloc(size), *dec = (uint8_t*)malloc(size);
+  uint8_t *out = NULL;
+  size_t out_size, dec_size, segment;
+  int kind, ok = buf && dec;
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry(kind, buf, size);
+    ok = yay0_compress(buf, size, &out, &out_size) == YAY0_OK;
+    for (segment = 4096; ok && segment < size; segment = segment * 3 + 17)
+    {
+      memset(dec, 0, size);
+      dec_size = size;
+      ok = yay0_decompress_parallel(out, out_size, dec, &dec_size, 3,
+                                    segment) == YAY0_OK &&
+           dec_size == size && memcmp(dec, buf, size) == 0;
+    }
+    /* Errors found by the pre-scan */
+    dec_size = size;
+    ok = ok && yay0_decompress_parallel(out, out_size - 1, dec, &dec_size, 3,
+                                        4096) == YAY0_ERR_TRUNCATED;
+    free(out);
+    out = NULL;
+  }
+
+  free(buf);
+  free(dec);
+  printf("Parallel decompression %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Small similar inputs shrink with a trained dictionary and decode back */
+static int test_dict(void)
+{
+  uint8_t samples[8][300], *out = NULL, *plain = NULL, dict[5000], dec[300];
+  const uint8_t *ptrs[8];
+  size_t sizes[8], dict_size, out_size, plain_size, dec_size, i, j;
+  size_t scratch_size, written;
+  yay0_params params;
+  yay0_encoder_t *enc;
+  void *scratch = NULL;
+  int level, ok;
+
+  /* A shared header and a few shared phrases among per-asset noise */
+  for (i = 0; i < 8; ++i)
+  {
+    memcpy(samples[i], dec_data + 40, 120);
+    for (j = 120; j < 300; ++j)
+      samples[i][j] = (uint8_t)test_rand();
+    memcpy(samples[i] + 160 + i * 4, dec_data + 500, 60);
+    ptrs[i] = samples[i];
+    sizes[i] = 300;
+  }
+  ok = yay0_dict_train(ptrs, sizes, 7, dict, sizeof(dict), &dict_size) ==
+         YAY0_OK && dict_size > 0 && dict_size <= YAY0_DICT_SIZE_MAX &&
+       yay0_compress(samples[7], 300, &plain, &plain_size) == YAY0_OK;
+
+  for (level = 0; ok && level <= 9; level += 3)
+  {
+    yay0_params_init(&params, level);
+    params.dict = dict;
+    params.dict_size = dict_size;
+    /* Also split into blocks, where only the first one sees the dictionary */
+    params.block_size = level == 6 ? 100 : 0;
+    dec_size = sizeof(dec);
+    ok = yay0_compress_ex(samples[7], 300, &params, &out, &out_size) ==
+           YAY0_OK && out_size + 100 < plain_size &&
+         yay0_decompress_dict(out, out_size, dict, dict_size, dec,
+                              &dec_size) == YAY0_OK &&
+         dec_size == 300 && memcmp(dec, samples[7], 300) == 0 &&
+         yay0_decompress(out, out_size, dec, &dec_size) == YAY0_ERR_BACKREF &&
+         yay0_measure_dict(out, out_size, dict_size, &written, &dec_size) ==
+           YAY0_OK && written == out_size && dec_size == 300 &&
+         yay0_measure(out, out_size, NULL, NULL) == YAY0_ERR_BACKREF;
+    free(out);
+    out = NULL;
+  }
+
+  /* Caller memory has room for the dictionary too */
+  params.block_size = 0;
+  scratch_size = yay0_compress_scratch_size_ex(300, &params);
+  scratch = malloc(scratch_size);
+  enc = yay0_encoder_create_in(scratch, scratch_size, 300, &params);
+  out = (uint8_t*)malloc(yay0_compress_bound(300));
+  dec_size = sizeof(dec);
+  ok = ok && enc && out &&
+       yay0_compress_ctx_to(enc, samples[7], 300, out,
+                            yay0_compress_bound(300), &written) == YAY0_OK &&
+       yay0_decompress_dict(out, written, dict, dict_size, dec, &dec_size) ==
+         YAY0_OK && dec_size == 300 && memcmp(dec, samples[7], 300) == 0;
+  /* A header claiming far more output is refused before anything is
+   * allocated for it */
+  if (ok)
+  {
+    out[4] = out[5] = out[6] = 0xFF;
+    dec_size = (size_t)-1;
+    ok = yay0_measure_dict(out, written, dict_size, NULL, NULL) != YAY0_OK &&
+         yay0_decompress_dict(out, written, dict, dict_size, dec,
+                              &dec_size) != YAY0_OK;
+  }
+
+  free(out);
+  free(plain);
+  free(scratch);
+  printf("Preset dictionary %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/**
+ * Everything the encoders write validates; truncated, padded, oversized and
+ * mutated files are turned away, and whatever validates also decodes.
+ */
+static int test_validate(void)
+{
+  uint8_t *buf = (uint8_t*)malloc(20000), *dec = (uint8_t*)malloc(20000);
+  uint8_t *out = NULL, *bad = NULL;
+  size_t out_size, size, dec_size;
+  yay0_params params;
+  unsigned int kind, i;
+  int ok = buf && dec;
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry((int)kind, buf, 20000);
+    yay0_params_init(&params, kind == 1 ? 9 : 0);
+    params.block_size = kind == 3 ? 5000 : 0;
+    ok = yay0_compress_ex(buf, 20000, &params, &out, &out_size) == YAY0_OK &&
+         yay0_validate(out, out_size, &size) == YAY0_OK && size == 20000 &&
+         yay0_validate(out, out_size - 1, &size) != YAY0_OK;
+    bad = ok ? (uint8_t*)malloc(out_size + 1) : NULL;
+    ok = ok && bad;
+    if (ok)
+    {
+      /* Trailing bytes, and a header claiming 4 GB of output */
+      memcpy(bad, out, out_size);
+      bad[out_size] = 0;
+      ok = yay0_validate(bad, out_size + 1, &size) == YAY0_ERR_FORMAT;
+      memset(bad + 4, 0xFF, 4);
+      ok = ok && yay0_validate(bad, out_size, &size) != YAY0_OK;
+    }
+    for (i = 0; ok && i < 300; ++i)
+    {
+      memcpy(bad, out, out_size);
+      bad[test_rand() % out_size] ^= (uint8_t)(1u << (test_rand() % 8));
+      dec_size = 20000;
+      if (yay0_validate(bad, out_size, &size) == YAY0_OK)
+        ok = size <= 20000 &&
+             yay0_decompress(bad, out_size, dec, &dec_size) == YAY0_OK &&
+             dec_size == size;
+    }
+    free(out);
+    free(bad);
+    out = bad = NULL;
+  }
+
+  free(buf);
+  free(dec);
+  printf("Validation %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Token counts must agree between encoder and decoder and add up */
+static int stats_consistent(const yay0_stats *s, size_t size)
+{
+  unsigned long lens = 0, dists = 0;
+  unsigned int i;
+
+  for (i = 0; i < YAY0_STATS_LEN_BUCKETS; ++i)
+    lens += s->len_hist[i];
+  for (i = 0; i < YAY0_STATS_DIST_BUCKETS; ++i)
+    dists += s->dist_hist[i];
+
+  return s->literals + s->match_bytes == size && lens == s->matches &&
+         dists == s->matches;
+}
+
+static int test_stats(void)
+{
+  uint8_t *buf = (uint8_t*)malloc(40000), *dec = (uint8_t*)malloc(40000);
+  uint8_t *out = NULL;
+  size_t out_size, dec_size;
+  yay0_stats enc_stats, dec_stats;
+  yay0_params params;
+  int level, ok = buf && dec;
+
+  for (level = 0; ok && level <= YAY0_LEVEL_MAX; level += 3)
+  {
+    make_corpus_entry(level % 5, buf, 40000);
+    yay0_params_init(&params, level);
+    yay0_stats_init(&enc_stats);
+    yay0_stats_init(&dec_stats);
+    params.stats = &enc_stats;
+    /* Level 3 goes through the block path */
+    if (level == 3)
+      params.block_size = 8192;
+    dec_size = 40000;
+    ok = yay0_compress_ex(buf, 40000, &params, &out, &out_size) == YAY0_OK &&
+         yay0_decompress_ex(out, out_size, dec, &dec_size, &dec_stats) ==
+           YAY0_OK &&
+         stats_consistent(&enc_stats, 40000) &&
+         enc_stats.matches == dec_stats.matches &&
+         enc_stats.literals == dec_stats.literals &&
+         memcmp(enc_stats.len_hist, dec_stats.len_hist,
+                sizeof(enc_stats.len_hist)) == 0;
+#ifndef YAY0_NO_STATS
+    ok = ok && enc_stats.searches > 0;
+#endif
+    free(out);
+    out = NULL;
+  }
+
+  free(buf);
+  free(dec);
+  printf("Statistics %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Compress with a reused encoder context and compare against yay0_compress */
+static int test_encoder_ctx(void)
+{
+  yay0_encoder_t *enc = yay0_encoder_create();
+  uint8_t *ref = NULL, *out = NULL;
+  size_t ref_size, out_size;
+  int i, ok = 1;
+
+  if (!enc ||
+      yay0_compress(dec_data, sizeof(dec_data), &ref, &ref_size) != YAY0_OK)
+    ok = 0;
+
+  for (i = 0; ok && i < 3; ++i)
+  {
+    if (yay0_compress_ctx(enc, dec_data, sizeof(dec_data), &out,
+                          &out_size) != YAY0_OK ||
+        out_size != ref_size || memcmp(out, ref, ref_size) != 0)
+      ok = 0;
+    free(out);
+    out = NULL;
+  }
+
+  /* A run left cached by one input must not leak into the next */
+  yay0_encoder_destroy(enc);
+  enc = yay0_encoder_create();
+  if (ok && enc)
+  {
+    static uint8_t first[1400], second[1500], dec[1500];
+    size_t dec_size = sizeof(second);
+
+    for (i = 0; i < 1400; ++i)
+      first[i] = i < 1000 ? 0 : (uint8_t)(1 + i % 251);
+    for (i = 0; i < 1500; ++i)
+      second[i] = i >= 500 && i < 1100 ? 0 : (uint8_t)(1 + i % 251);
+    yay0_encoder_set_search(enc, YAY0_SEARCH_SCAN, 0);
+    ok = yay0_compress_ctx(enc, first, sizeof(first), &out, &out_size) ==
+           YAY0_OK;
+    free(out);
+    out = NULL;
+    ok = ok && yay0_compress_ctx(enc, second, sizeof(second), &out,
+                                 &out_size) == YAY0_OK &&
+         yay0_decompress(out, out_size, dec, &dec_size) == YAY0_OK &&
+         dec_size == sizeof(second) && memcmp(dec, second, dec_size) == 0;
+    free(out);
+    out = NULL;
+  }
+
+  yay0_encoder_destroy(enc);
+  free(ref);
+  printf("Encoder context reuse %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/**
+ * One parse written as Yay0, Yaz0 and MIO0: the Yay0 copy matches a plain
+ * encode and all of them decode back, as do hand-made Yaz0 and MIO0 files.
+ */
+static int test_formats(void)
+{
+  static const yay0_format formats[3] =
+    { YAY0_FORMAT_YAY0, YAY0_FORMAT_YAZ0, YAY0_FORMAT_MIO0 };
+  static const uint8_t yaz0[] =
+    { 'Y', 'a', 'z', '0', 0, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 0,
+      0xE0, 'a', 'b', 'c', 0x10, 0x02 };
+  static const uint8_t mio0[] =
+    { 'M', 'I', 'O', '0', 0, 0, 0, 6, 0, 0, 0, 20, 0, 0, 0, 22,
+      0xE0, 0, 0, 0, 0x00, 0x02, 'a', 'b', 'c' };
+  yay0_encoder_t *enc = yay0_encoder_create();
+  uint8_t *buf = (uint8_t*)malloc(20000), *dec = (uint8_t*)malloc(20000);
+  uint8_t *outs[3], *plain = NULL, bogus[sizeof(mio0)];
+  size_t sizes[3], plain_size, dec_size, packed, f;
+  yay0_format format;
+  int kind, ok = enc && buf && dec;
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry(kind, buf, 20000);
+    ok = yay0_compress_formats(enc, buf, 20000, formats, 3, outs, sizes) ==
+           YAY0_OK &&
+         yay0_compress_ctx(enc, buf, 20000, &plain, &plain_size) == YAY0_OK &&
+         plain_size == sizes[0] && memcmp(plain, outs[0], plain_size) == 0;
+    for (f = 0; ok && f < 3; ++f)
+    {
+      dec_size = 20000;
+      ok = yay0_format_detect(outs[f], sizes[f], &format, &dec_size) ==
+             YAY0_OK && format == formats[f] && dec_size == 20000 &&
+           yay0_decompress_any(outs[f], sizes[f], dec, &dec_size) ==
+             YAY0_OK && dec_size == 20000 && memcmp(dec, buf, 20000) == 0;
+      ok = ok && yay0_measure_any(outs[f], sizes[f], &format, &packed,
+                                  &dec_size) == YAY0_OK &&
+           format == formats[f] && packed == sizes[f] && dec_size == 20000;
+      /* Cut off files must fail cleanly */
+      dec_size = 20000;
+      ok = ok && yay0_decompress_any(outs[f], sizes[f] / 2, dec, &dec_size) !=
+                   YAY0_OK;
+    }
+    if (!ok)
+      printf("Formats differ: kind %d\n", kind);
+    for (f = 0; f < 3; ++f)
+      free(outs[f]);
+    free(plain);
+    plain = NULL;
+  }
+
+  dec_size = 6;
+  ok = ok && yay0_decompress_any(yaz0, sizeof(yaz0), dec, &dec_size) ==
+               YAY0_OK && dec_size == 6 && memcmp(dec, "abcabc", 6) == 0;
+  dec_size = 6;
+  ok = ok && yay0_decompress_any(mio0, sizeof(mio0), dec, &dec_size) ==
+               YAY0_OK && dec_size == 6 && memcmp(dec, "abcabc", 6) == 0;
+  /* A header claiming far more output than the tokens make is refused */
+  memcpy(bogus, yaz0, sizeof(yaz0));
+  bogus[4] = bogus[5] = bogus[6] = 0xFF;
+  ok = ok && yay0_measure_any(bogus, sizeof(yaz0), NULL, NULL, &dec_size) !=
+               YAY0_OK;
+  memcpy(bogus, mio0, sizeof(mio0));
+  bogus[4] = bogus[5] = bogus[6] = 0xFF;
+  ok = ok && yay0_measure_any(bogus, sizeof(mio0), NULL, NULL, &dec_size) !=
+               YAY0_OK;
+
+  yay0_encoder_destroy(enc);
+  free(buf);
+  free(dec);
+  printf("Yaz0 and MIO0 output %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/* Caller's pool for test_batch: runs the jobs backwards on two "workers" */
+static void test_pool_run(void *pool, unsigned int workers, size_t count,
+  yay0_batch_fn fn, void *arg)
+{
+  size_t i;
+
+  *(unsigned int*)pool = workers;
+  for (i = count; i-- > 0;)
+    fn(arg, i, (unsigned int)(i % workers));
+}
+
+/* Blocks count_alloc has handed out of exactly count_watch bytes */
+static size_t count_watch;
+static long count_watched;
+
+/* Allocator that counts live blocks, to show every one is given back */
+static void *count_alloc(void *ctx, size_t size)
+{
+  void *p = malloc(size ? size : 1);
+
+  if (p)
+  {
+    ++*(long*)ctx;
+    if (size == count_watch)
+      ++count_watched;
+  }
+
+  return p;
+}
+
+static void count_free(void *ctx, void *ptr)
+{
+  --*(long*)ctx;
+  free(ptr);
+}
+
+/**
+ * Arenas of the documented sizes are enough to compress and decode,
+ * one byte short of the scratch size is not, and the entry points that
+ * allocate all go through the allocator and give back what they take.
+ */
+static int test_allocator(void)
+{
+  uint8_t *buf = (uint8_t*)malloc(12000);
+  uint8_t *out = (uint8_t*)malloc(yay0_compress_bound(12000));
+  uint8_t *dec = (uint8_t*)malloc(12000);
+  size_t scratch_size = yay0_compress_scratch_size(12000);
+  size_t mem_size = scratch_size + yay0_compress_bound(12000) + 16;
+  void *mem = malloc(mem_size);
+  uint8_t *ref = NULL, *res = NULL;
+  size_t ref_size, res_size, written, dec_size;
+  yay0_allocator counter;
+  yay0_encoder_t *enc;
+  yay0_decoder_t *stream;
+  yay0_index_t *index;
+  yay0_params params;
+  yay0_arena arena;
+  long live = 0;
+  int kind, ok = buf && out && dec && mem;
+
+  for (kind = 0; ok && kind < TEST_CORPUS_KINDS; ++kind)
+  {
+    make_corpus_entry(kind, buf, 12000);
+    ok = yay0_compress(buf, 12000, &ref, &ref_size) == YAY0_OK;
+
+    /* yay0_compress_to takes exactly the scratch size */
+    yay0_arena_init(&arena, mem, scratch_size);
+    yay0_set_allocator(&arena.allocator);
+    ok = ok && yay0_compress_to(buf, 12000, out, yay0_compress_bound(12000),
+                                &written) == YAY0_OK &&
+         written == ref_size && memcmp(out, ref, ref_size) == 0 &&
+         arena.peak == scratch_size && arena.used == 0;
+    yay0_arena_init(&arena, mem, scratch_size - 1);
+    ok = ok && yay0_compress_to(buf, 12000, out, yay0_compress_bound(12000),
+                                &written) == YAY0_ERR_FORMAT;
+    yay0_set_allocator(NULL);
+
+    /* An arena encoder sizes its buffers once, for the whole input */
+    yay0_arena_init(&arena, mem, mem_size);
+    enc = yay0_encoder_create_with(&arena.allocator);
+    ok = ok && enc &&
+         yay0_compress_ctx(enc, buf, 12000, &res, &res_size) == YAY0_OK &&
+         res_size == ref_size && memcmp(res, ref, ref_size) == 0 &&
+         arena.peak <= scratch_size + yay0_compress_bound(12000) + 15;
+    yay0_encoder_destroy(enc);
+    res = NULL;
+    free(ref);
+    ref = NULL;
+  }
+
+  /* The streaming decoder is one block, rounded up like any other */
+  yay0_arena_init(&arena, mem, (yay0_decoder_scratch_size() + 15) & ~(size_t)15);
+  stream = yay0_decoder_create_with(&arena.allocator);
+  ok = ok && stream;
+  yay0_decoder_destroy(stream);
+  ok = ok && arena.used == 0;
+
+  counter.alloc = count_alloc;
+  counter.free = count_free;
+  counter.ctx = &live;
+  yay0_set_allocator(&counter);
+  yay0_params_init(&params, 6);
+  params.block_size = 4096;
+  params.threads = 3;
+  /* Thread handles come from the allocator as well, in one block */
+  count_watch = yay0_parallel_scratch_size(3, 3);
+  ok = ok && yay0_compress_ex(buf, 12000, &params, &ref, &ref_size) ==
+               YAY0_OK && live == 1 && count_watched == (count_watch != 0);
+  count_watch = 0;
+  dec_size = 12000;
+  ok = ok && yay0_decompress_parallel(ref, ref_size, dec, &dec_size, 2,
+                                      4096) == YAY0_OK &&
+       dec_size == 12000 && memcmp(dec, buf, 12000) == 0 && live == 1;
+  ok = ok && yay0_index_build(ref, ref_size, 4096, &index) == YAY0_OK &&
+       yay0_decompress_range(ref, ref_size, index, 5000, 3000, dec) ==
+         YAY0_OK && memcmp(dec, buf + 5000, 3000) == 0;
+  if (ok)
+    yay0_index_destroy(index);
+  ok = ok && live == 1;
+  count_free(&live, ref);
+  yay0_set_allocator(NULL);
+  ok = ok && live == 0;
+
+  free(mem);
+  free(buf);
+  free(out);
+  free(dec);
+  printf("Allocator hooks %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
+/**
+ * Batches match one-at-a-time encodes whatever worker reuses which
+ * context, decode back through a caller's pool, and report a bad job
+ * without holding up the others.
+ */
+static int test_batch(void)
+{
+  enum { JOBS = 24 };
+  yay0_batch_job jobs[JOBS], back[JOBS + 1];
+  yay0_batch_pool pool = { NULL, NULL, 3 };
+  yay0_batch_report report;
+  yay0_params params;
+  uint8_t *inputs[JOBS], *single = NULL, bogus[40];
+  size_t sizes[JOBS], single_size, total = 0, i;
+  unsigned int seen = 0;
+  int ok = 1;
+
+  memset(jobs, 0, sizeof(jobs));
+  memset(back, 0, sizeof(back));
+  yay0_params_init(&params, 6);
+  for (i = 0; i < JOBS; ++i)
+  {
+    sizes[i] = (i * 2711) % 20000 + 1;
+    inputs[i] = (uint8_t*)malloc(sizes[i]);
+    ok = ok && inputs[i];
+    if (!ok)
+      continue;
+    make_corpus_entry((int)(i % TEST_CORPUS_KINDS), inputs[i], sizes[i]);
+    jobs[i].input = inputs[i];
+    jobs[i].input_size = sizes[i];
+    /* Half into caller memory, half allocated by the library */
+    if (i % 2)
+    {
+      jobs[i].output_capacity = yay0_compress_bound(sizes[i]);
+      jobs[i].output = (uint8_t*)malloc(jobs[i].output_capacity);
+      ok = jobs[i].output != NULL;
+    }
+    total += sizes[i];
+  }
+
+  ok = ok && yay0_compress_batch(jobs, JOBS, &params, &pool, &report) ==
+               YAY0_OK &&
+       report.jobs == JOBS && report.failed == 0 &&
+       report.input_bytes == total;
+  for (i = 0; ok && i < JOBS; ++i)
+  {
+    ok = jobs[i].result == YAY0_OK &&
+         yay0_compress_ex(inputs[i], sizes[i], &params, &single,
+                          &single_size) == YAY0_OK &&
+         single_size == jobs[i].output_size &&
+         memcmp(single, jobs[i].output, single_size) == 0;
+    free(single);
+    single = NULL;
+    back[i].input = jobs[i].output;
+    back[i].input_size = jobs[i].output_size;
+  }
+
+  /* A file that cannot decode, in the middle of the batch */
+  memset(bogus, 0x5A, sizeof(bogus));
+  memcpy(bogus, "Yay0", 4);
+  back[JOBS] = back[JOBS / 2];
+  back[JOBS / 2].input = bogus;
+  back[JOBS / 2].input_size = sizeof(bogus);
+  pool.run = test_pool_run;
+  pool.pool = &seen;
+  pool.workers = 2;
+  ok = ok && yay0_decompress_batch(back, JOBS + 1, &pool, &report) !=
+               YAY0_OK &&
+       seen == 2 && report.jobs == JOBS + 1 && report.failed == 1 &&
+       back[JOBS / 2].result != YAY0_OK && back[JOBS / 2].output == NULL;
+  for (i = 0; ok && i < JOBS; ++i)
+  {
+    yay0_batch_job *b = i == JOBS / 2 ? &back[JOBS] : &back[i];
+
+    ok = b->result == YAY0_OK && b->output_size == sizes[i] &&
+         memcmp(b->output, inputs[i], sizes[i]) == 0;
+  }
+
+  for (i = 0; i < JOBS; ++i)
+  {
+    free(inputs[i]);
+    free(jobs[i].output);
+  }
+  for (i = 0; i <= JOBS; ++i)
+    free(back[i].output);
+  printf("Batch API %s\n", ok ? "successful" : "failed");
+
+  return ok;
+}
+
 int main(int argc, char **argv)
 {
   unsigned char *data;
@@ -111,5 +1330,14 @@ int main(int argc, char **argv)
 
   free(data);
 
+  if (!test_encoder_ctx() || !test_chain_search() || !test_exact_search() ||
+      !test_golden() || !test_optimal_parse() || !test_levels() ||
+      !test_stream_decoder() || !test_fast_decode() || !test_compress_to() ||
+      !test_blocks() || !test_stats() || !test_measure() ||
+      !test_range() || !test_parallel_decode() || !test_dict() ||
+      !test_validate() || !test_batch() ||
+      !test_formats() || !test_allocator())
+    return -1;
+
   return result_compress == YAY0_OK && result_decompress == YAY0_OK ? 0 : -1;
 }
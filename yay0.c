@@ -1,8 +1,12 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
 
 #include "yay0.h"
+#include "yay0_sys.h"
 
 #ifndef YAY0_BIG_ENDIAN
   #if defined(N64) || defined(GEKKO)
@@ -14,6 +18,135 @@
 
 #define YAY0_MATCH_LEN_MAX 273
 
+/* Backreferences reach at most this many bytes back (12-bit distance) */
+#define YAY0_WINDOW_SIZE 0x1000u
+#define YAY0_WINDOW_MASK (YAY0_WINDOW_SIZE - 1)
+
+#define YAY0_HEADER_SIZE 16u
+
+/* Round up to keep every buffer carved from scratch memory aligned */
+#define YAY0_ALIGN(x) (((x) + 15u) & ~(size_t)15u)
+
+static void *heap_alloc(void *ctx, size_t size)
+{
+  (void)ctx;
+  return malloc(size);
+}
+
+static void heap_free(void *ctx, void *ptr)
+{
+  (void)ctx;
+  free(ptr);
+}
+
+static const yay0_allocator yay0_heap = { heap_alloc, heap_free, NULL };
+
+/* Allocator of the entry points that are not given one */
+static yay0_allocator yay0_mem = { heap_alloc, heap_free, NULL };
+
+void yay0_set_allocator(const yay0_allocator *allocator)
+{
+  yay0_mem = allocator && allocator->alloc && allocator->free ? *allocator
+                                                              : yay0_heap;
+}
+
+static void *mem_alloc(const yay0_allocator *a, size_t size)
+{
+  return a->alloc(a->ctx, size);
+}
+
+static void *mem_calloc(const yay0_allocator *a, size_t count, size_t size)
+{
+  void *p;
+
+  if (a->alloc == heap_alloc)
+    return calloc(count, size);
+  if (size && count > (size_t)-1 / size)
+    return NULL;
+  p = a->alloc(a->ctx, count * size);
+  if (p)
+    memset(p, 0, count * size);
+
+  return p;
+}
+
+/* realloc for allocators without one, which need the old size to copy */
+static void *mem_realloc(const yay0_allocator *a, void *ptr,
+  size_t old_size, size_t size)
+{
+  void *p;
+
+  if (a->alloc == heap_alloc)
+    return realloc(ptr, size);
+  p = a->alloc(a->ctx, size);
+  if (p && ptr)
+  {
+    memcpy(p, ptr, old_size < size ? old_size : size);
+    a->free(a->ctx, ptr);
+  }
+
+  return p;
+}
+
+static void mem_free(const yay0_allocator *a, void *ptr)
+{
+  if (ptr)
+    a->free(a->ctx, ptr);
+}
+
+/* yay0_parallel_for with its thread handles from the allocator too */
+static void mem_parallel_for(unsigned int threads, size_t count,
+  yay0_task_fn fn, void *arg)
+{
+  size_t size = yay0_parallel_scratch_size(threads, count);
+  void *scratch = size ? mem_alloc(&yay0_mem, size) : NULL;
+
+  yay0_parallel_for_in(threads, count, fn, arg, scratch);
+  mem_free(&yay0_mem, scratch);
+}
+
+static void *arena_alloc(void *ctx, size_t size)
+{
+  yay0_arena *arena = (yay0_arena*)ctx;
+  size_t need = YAY0_ALIGN(size);
+
+  if (need < size || need > arena->size - arena->used)
+    return NULL;
+  arena->last = arena->used;
+  arena->used += need;
+  if (arena->used > arena->peak)
+    arena->peak = arena->used;
+
+  return arena->base + arena->last;
+}
+
+static void arena_free(void *ctx, void *ptr)
+{
+  yay0_arena *arena = (yay0_arena*)ctx;
+
+  /* Blocks below the newest stay taken until the arena is reset */
+  if ((uint8_t*)ptr == arena->base + arena->last)
+    arena->used = arena->last;
+}
+
+void yay0_arena_init(yay0_arena *arena, void *mem, size_t size)
+{
+  arena->allocator.alloc = arena_alloc;
+  arena->allocator.free = arena_free;
+  arena->allocator.ctx = arena;
+  arena->base = (uint8_t*)mem;
+  arena->size = mem ? size : 0;
+  arena->used = 0;
+  arena->last = 0;
+  arena->peak = 0;
+}
+
+void yay0_arena_reset(yay0_arena *arena)
+{
+  arena->used = 0;
+  arena->last = 0;
+}
+
 static uint32_t read_be_u32(const uint8_t *p)
 {
 #if YAY0_BIG_ENDIAN
@@ -115,32 +248,136 @@ static int yay0_validate_magic(const uint8_t *input, size_t input_size)
            input[3] == '0';
 }
 
-yay0_result yay0_decompress_headerless(const uint8_t *flag_ptr, size_t flag_len,
-  const uint8_t *comp_ptr, size_t comp_len, const uint8_t *raw_ptr,
-  size_t raw_len, uint8_t *output, size_t output_size)
+/* Most output one flag word can produce: 32 maximum length backreferences */
+#define YAY0_DEC_WORD_OUT (32u * YAY0_MATCH_LEN_MAX)
+
+/* Bytes the fast path may write past the end of a backreference */
+#define YAY0_DEC_SLACK 8u
+
+/* Number of consecutive set bits at the top of word */
+static unsigned int dec_leading_ones(uint32_t word)
 {
-  yay0_flag_t flags;
-  yay0_region_t comp, raw;
-  size_t out_written = 0;
-  int bit;
+#if defined(__GNUC__)
+  return ~word ? (unsigned int)__builtin_clz(~word) : 32u;
+#else
+  unsigned int n = 0;
 
-  if (!flag_ptr || !comp_ptr || !raw_ptr || !output)
-    return YAY0_ERR_FORMAT;
+  while (word & 0x80000000u)
+  {
+    word <<= 1;
+    ++n;
+  }
 
-  flagreader_init(&flags, flag_ptr, flag_len);
-  rr_init(&comp, comp_ptr, comp_len);
-  rr_init(&raw, raw_ptr, raw_len);
+  return n;
+#endif
+}
+
+/**
+ * Decode whole flag words while there is enough input and output left that
+ * no item in the word can run out of either, so none of the per-byte
+ * bounds checks of the careful loop are needed. Stops at the first word
+ * that may come close to an end, leaving the rest to the careful loop.
+ */
+static yay0_result dec_fast(yay0_flag_t *flags, yay0_region_t *comp,
+  yay0_region_t *raw, uint8_t *output, size_t output_size,
+  size_t *out_written)
+{
+  size_t out = *out_written;
+
+  while (flags->bit_mask == 0 && flags->len - flags->byte_pos >= 4 &&
+         output_size - out >= YAY0_DEC_WORD_OUT + YAY0_DEC_SLACK &&
+         comp->len - comp->pos >= 2 * 32 && raw->len - raw->pos >= 32)
+  {
+    uint32_t word = read_be_u32(flags->data + flags->byte_pos);
+    unsigned int left = 32, n;
+
+    flags->byte_pos += 4;
+    while (left)
+    {
+      n = dec_leading_ones(word);
+      if (n)
+      {
+        /* Run of literals */
+        memcpy(output + out, raw->data + raw->pos, n);
+        out += n;
+        raw->pos += n;
+        left -= n;
+        word = (word << (n - 1)) << 1;
+      }
+      else
+      {
+        const uint8_t *tok = comp->data + comp->pos;
+        size_t distance, length, i;
+        uint8_t *dst;
+        const uint8_t *src;
+
+        comp->pos += 2;
+        distance = ((size_t)(tok[0] & 0x0F) << 8 | tok[1]) + 1;
+        length = tok[0] >> 4;
+        if (length == 0)
+          length = (size_t)raw->data[raw->pos++] + 0x12;
+        else
+          length += 2;
+
+        if (distance > out)
+        {
+          *out_written = out;
+          return YAY0_ERR_BACKREF;
+        }
+
+        dst = output + out;
+        src = dst - distance;
+        if (distance >= YAY0_DEC_SLACK)
+        {
+          /* Chunks never overlap the bytes they are copied to */
+          for (i = 0; i < length; i += YAY0_DEC_SLACK)
+            memcpy(dst + i, src + i, YAY0_DEC_SLACK);
+        }
+        else if (distance == 1)
+          memset(dst, *src, length);
+        else
+        {
+          for (i = 0; i < length; ++i)
+            dst[i] = src[i];
+        }
+        out += length;
+        word <<= 1;
+        --left;
+      }
+    }
+  }
+  *out_written = out;
+
+  return YAY0_OK;
+}
 
+/**
+ * Decode from the given stream positions until output_size bytes of output
+ * exist. The first out_written bytes of output are already decoded, so
+ * backreferences may reach into them.
+ */
+static yay0_result dec_run(yay0_flag_t *flags, yay0_region_t *comp,
+  yay0_region_t *raw, uint8_t *output, size_t output_size,
+  size_t out_written)
+{
+  yay0_result result;
+  int bit;
+
+  result = dec_fast(flags, comp, raw, output, output_size, &out_written);
+  if (result != YAY0_OK)
+    return result;
+
+  /* Careful loop for whatever is left near the ends of the buffers */
   while (out_written < output_size)
   {
-    bit = flagreader_readbit(&flags);
+    bit = flagreader_readbit(flags);
     if (bit < 0)
       return YAY0_ERR_TRUNCATED;
 
     if (bit)
     {
       /* Read one byte from raw */
-      int v = rr_read_u8(&raw);
+      int v = rr_read_u8(raw);
       if (v < 0) return YAY0_ERR_TRUNCATED;
       output[out_written++] = (uint8_t)v;
     }
@@ -150,11 +387,11 @@ yay0_result yay0_decompress_headerless(const uint8_t *flag_ptr, size_t flag_len,
       size_t src_index;
 
       /* Backreference */
-      w = rr_read_u8(&comp);
+      w = rr_read_u8(comp);
       if (w < 0)
         return YAY0_ERR_TRUNCATED;
 
-      b2 = rr_read_u8(&comp);
+      b2 = rr_read_u8(comp);
       if (b2 < 0)
         return YAY0_ERR_TRUNCATED;
 
@@ -164,7 +401,7 @@ yay0_result yay0_decompress_headerless(const uint8_t *flag_ptr, size_t flag_len,
 
       if (length == 0)
       {
-        int ext = rr_read_u8(&raw);
+        int ext = rr_read_u8(raw);
 
         if (ext < 0)
           return YAY0_ERR_TRUNCATED;
@@ -198,6 +435,23 @@ yay0_result yay0_decompress_headerless(const uint8_t *flag_ptr, size_t flag_len,
   return YAY0_OK;
 }
 
+yay0_result yay0_decompress_headerless(const uint8_t *flag_ptr, size_t flag_len,
+  const uint8_t *comp_ptr, size_t comp_len, const uint8_t *raw_ptr,
+  size_t raw_len, uint8_t *output, size_t output_size)
+{
+  yay0_flag_t flags;
+  yay0_region_t comp, raw;
+
+  if (!flag_ptr || !comp_ptr || !raw_ptr || !output)
+    return YAY0_ERR_FORMAT;
+
+  flagreader_init(&flags, flag_ptr, flag_len);
+  rr_init(&comp, comp_ptr, comp_len);
+  rr_init(&raw, raw_ptr, raw_len);
+
+  return dec_run(&flags, &comp, &raw, output, output_size, 0);
+}
+
 yay0_result yay0_decompress(const uint8_t *input, size_t input_size,
   uint8_t *output, size_t *output_size)
 {
@@ -250,6 +504,66 @@ yay0_result yay0_decompress(const uint8_t *input, size_t input_size,
     return result;
 }
 
+yay0_result yay0_decompress_dict(const uint8_t *input, size_t input_size,
+  const uint8_t *dict, size_t dict_size, uint8_t *output,
+  size_t *output_size)
+{
+  uint32_t decom_size, comp_off, raw_off, flag_end;
+  yay0_flag_t flags;
+  yay0_region_t comp, raw;
+  yay0_result result;
+  uint8_t *buf;
+
+  if (!dict || !dict_size)
+    return yay0_decompress(input, input_size, output, output_size);
+  if (!input || input_size < YAY0_HEADER_SIZE)
+    return YAY0_ERR_TRUNCATED;
+  else if (!yay0_validate_magic(input, input_size))
+    return YAY0_ERR_FORMAT;
+  if (!output || !output_size)
+    return YAY0_ERR_FORMAT;
+
+  decom_size = read_be_u32(input + 4);
+  if ((size_t)decom_size > *output_size)
+    return YAY0_ERR_OUTPUT_SMALL;
+  comp_off = read_be_u32(input + 8);
+  raw_off = read_be_u32(input + 12);
+  if (comp_off > input_size || raw_off > input_size)
+    return YAY0_ERR_TRUNCATED;
+  flag_end = comp_off < raw_off ? comp_off : raw_off;
+  if (flag_end < YAY0_HEADER_SIZE)
+    return YAY0_ERR_FORMAT;
+  if (dict_size > YAY0_DICT_SIZE_MAX)
+  {
+    dict += dict_size - YAY0_DICT_SIZE_MAX;
+    dict_size = YAY0_DICT_SIZE_MAX;
+  }
+  /* The buffer is sized from the header, so check the tokens match it */
+  result = yay0_measure_dict(input, input_size, dict_size, NULL, NULL);
+  if (result != YAY0_OK)
+    return result;
+
+  /* Decode after the dictionary, so backreferences can reach into it */
+  buf = (uint8_t*)mem_alloc(&yay0_mem, dict_size + decom_size);
+  if (!buf)
+    return YAY0_ERR_FORMAT;
+  memcpy(buf, dict, dict_size);
+  flagreader_init(&flags, input + YAY0_HEADER_SIZE,
+                  flag_end - YAY0_HEADER_SIZE);
+  rr_init(&comp, input + comp_off, input_size - comp_off);
+  rr_init(&raw, input + raw_off, input_size - raw_off);
+  result = dec_run(&flags, &comp, &raw, buf, dict_size + decom_size,
+                   dict_size);
+  if (result == YAY0_OK)
+  {
+    memcpy(output, buf + dict_size, decom_size);
+    *output_size = decom_size;
+  }
+  mem_free(&yay0_mem, buf);
+
+  return result;
+}
+
 yay0_result yay0_get_decompressed_size(const uint8_t *input, size_t input_size,
   size_t *out_size)
 {
@@ -264,342 +578,3344 @@ yay0_result yay0_get_decompressed_size(const uint8_t *input, size_t input_size,
   }
 }
 
-static const uint8_t *enc_bz = NULL;
-static int enc_insize = 0;
+yay0_result yay0_format_detect(const uint8_t *input, size_t input_size,
+  yay0_format *format, size_t *decompressed_size)
+{
+  yay0_format found;
 
-/* Boyer-Moore-like skip table used by mischarsearch() */
-static unsigned short enc_skip[256];
+  if (!input || input_size < YAY0_HEADER_SIZE)
+    return YAY0_ERR_TRUNCATED;
+  if (memcmp(input, "Yay0", 4) == 0)
+    found = YAY0_FORMAT_YAY0;
+  else if (memcmp(input, "Yaz0", 4) == 0)
+    found = YAY0_FORMAT_YAZ0;
+  else if (memcmp(input, "MIO0", 4) == 0)
+    found = YAY0_FORMAT_MIO0;
+  else
+    return YAY0_ERR_FORMAT;
+  if (format)
+    *format = found;
+  if (decompressed_size)
+    *decompressed_size = (size_t)read_be_u32(input + 4);
 
-static void enc_initskip(const unsigned char *pattern, int len)
-{
-  int i;
-  for (i = 0; i < 256; ++i)
-    enc_skip[i] = (unsigned short)len;
-  for (i = 0; i < len; ++i)
-    enc_skip[(unsigned char)pattern[i]] = (unsigned short)(len - i - 1);
+  return YAY0_OK;
 }
 
-/* Find the first occurrence of 'pattern' (length patternlen) in data
-   (length datalen) using a simple skip heuristic. Returns index within
-   'data' (0..datalen-1) where the pattern starts, or datalen if not found. */
-static int enc_mischarsearch(const unsigned char *pattern, int patternlen,
-                             const unsigned char *data, int datalen)
+/**
+ * Copies a backreference for the Yaz0 and MIO0 decoders, cut short at the
+ * end of the output like in Yay0, or only counts it with no output.
+ * Returns 0 if it reaches before the start.
+ */
+static int dec_copy_match(uint8_t *output, size_t *out, size_t size,
+  size_t distance, unsigned int length)
 {
-  int result = datalen;
-  int i, j, v6;
+  size_t pos = *out;
 
-  if (patternlen <= datalen) {
-    enc_initskip(pattern, patternlen);
-    i = patternlen - 1;
-    for (;;) {
-      if (pattern[patternlen - 1] == data[i]) {
-        --i;
-        j = patternlen - 2;
-        if (j < 0) {
-          return i + 1;
-        }
-        while (pattern[j] == data[i]) {
-          --i;
-          --j;
-          if (j < 0)
-            return i + 1;
-        }
-        v6 = patternlen - j;
-        if (enc_skip[data[i]] > (unsigned)v6)
-          v6 = enc_skip[data[i]];
-        /* increment i by v6 below via loop increment */
-        i += v6;
-      } else {
-        v6 = enc_skip[data[i]];
-        i += v6;
-      }
-      if (i >= datalen)
-        break;
-    }
+  if (distance > pos)
+    return 0;
+  if (length > size - pos)
+    length = (unsigned int)(size - pos);
+  if (!output)
+    pos += length;
+  while (output && length--)
+  {
+    output[pos] = output[pos - distance];
+    ++pos;
   }
-  return result;
+  *out = pos;
+
+  return 1;
 }
 
-static void enc_search(unsigned cur_pos, int buf_end, int *match_pos_out,
-  unsigned *match_len_out)
+/**
+ * Yay0's three streams, with 3 to 18 byte matches and no long form. With
+ * no output this only walks the tokens; *end gets the furthest byte read.
+ */
+static yay0_result dec_mio0(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t size, size_t *end)
 {
-  unsigned match_len = 3;        /* Starting minimum match length */
-  unsigned search_start = 0;     /* Earliest position to search from */
-  unsigned mismatch_offset;      /* Where mismatch happens in search window */
-  unsigned best_match_pos = 0;   /* Best match position found so far */
-  unsigned max_match_len;        /* Maximum possible match length */
-
-  /* Limit search window to 4 KB before current position */
-  if (cur_pos > 0x1000)
-    search_start = cur_pos - 0x1000;
+  uint32_t comp_off = read_be_u32(input + 8), raw_off = read_be_u32(input + 12);
+  uint32_t flag_end = comp_off < raw_off ? comp_off : raw_off;
+  yay0_region_t flags, comp, raw;
+  unsigned int bits = 0;
+  size_t out = 0;
+  int flag = 0, hi, lo;
 
-  /* Calculate the maximum match length possible based on remaining bytes */
-  max_match_len = YAY0_MATCH_LEN_MAX;
-  if ((unsigned)(buf_end - (int)cur_pos) <= 0x111)
-      max_match_len = (unsigned)(buf_end - (int)cur_pos);
+  if (comp_off > input_size || raw_off > input_size)
+    return YAY0_ERR_TRUNCATED;
+  if (flag_end < YAY0_HEADER_SIZE)
+    return YAY0_ERR_FORMAT;
+  rr_init(&flags, input + YAY0_HEADER_SIZE, flag_end - YAY0_HEADER_SIZE);
+  rr_init(&comp, input + comp_off, input_size - comp_off);
+  rr_init(&raw, input + raw_off, input_size - raw_off);
 
-  /* Skip if not enough data for a match */
-  if (max_match_len < match_len)
+  while (out < size)
   {
-    *match_len_out = 0;
-    *match_pos_out = 0;
-
-    return;
+    if (!bits)
+    {
+      flag = rr_read_u8(&flags);
+      if (flag < 0)
+        return YAY0_ERR_TRUNCATED;
+      bits = 8;
+    }
+    if (flag & (1 << --bits))
+    {
+      hi = rr_read_u8(&raw);
+      if (hi < 0)
+        return YAY0_ERR_TRUNCATED;
+      if (output)
+        output[out] = (uint8_t)hi;
+      ++out;
+      continue;
+    }
+    hi = rr_read_u8(&comp);
+    lo = rr_read_u8(&comp);
+    if (lo < 0)
+      return YAY0_ERR_TRUNCATED;
+    if (!dec_copy_match(output, &out, size,
+                        ((size_t)(hi & 0x0F) << 8 | (size_t)lo) + 1,
+                        ((unsigned int)hi >> 4) + 3))
+      return YAY0_ERR_BACKREF;
   }
-
-  /* Search backwards for the best match */
-  while (cur_pos > search_start)
+  if (end)
   {
-    mismatch_offset = (unsigned)enc_mischarsearch(
-      &enc_bz[cur_pos],
-      match_len,
-      &enc_bz[search_start],
-      match_len + cur_pos - search_start
-    );
+    *end = YAY0_HEADER_SIZE + flags.pos;
+    if (comp_off + comp.pos > *end)
+      *end = comp_off + comp.pos;
+    if (raw_off + raw.pos > *end)
+      *end = raw_off + raw.pos;
+  }
 
-    /* No more candidates in range */
-    if (mismatch_offset >= cur_pos - search_start)
-      break;
+  return YAY0_OK;
+}
 
-    /* Extend match length as far as possible */
-    while (max_match_len > match_len &&
-           enc_bz[match_len + search_start + mismatch_offset] == enc_bz[match_len + cur_pos])
-      ++match_len;
+/* One stream: each flag byte followed by the literals and tokens it covers */
+static yay0_result dec_yaz0(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t size, size_t *end)
+{
+  yay0_region_t in;
+  unsigned int bits = 0, length;
+  size_t out = 0;
+  int flag = 0, hi, lo;
 
-    /* Found the longest possible match */
-    if (match_len == max_match_len)
+  rr_init(&in, input + YAY0_HEADER_SIZE, input_size - YAY0_HEADER_SIZE);
+  while (out < size)
+  {
+    if (!bits)
     {
-      *match_pos_out = (int)(search_start + mismatch_offset);
-      *match_len_out = match_len;
+      flag = rr_read_u8(&in);
+      if (flag < 0)
+        return YAY0_ERR_TRUNCATED;
+      bits = 8;
+    }
+    if (flag & (1 << --bits))
+    {
+      hi = rr_read_u8(&in);
+      if (hi < 0)
+        return YAY0_ERR_TRUNCATED;
+      if (output)
+        output[out] = (uint8_t)hi;
+      ++out;
+      continue;
+    }
+    hi = rr_read_u8(&in);
+    lo = rr_read_u8(&in);
+    if (lo < 0)
+      return YAY0_ERR_TRUNCATED;
+    length = (unsigned int)hi >> 4;
+    if (!length)
+    {
+      int ext = rr_read_u8(&in);
 
-      return;
+      if (ext < 0)
+        return YAY0_ERR_TRUNCATED;
+      length = (unsigned int)ext + 0x12;
     }
+    else
+      length += 2;
+    if (!dec_copy_match(output, &out, size,
+                        ((size_t)(hi & 0x0F) << 8 | (size_t)lo) + 1, length))
+      return YAY0_ERR_BACKREF;
+  }
+  if (end)
+    *end = YAY0_HEADER_SIZE + in.pos;
 
-    /* Store this as current best match */
-    best_match_pos = search_start + mismatch_offset;
+  return YAY0_OK;
+}
+
+yay0_result yay0_decompress_any(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t *output_size)
+{
+  yay0_format format;
+  yay0_result result;
+  size_t size;
+
+  result = yay0_format_detect(input, input_size, &format, &size);
+  if (result != YAY0_OK)
+    return result;
+  if (format == YAY0_FORMAT_YAY0)
+    return yay0_decompress(input, input_size, output, output_size);
+  if (!output || !output_size)
+    return YAY0_ERR_FORMAT;
+  if (size > *output_size)
+    return YAY0_ERR_OUTPUT_SMALL;
+
+  if (format == YAY0_FORMAT_YAZ0)
+    result = dec_yaz0(input, input_size, output, size, NULL);
+  else
+    result = dec_mio0(input, input_size, output, size, NULL);
+  if (result == YAY0_OK)
+    *output_size = size;
+
+  return result;
+}
+
+void yay0_stats_init(yay0_stats *s)
+{
+  if (s)
+    memset(s, 0, sizeof(*s));
+}
+
+static void walk_count_match(yay0_stats *s, unsigned int len,
+  unsigned int dist)
+{
+  unsigned int k;
+
+  ++s->matches;
+  s->match_bytes += len;
+  ++s->len_hist[len > 17 ? YAY0_STATS_LEN_BUCKETS - 1 : len - 3];
+  for (k = 0; dist >> (k + 1); ++k)
+    ;
+  ++s->dist_hist[k];
+}
+
+/* Where decoding can resume: file offsets of the streams and the output */
+typedef struct
+{
+  uint32_t out;
+  uint32_t flag;
+  uint32_t comp;
+  uint32_t raw;
+} yay0_checkpoint_t;
+
+struct yay0_index_s
+{
+  /* Decompressed size and the file size the index was built for */
+  uint32_t size;
+  uint32_t packed;
+  uint32_t interval;
+  uint32_t count;
+  yay0_checkpoint_t *points;
+  /* YAY0_WINDOW_SIZE bytes per checkpoint: the output just before it */
+  uint8_t *windows;
+  unsigned int cap;
+  /* Where the index and its arrays came from */
+  yay0_allocator mem;
+};
+
+/**
+ * Room for every checkpoint a file of 'size' bytes can get, so that
+ * building the index does not have to grow the array
+ */
+static int index_reserve(yay0_index_t *index, size_t size)
+{
+  size_t cap = size ? (size - 1) / index->interval + 1 : 1;
+
+  /* At most one per 32-bit flag word, and every item makes a byte */
+  if (cap > size / 32 + 1)
+    cap = size / 32 + 1;
+  if (cap > (size_t)-1 / sizeof(yay0_checkpoint_t))
+    return 0;
+  index->points = (yay0_checkpoint_t*)mem_alloc(&index->mem,
+    cap * sizeof(yay0_checkpoint_t));
+  if (!index->points)
+    return 0;
+  index->cap = (unsigned int)cap;
+
+  return 1;
+}
+
+/* Where each stream's last read ended, and how much output it all made */
+typedef struct
+{
+  size_t flag;
+  size_t comp;
+  size_t raw;
+  size_t out;
+} yay0_walk_end_t;
+
+static size_t walk_end_max(const yay0_walk_end_t *end)
+{
+  size_t max = end->flag;
+
+  if (end->comp > max)
+    max = end->comp;
+
+  return end->raw > max ? end->raw : max;
+}
+
+/**
+ * Walk the tokens of a file without producing output, checking that every
+ * read stays inside the input and every backreference inside the output,
+ * the same way the decoder does. Counts the tokens into s if it is not
+ * NULL, and fills in *end if it is not NULL. With an index,
+ * records a checkpoint at the first flag word boundary every interval
+ * bytes of output. Backreferences may reach 'history' bytes of preset
+ * dictionary before the output.
+ */
+static yay0_result dec_walk(const uint8_t *input, size_t input_size,
+  size_t history, yay0_stats *s, yay0_walk_end_t *end, yay0_index_t *index)
+{
+  size_t total, produced = 0, fpos = YAY0_HEADER_SIZE, flag_end, cpos, rpos;
+  uint32_t comp_off, raw_off;
+  unsigned int token, len, dist, flag = 0, mask = 0;
+
+  if (!input || input_size < YAY0_HEADER_SIZE)
+    return YAY0_ERR_TRUNCATED;
+  else if (!yay0_validate_magic(input, input_size))
+    return YAY0_ERR_FORMAT;
+  total = read_be_u32(input + 4);
+  comp_off = read_be_u32(input + 8);
+  raw_off = read_be_u32(input + 12);
+  if (comp_off > input_size || raw_off > input_size)
+    return YAY0_ERR_TRUNCATED;
+  flag_end = comp_off < raw_off ? comp_off : raw_off;
+  if (flag_end < YAY0_HEADER_SIZE)
+    return YAY0_ERR_FORMAT;
+  cpos = comp_off;
+  rpos = raw_off;
+
+  while (produced < total)
+  {
+    if (index && !mask && !((fpos - YAY0_HEADER_SIZE) & 3) &&
+        produced >= (size_t)index->count * index->interval)
+    {
+      yay0_checkpoint_t *cp;
+
+      if (index->count == index->cap)
+      {
+        unsigned int cap = index->cap ? index->cap * 2 : 16;
+
+        cp = (yay0_checkpoint_t*)mem_realloc(&index->mem, index->points,
+          index->cap * sizeof(yay0_checkpoint_t),
+          cap * sizeof(yay0_checkpoint_t));
+        if (!cp)
+          return YAY0_ERR_FORMAT;
+        index->points = cp;
+        index->cap = cap;
+      }
+      cp = &index->points[index->count++];
+      cp->out = (uint32_t)produced;
+      cp->flag = (uint32_t)fpos;
+      cp->comp = (uint32_t)cpos;
+      cp->raw = (uint32_t)rpos;
+    }
+    /* Whole flag words at a time while no stream can run out */
+    if (!mask && !((fpos - YAY0_HEADER_SIZE) & 3) && flag_end - fpos >= 4 &&
+        total - produced >= YAY0_DEC_WORD_OUT &&
+        input_size - cpos >= 2 * 32 && input_size - rpos >= 32)
+    {
+      uint32_t word = read_be_u32(input + fpos);
+      unsigned int left = 32, n;
+
+      fpos += 4;
+      while (left)
+      {
+        n = dec_leading_ones(word);
+        if (n)
+        {
+          rpos += n;
+          produced += n;
+          left -= n;
+          word = (word << (n - 1)) << 1;
+          if (s)
+            s->literals += n;
+          continue;
+        }
+        token = ((unsigned int)input[cpos] << 8) | input[cpos + 1];
+        cpos += 2;
+        dist = (token & 0xFFFu) + 1;
+        len = token >> 12;
+        len = len ? len + 2 : input[rpos++] + 18u;
+        if (dist > produced + history)
+          return YAY0_ERR_BACKREF;
+        produced += len;
+        if (s)
+          walk_count_match(s, len, dist);
+        word <<= 1;
+        --left;
+      }
+      continue;
+    }
+
+    if (!mask)
+    {
+      if (fpos >= flag_end)
+        return YAY0_ERR_TRUNCATED;
+      flag = input[fpos++];
+      mask = 0x80;
+    }
+    if (flag & mask)
+    {
+      if (rpos >= input_size)
+        return YAY0_ERR_TRUNCATED;
+      ++rpos;
+      ++produced;
+      if (s)
+        ++s->literals;
+    }
+    else
+    {
+      if (cpos + 2 > input_size)
+        return YAY0_ERR_TRUNCATED;
+      token = ((unsigned int)input[cpos] << 8) | input[cpos + 1];
+      cpos += 2;
+      dist = (token & 0xFFFu) + 1;
+      len = token >> 12;
+      if (!len)
+      {
+        if (rpos >= input_size)
+          return YAY0_ERR_TRUNCATED;
+        len = input[rpos++] + 18u;
+      }
+      else
+        len += 2;
+      if (dist > produced + history)
+        return YAY0_ERR_BACKREF;
+      /* The decoder stops at the declared size, even inside a match */
+      produced += len;
+
+      if (s)
+        walk_count_match(s, len, dist);
+    }
+    mask >>= 1;
+  }
+
+  if (end)
+  {
+    end->flag = fpos;
+    end->comp = cpos;
+    end->raw = rpos;
+    end->out = produced;
+  }
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_measure(const uint8_t *input, size_t input_size,
+  size_t *compressed_size, size_t *decompressed_size)
+{
+  return yay0_measure_dict(input, input_size, 0, compressed_size,
+                           decompressed_size);
+}
+
+yay0_result yay0_measure_dict(const uint8_t *input, size_t input_size,
+  size_t dict_size, size_t *compressed_size, size_t *decompressed_size)
+{
+  yay0_walk_end_t end;
+  yay0_result result;
+
+  if (dict_size > YAY0_DICT_SIZE_MAX)
+    dict_size = YAY0_DICT_SIZE_MAX;
+  result = dec_walk(input, input_size, dict_size, NULL, &end, NULL);
+  if (result != YAY0_OK)
+    return result;
+  if (compressed_size)
+    *compressed_size = walk_end_max(&end);
+  if (decompressed_size)
+    *decompressed_size = read_be_u32(input + 4);
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_measure_any(const uint8_t *input, size_t input_size,
+  yay0_format *format, size_t *compressed_size, size_t *decompressed_size)
+{
+  yay0_format found;
+  yay0_result result;
+  size_t size, end = 0;
+
+  result = yay0_format_detect(input, input_size, &found, &size);
+  if (result == YAY0_OK && found == YAY0_FORMAT_YAY0)
+    result = yay0_measure(input, input_size, &end, &size);
+  else if (result == YAY0_OK && found == YAY0_FORMAT_YAZ0)
+    result = dec_yaz0(input, input_size, NULL, size, &end);
+  else if (result == YAY0_OK)
+    result = dec_mio0(input, input_size, NULL, size, &end);
+  if (result != YAY0_OK)
+    return result;
+  if (format)
+    *format = found;
+  if (compressed_size)
+    *compressed_size = end;
+  if (decompressed_size)
+    *decompressed_size = size;
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_validate(const uint8_t *input, size_t input_size,
+  size_t *decompressed_size)
+{
+  yay0_walk_end_t end;
+  uint32_t comp_off, raw_off;
+  yay0_result result = dec_walk(input, input_size, 0, NULL, &end, NULL);
+
+  if (result != YAY0_OK)
+    return result;
+  comp_off = read_be_u32(input + 8);
+  raw_off = read_be_u32(input + 12);
+
+  /* No match may run past the end, and flags only pad out their last word */
+  if (end.out != read_be_u32(input + 4) ||
+      (comp_off < raw_off ? comp_off : raw_off) - end.flag > 3)
+    return YAY0_ERR_FORMAT;
+  /* Each of the other two streams runs right up to whatever follows it */
+  if (comp_off <= raw_off ? end.comp != raw_off || end.raw != input_size :
+                            end.raw != comp_off || end.comp != input_size)
+    return YAY0_ERR_FORMAT;
+  if (decompressed_size)
+    *decompressed_size = end.out;
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_decompress_ex(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t *output_size, yay0_stats *stats)
+{
+  yay0_result result;
+  double start;
+
+  if (!stats)
+    return yay0_decompress(input, input_size, output, output_size);
+
+  start = yay0_time_now();
+  result = yay0_decompress(input, input_size, output, output_size);
+  stats->time_decode += yay0_time_now() - start;
+  if (result == YAY0_OK)
+    dec_walk(input, input_size, 0, stats, NULL, NULL);
+
+  return result;
+}
+
+/* Serialized index: magic, version, then big-endian fields */
+#define YAY0_INDEX_MAGIC "Y0ix"
+#define YAY0_INDEX_VERSION 1u
+#define YAY0_INDEX_HEADER_SIZE 24u
+#define YAY0_INDEX_POINT_SIZE 16u
+
+void yay0_index_destroy(yay0_index_t *index)
+{
+  if (index)
+  {
+    yay0_allocator mem = index->mem;
+
+    mem_free(&mem, index->points);
+    mem_free(&mem, index->windows);
+    mem_free(&mem, index);
+  }
+}
+
+/**
+ * Fill in the window before every checkpoint by decoding from one to the
+ * next, each time starting from the window just filled in, so that only
+ * 4 KB and the longest stretch between checkpoints are held at once
+ */
+static yay0_result index_fill_windows(yay0_index_t *index,
+  const uint8_t *input, size_t input_size)
+{
+  const yay0_checkpoint_t *cp = index->points;
+  yay0_flag_t flags;
+  yay0_region_t comp, raw;
+  yay0_result result = YAY0_OK;
+  uint32_t comp_off, raw_off, flag_end;
+  size_t span = 0, wlen, len;
+  uint8_t *buf = NULL, *w;
+  unsigned int i;
+
+  comp_off = read_be_u32(input + 8);
+  raw_off = read_be_u32(input + 12);
+  flag_end = comp_off < raw_off ? comp_off : raw_off;
+  for (i = 1; i < index->count; ++i)
+    if (cp[i].out - cp[i - 1].out > span)
+      span = cp[i].out - cp[i - 1].out;
+  if (span)
+  {
+    buf = (uint8_t*)mem_alloc(&index->mem, YAY0_WINDOW_SIZE + span);
+    if (!buf)
+      return YAY0_ERR_FORMAT;
+  }
+
+  /* Nothing comes before the first checkpoint, at the start */
+  if (index->count)
+    memset(index->windows, 0, YAY0_WINDOW_SIZE);
+  for (i = 1; result == YAY0_OK && i < index->count; ++i)
+  {
+    w = index->windows + (size_t)(i - 1) * YAY0_WINDOW_SIZE;
+    wlen = cp[i - 1].out < YAY0_WINDOW_SIZE ? cp[i - 1].out
+                                            : YAY0_WINDOW_SIZE;
+    memcpy(buf, w + YAY0_WINDOW_SIZE - wlen, wlen);
+    len = wlen + (cp[i].out - cp[i - 1].out);
+    flagreader_init(&flags, input + cp[i - 1].flag,
+                    flag_end - cp[i - 1].flag);
+    rr_init(&comp, input + cp[i - 1].comp, input_size - cp[i - 1].comp);
+    rr_init(&raw, input + cp[i - 1].raw, input_size - cp[i - 1].raw);
+    result = dec_run(&flags, &comp, &raw, buf, len, wlen);
+
+    w += YAY0_WINDOW_SIZE;
+    wlen = len < YAY0_WINDOW_SIZE ? len : YAY0_WINDOW_SIZE;
+    memset(w, 0, YAY0_WINDOW_SIZE - wlen);
+    memcpy(w + YAY0_WINDOW_SIZE - wlen, buf + len - wlen, wlen);
+  }
+  mem_free(&index->mem, buf);
+
+  return result;
+}
+
+yay0_result yay0_index_build(const uint8_t *input, size_t input_size,
+  size_t interval, yay0_index_t **index)
+{
+  yay0_index_t *idx;
+  yay0_result result;
+  yay0_walk_end_t end;
+
+  if (!index)
+    return YAY0_ERR_FORMAT;
+  *index = NULL;
+  if (!interval)
+    interval = YAY0_INDEX_INTERVAL_DEFAULT;
+  if (interval > 0x7FFFFFFFu || input_size > 0xFFFFFFFFu)
+    return YAY0_ERR_FORMAT;
+  /* Only a size the tokens really produce may size the checkpoints */
+  result = dec_walk(input, input_size, 0, NULL, &end, NULL);
+  if (result != YAY0_OK)
+    return result;
+
+  idx = (yay0_index_t*)mem_calloc(&yay0_mem, 1, sizeof(yay0_index_t));
+  if (!idx)
+    return YAY0_ERR_FORMAT;
+  idx->mem = yay0_mem;
+  idx->size = read_be_u32(input + 4);
+  idx->packed = (uint32_t)walk_end_max(&end);
+  idx->interval = (uint32_t)interval;
+  result = index_reserve(idx, idx->size) ? YAY0_OK : YAY0_ERR_FORMAT;
+  if (result == YAY0_OK)
+    result = dec_walk(input, input_size, 0, NULL, NULL, idx);
+  if (result == YAY0_OK)
+  {
+    idx->windows = (uint8_t*)mem_alloc(&idx->mem,
+      (size_t)idx->count * YAY0_WINDOW_SIZE + 1);
+    result = idx->windows ? index_fill_windows(idx, input, input_size)
+                          : YAY0_ERR_FORMAT;
+  }
+
+  if (result != YAY0_OK)
+    yay0_index_destroy(idx);
+  else
+    *index = idx;
+
+  return result;
+}
+
+size_t yay0_index_serialized_size(const yay0_index_t *index)
+{
+  return index ? YAY0_INDEX_HEADER_SIZE + (size_t)index->count *
+                 (YAY0_INDEX_POINT_SIZE + YAY0_WINDOW_SIZE) : 0;
+}
+
+yay0_result yay0_index_save(const yay0_index_t *index, uint8_t *output,
+  size_t output_capacity, size_t *written)
+{
+  size_t total = yay0_index_serialized_size(index), pos;
+  unsigned int i;
+
+  if (!index || !output || !written)
+    return YAY0_ERR_FORMAT;
+  if (total > output_capacity)
+    return YAY0_ERR_OUTPUT_SMALL;
+
+  memcpy(output, YAY0_INDEX_MAGIC, 4);
+  be_write_u32(output + 4, YAY0_INDEX_VERSION);
+  be_write_u32(output + 8, index->size);
+  be_write_u32(output + 12, index->packed);
+  be_write_u32(output + 16, index->interval);
+  be_write_u32(output + 20, index->count);
+  pos = YAY0_INDEX_HEADER_SIZE;
+  for (i = 0; i < index->count; ++i, pos += YAY0_INDEX_POINT_SIZE)
+  {
+    be_write_u32(output + pos, index->points[i].out);
+    be_write_u32(output + pos + 4, index->points[i].flag);
+    be_write_u32(output + pos + 8, index->points[i].comp);
+    be_write_u32(output + pos + 12, index->points[i].raw);
+  }
+  memcpy(output + pos, index->windows, (size_t)index->count * YAY0_WINDOW_SIZE);
+  *written = total;
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_index_load(const uint8_t *input, size_t input_size,
+  yay0_index_t **index)
+{
+  yay0_index_t *idx;
+  uint32_t count;
+  size_t pos;
+  unsigned int i;
+
+  if (!index)
+    return YAY0_ERR_FORMAT;
+  *index = NULL;
+  if (!input || input_size < YAY0_INDEX_HEADER_SIZE)
+    return YAY0_ERR_TRUNCATED;
+  if (memcmp(input, YAY0_INDEX_MAGIC, 4) != 0 ||
+      read_be_u32(input + 4) != YAY0_INDEX_VERSION)
+    return YAY0_ERR_FORMAT;
+  count = read_be_u32(input + 20);
+  if ((input_size - YAY0_INDEX_HEADER_SIZE) /
+      (YAY0_INDEX_POINT_SIZE + YAY0_WINDOW_SIZE) < count)
+    return YAY0_ERR_TRUNCATED;
+
+  idx = (yay0_index_t*)mem_calloc(&yay0_mem, 1, sizeof(yay0_index_t));
+  if (!idx)
+    return YAY0_ERR_FORMAT;
+  idx->mem = yay0_mem;
+  idx->size = read_be_u32(input + 8);
+  idx->packed = read_be_u32(input + 12);
+  idx->interval = read_be_u32(input + 16);
+  idx->count = idx->cap = count;
+  idx->points = (yay0_checkpoint_t*)mem_alloc(&idx->mem,
+    ((size_t)count + 1) * sizeof(yay0_checkpoint_t));
+  idx->windows = (uint8_t*)mem_alloc(&idx->mem,
+    (size_t)count * YAY0_WINDOW_SIZE + 1);
+  if (!idx->points || !idx->windows)
+  {
+    yay0_index_destroy(idx);
+    return YAY0_ERR_FORMAT;
+  }
+
+  pos = YAY0_INDEX_HEADER_SIZE;
+  for (i = 0; i < count; ++i, pos += YAY0_INDEX_POINT_SIZE)
+  {
+    idx->points[i].out = read_be_u32(input + pos);
+    idx->points[i].flag = read_be_u32(input + pos + 4);
+    idx->points[i].comp = read_be_u32(input + pos + 8);
+    idx->points[i].raw = read_be_u32(input + pos + 12);
+  }
+  memcpy(idx->windows, input + pos, (size_t)count * YAY0_WINDOW_SIZE);
+  *index = idx;
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_decompress_range(const uint8_t *input, size_t input_size,
+  const yay0_index_t *index, size_t offset, size_t length, uint8_t *output)
+{
+  const yay0_checkpoint_t *cp;
+  yay0_flag_t flags;
+  yay0_region_t comp, raw;
+  yay0_result result;
+  size_t lo, hi, wlen, need;
+  uint32_t comp_off, raw_off, flag_end;
+  uint8_t *buf;
+
+  if (!input || !index || (!output && length))
+    return YAY0_ERR_FORMAT;
+  if (input_size < YAY0_HEADER_SIZE)
+    return YAY0_ERR_TRUNCATED;
+  if (!yay0_validate_magic(input, input_size) ||
+      read_be_u32(input + 4) != index->size)
+    return YAY0_ERR_FORMAT;
+  if (input_size < index->packed)
+    return YAY0_ERR_TRUNCATED;
+  if (offset > index->size || length > index->size - offset)
+    return YAY0_ERR_OUTPUT_SMALL;
+  if (!length)
+    return YAY0_OK;
+  else if (!index->count)
+    return YAY0_ERR_FORMAT;
+
+  /* Last checkpoint at or before offset; the first one is at 0 */
+  lo = 0;
+  hi = index->count;
+  while (hi - lo > 1)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (index->points[mid].out <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  cp = &index->points[lo];
+
+  /* An index from another file could point anywhere */
+  comp_off = read_be_u32(input + 8);
+  raw_off = read_be_u32(input + 12);
+  flag_end = comp_off < raw_off ? comp_off : raw_off;
+  if (cp->flag > flag_end || cp->comp > input_size || cp->raw > input_size ||
+      cp->out > offset)
+    return YAY0_ERR_FORMAT;
+
+  /* Window, then everything from the checkpoint up to the end of the range */
+  wlen = cp->out < YAY0_WINDOW_SIZE ? cp->out : YAY0_WINDOW_SIZE;
+  need = wlen + (offset + length - cp->out);
+  buf = (uint8_t*)mem_alloc(&yay0_mem, need);
+  if (!buf)
+    return YAY0_ERR_FORMAT;
+  memcpy(buf, index->windows + (size_t)lo * YAY0_WINDOW_SIZE +
+         YAY0_WINDOW_SIZE - wlen, wlen);
+
+  flagreader_init(&flags, input + cp->flag, flag_end - cp->flag);
+  rr_init(&comp, input + cp->comp, input_size - cp->comp);
+  rr_init(&raw, input + cp->raw, input_size - cp->raw);
+  result = dec_run(&flags, &comp, &raw, buf, need, wlen);
+  if (result == YAY0_OK)
+    memcpy(output, buf + need - length, length);
+  mem_free(&yay0_mem, buf);
+
+  return result;
+}
+
+/* Smallest segment yay0_decompress_parallel picks by itself */
+#define YAY0_SEGMENT_SIZE_MIN (256u * 1024u)
+
+/* A backreference that reads output from before its segment was decoded */
+typedef struct
+{
+  size_t dst;
+  unsigned int distance, length;
+} yay0_fixup_t;
+
+typedef struct
+{
+  const uint8_t *input;
+  size_t input_size;
+  uint8_t *output;
+  const yay0_index_t *index;
+  /* Per segment: deferred backreferences, in output order */
+  yay0_fixup_t **fixups;
+  size_t *nfixups;
+  yay0_result *results;
+} yay0_par_job_t;
+
+/* Whether [src, src + len) overlaps any of the sorted, disjoint fixups */
+static int dec_fixup_overlaps(const yay0_fixup_t *fix, size_t nfix,
+  size_t src, size_t len)
+{
+  size_t lo = 0, hi = nfix;
+
+  /* First fixup ending after src */
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (fix[mid].dst + fix[mid].length <= src)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo < nfix && fix[lo].dst < src + len;
+}
+
+/**
+ * Decode one segment straight into the shared output. A backreference is
+ * deferred if it reads from before the segment or from bytes of a
+ * deferred one; its bytes are filled in later, once the previous segment
+ * is complete. Once the last 4 KB of output hold no deferred bytes
+ * nothing later can depend on them, and the plain decoder finishes the
+ * segment.
+ */
+static void dec_segment_task(void *arg, size_t index, unsigned int worker)
+{
+  yay0_par_job_t *job = (yay0_par_job_t*)arg;
+  const yay0_checkpoint_t *cp = &job->index->points[index];
+  const uint8_t *input = job->input;
+  uint8_t *output = job->output;
+  size_t start = cp->out, out = start, end, nfix = 0, cap = 0;
+  uint32_t comp_off = read_be_u32(input + 8), raw_off = read_be_u32(input + 12);
+  yay0_fixup_t *fix = NULL;
+  yay0_flag_t flags;
+  yay0_region_t comp, raw;
+  yay0_result result = YAY0_OK;
+
+  (void)worker;
+  end = index + 1 < job->index->count ? job->index->points[index + 1].out :
+                                        job->index->size;
+  flagreader_init(&flags, input + cp->flag,
+                  (comp_off < raw_off ? comp_off : raw_off) - cp->flag);
+  rr_init(&comp, input + cp->comp, job->input_size - cp->comp);
+  rr_init(&raw, input + cp->raw, job->input_size - cp->raw);
+
+  /* The first segment depends on nothing */
+  while (index && out < end &&
+         (out - start < YAY0_WINDOW_SIZE || flags.bit_mask ||
+          (nfix && out - (fix[nfix - 1].dst + fix[nfix - 1].length) <
+                     YAY0_WINDOW_SIZE)))
+  {
+    int bit = flagreader_readbit(&flags);
+
+    if (bit < 0)
+    {
+      result = YAY0_ERR_TRUNCATED;
+      break;
+    }
+    if (bit)
+    {
+      int v = rr_read_u8(&raw);
+
+      if (v < 0)
+      {
+        result = YAY0_ERR_TRUNCATED;
+        break;
+      }
+      output[out++] = (uint8_t)v;
+    }
+    else
+    {
+      int hi = rr_read_u8(&comp), lo = rr_read_u8(&comp);
+      size_t distance, length, src, i;
+
+      if (lo < 0)
+      {
+        result = YAY0_ERR_TRUNCATED;
+        break;
+      }
+      distance = ((size_t)(hi & 0x0F) << 8 | (size_t)lo) + 1;
+      length = (size_t)hi >> 4;
+      if (!length)
+      {
+        int ext = rr_read_u8(&raw);
+
+        if (ext < 0)
+        {
+          result = YAY0_ERR_TRUNCATED;
+          break;
+        }
+        length = (size_t)ext + 0x12;
+      }
+      else
+        length += 2;
+      if (distance > out)
+      {
+        result = YAY0_ERR_BACKREF;
+        break;
+      }
+      if (length > end - out)
+        length = end - out;
+
+      /* Bytes of the match itself that it copies were checked as sources */
+      src = out - distance;
+      if (src < start || dec_fixup_overlaps(fix, nfix, src,
+                                            distance < length ? distance
+                                                              : length))
+      {
+        if (nfix == cap)
+        {
+          yay0_fixup_t *grown;
+
+          cap = cap ? cap * 2 : 64;
+          grown = (yay0_fixup_t*)mem_realloc(&yay0_mem, fix,
+            nfix * sizeof(yay0_fixup_t), cap * sizeof(yay0_fixup_t));
+          if (!grown)
+          {
+            result = YAY0_ERR_FORMAT;
+            break;
+          }
+          fix = grown;
+        }
+        fix[nfix].dst = out;
+        fix[nfix].distance = (unsigned int)distance;
+        fix[nfix].length = (unsigned int)length;
+        ++nfix;
+      }
+      else
+        for (i = 0; i < length; ++i)
+          output[out + i] = output[src + i];
+      out += length;
+    }
+  }
+
+  if (result == YAY0_OK && out < end)
+    result = dec_run(&flags, &comp, &raw, output, end, out);
+  job->fixups[index] = fix;
+  job->nfixups[index] = nfix;
+  job->results[index] = result;
+}
+
+yay0_result yay0_decompress_parallel(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t *output_size, unsigned int threads,
+  size_t segment_size)
+{
+  yay0_index_t index;
+  yay0_par_job_t job;
+  yay0_result result;
+  size_t size, k, f, i;
+
+  result = yay0_get_decompressed_size(input, input_size, &size);
+  if (result != YAY0_OK)
+    return result;
+  if (!output || !output_size)
+    return YAY0_ERR_FORMAT;
+  if (size > *output_size)
+    return YAY0_ERR_OUTPUT_SMALL;
+  if (!segment_size)
+  {
+    /* A few segments per thread to even out the load */
+    segment_size = size / (4 * (size_t)yay0_parallel_threads(threads, size));
+    if (segment_size < YAY0_SEGMENT_SIZE_MIN)
+      segment_size = YAY0_SEGMENT_SIZE_MIN;
+  }
+  if (segment_size < YAY0_WINDOW_SIZE)
+    segment_size = YAY0_WINDOW_SIZE;
+  if (threads == 1 || size <= segment_size || segment_size > 0x7FFFFFFFu ||
+      input_size > 0xFFFFFFFFu)
+    return yay0_decompress(input, input_size, output, output_size);
+
+  /* Phase one: stream positions at each segment start, checking the file */
+  memset(&index, 0, sizeof(index));
+  index.size = (uint32_t)size;
+  index.interval = (uint32_t)segment_size;
+  index.mem = yay0_mem;
+  if (!index_reserve(&index, size))
+    return YAY0_ERR_FORMAT;
+  result = dec_walk(input, input_size, 0, NULL, NULL, &index);
+  if (result != YAY0_OK)
+  {
+    mem_free(&index.mem, index.points);
+    return result;
+  }
+
+  /* Phase two: all segments at once, then deferred copies in order */
+  job.input = input;
+  job.input_size = input_size;
+  job.output = output;
+  job.index = &index;
+  job.fixups = (yay0_fixup_t**)mem_calloc(&yay0_mem, index.count,
+                                          sizeof(yay0_fixup_t*));
+  job.nfixups = (size_t*)mem_calloc(&yay0_mem, index.count, sizeof(size_t));
+  job.results = (yay0_result*)mem_calloc(&yay0_mem, index.count,
+                                         sizeof(yay0_result));
+  if (!job.fixups || !job.nfixups || !job.results)
+    result = YAY0_ERR_FORMAT;
+  else
+    mem_parallel_for(threads, index.count, dec_segment_task, &job);
+
+  for (k = 0; result == YAY0_OK && k < index.count; ++k)
+  {
+    result = job.results[k];
+    for (f = 0; result == YAY0_OK && f < job.nfixups[k]; ++f)
+    {
+      const yay0_fixup_t *fx = &job.fixups[k][f];
+      uint8_t *dst = output + fx->dst;
+      const uint8_t *src = dst - fx->distance;
+
+      for (i = 0; i < fx->length; ++i)
+        dst[i] = src[i];
+    }
+  }
+
+  if (job.fixups)
+    for (k = 0; k < index.count; ++k)
+      mem_free(&yay0_mem, job.fixups[k]);
+  mem_free(&yay0_mem, job.fixups);
+  mem_free(&yay0_mem, job.nfixups);
+  mem_free(&yay0_mem, job.results);
+  mem_free(&index.mem, index.points);
+  if (result == YAY0_OK)
+    *output_size = size;
+
+  return result;
+}
+
+/* Bytes buffered at a time from each of the three streams */
+#define YAY0_STREAM_BUF 512u
+
+typedef struct
+{
+  /* File offset of buf[0] */
+  size_t offset;
+  /* File offset the stream may not read past */
+  size_t end;
+  uint8_t buf[YAY0_STREAM_BUF];
+  unsigned int pos, len;
+} yay0_stream_t;
+
+struct yay0_decoder_s
+{
+  /* Header bytes gathered so far; streams are set up once all 16 arrive */
+  uint8_t header[YAY0_HEADER_SIZE];
+  unsigned int header_len;
+
+  yay0_stream_t flags, comp, raw;
+
+  /* Stream the decoder is waiting on, NULL while reading the header */
+  yay0_stream_t *want;
+  /* File offset at which input was reported to end */
+  size_t eof;
+  /* Sticky error, once decoding failed */
+  yay0_result error;
+
+  uint32_t total;
+  uint32_t produced;
+
+  /* Current flag byte and the bit to read from it next, 0 when used up */
+  uint8_t flag;
+  unsigned int flag_mask;
+
+  /* Backreference being copied out */
+  unsigned int match_dist;
+  unsigned int match_left;
+
+  /* The last 4 KB of output, indexed by output position */
+  uint8_t window[YAY0_WINDOW_SIZE];
+
+  /* Where the decoder came from */
+  yay0_allocator mem;
+};
+
+yay0_decoder_t *yay0_decoder_create(void)
+{
+  return yay0_decoder_create_with(NULL);
+}
+
+yay0_decoder_t *yay0_decoder_create_with(const yay0_allocator *allocator)
+{
+  const yay0_allocator *a = allocator ? allocator : &yay0_mem;
+  yay0_decoder_t *dec = (yay0_decoder_t*)mem_alloc(a,
+                                                   sizeof(yay0_decoder_t));
+
+  if (dec)
+  {
+    dec->mem = *a;
+    yay0_decoder_reset(dec);
+  }
+
+  return dec;
+}
+
+size_t yay0_decoder_scratch_size(void)
+{
+  return sizeof(yay0_decoder_t);
+}
+
+void yay0_decoder_reset(yay0_decoder_t *dec)
+{
+  if (!dec)
+    return;
+  dec->header_len = 0;
+  dec->want = NULL;
+  dec->eof = (size_t)-1;
+  dec->error = YAY0_OK;
+  dec->total = 0;
+  dec->produced = 0;
+  dec->flag_mask = 0;
+  dec->match_left = 0;
+}
+
+void yay0_decoder_destroy(yay0_decoder_t *dec)
+{
+  if (dec)
+  {
+    yay0_allocator mem = dec->mem;
+
+    mem_free(&mem, dec);
+  }
+}
+
+static void stream_init(yay0_stream_t *s, size_t offset, size_t end)
+{
+  s->offset = offset;
+  s->end = end;
+  s->pos = 0;
+  s->len = 0;
+}
+
+size_t yay0_decoder_want(const yay0_decoder_t *dec)
+{
+  const yay0_stream_t *s;
+
+  if (!dec)
+    return 0;
+  else if (!dec->want)
+    return dec->header_len;
+  s = dec->want;
+
+  return s->offset + s->len;
+}
+
+size_t yay0_decoder_feed(yay0_decoder_t *dec, const uint8_t *data, size_t len)
+{
+  yay0_stream_t *s;
+  size_t room, want;
+
+  if (!dec)
+    return 0;
+  want = yay0_decoder_want(dec);
+  if (!data || !len)
+  {
+    if (want < dec->eof)
+      dec->eof = want;
+    return 0;
+  }
+
+  if (!dec->want)
+  {
+    room = YAY0_HEADER_SIZE - dec->header_len;
+    if (len > room)
+      len = room;
+    memcpy(dec->header + dec->header_len, data, len);
+    dec->header_len += (unsigned int)len;
+
+    return len;
+  }
+
+  /* Make room at the end of the buffer, never reading past the stream end */
+  s = dec->want;
+  if (s->pos)
+  {
+    memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+    s->offset += s->pos;
+    s->len -= s->pos;
+    s->pos = 0;
+  }
+  room = YAY0_STREAM_BUF - s->len;
+  if (s->end - want < room)
+    room = s->end - want;
+  if (len > room)
+    len = room;
+  memcpy(s->buf + s->len, data, len);
+  s->len += (unsigned int)len;
+
+  return len;
+}
+
+/**
+ * Make sure 'count' bytes of the stream are buffered. Otherwise returns
+ * YAY0_NEED_INPUT and waits on the stream, or YAY0_ERR_TRUNCATED if the
+ * stream or the input ends first.
+ */
+static yay0_result stream_need(yay0_decoder_t *dec, yay0_stream_t *s,
+  unsigned int count)
+{
+  size_t have_end;
+
+  if (s->len - s->pos >= count)
+    return YAY0_OK;
+  have_end = s->offset + s->len;
+  if (have_end >= s->end || have_end >= dec->eof)
+    return YAY0_ERR_TRUNCATED;
+  dec->want = s;
+
+  return YAY0_NEED_INPUT;
+}
+
+static yay0_result decoder_read_header(yay0_decoder_t *dec)
+{
+  uint32_t comp_off, raw_off, min_off;
+
+  if (dec->header_len < YAY0_HEADER_SIZE)
+    return dec->eof <= dec->header_len ? YAY0_ERR_TRUNCATED : YAY0_NEED_INPUT;
+  if (!yay0_validate_magic(dec->header, YAY0_HEADER_SIZE))
+    return YAY0_ERR_FORMAT;
+
+  dec->total = read_be_u32(dec->header + 4);
+  comp_off = read_be_u32(dec->header + 8);
+  raw_off = read_be_u32(dec->header + 12);
+  min_off = (comp_off < raw_off) ? comp_off : raw_off;
+  if (min_off < YAY0_HEADER_SIZE)
+    return YAY0_ERR_FORMAT;
+
+  stream_init(&dec->flags, YAY0_HEADER_SIZE, min_off);
+  stream_init(&dec->comp, comp_off, (size_t)-1);
+  stream_init(&dec->raw, raw_off, (size_t)-1);
+  dec->want = &dec->flags;
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_decoder_size(const yay0_decoder_t *dec, size_t *out_size)
+{
+  if (!dec || !out_size)
+    return YAY0_ERR_FORMAT;
+  else if (!dec->want)
+    return YAY0_NEED_INPUT;
+  *out_size = dec->total;
+
+  return YAY0_OK;
+}
+
+int yay0_decoder_done(const yay0_decoder_t *dec)
+{
+  return dec && dec->want && dec->produced == dec->total &&
+         !dec->match_left;
+}
+
+/* Decode as far as the buffered input and the output space allow */
+static yay0_result decoder_run(yay0_decoder_t *dec, uint8_t *output,
+  size_t output_size, size_t *written)
+{
+  size_t out = *written;
+  yay0_result result = YAY0_OK;
+
+  while (out < output_size)
+  {
+    yay0_stream_t *comp = &dec->comp, *raw = &dec->raw;
+
+    if (dec->match_left)
+    {
+      uint32_t p = dec->produced;
+      uint8_t b;
+
+      do
+      {
+        b = dec->window[(p - dec->match_dist) & YAY0_WINDOW_MASK];
+        dec->window[p & YAY0_WINDOW_MASK] = b;
+        output[out++] = b;
+        ++p;
+      } while (--dec->match_left && out < output_size);
+      dec->produced = p;
+      continue;
+    }
+    if (dec->produced == dec->total)
+      break;
+
+    if (!dec->flag_mask)
+    {
+      result = stream_need(dec, &dec->flags, 1);
+      if (result != YAY0_OK)
+        break;
+      dec->flag = dec->flags.buf[dec->flags.pos++];
+      dec->flag_mask = 0x80;
+    }
+
+    if (dec->flag & dec->flag_mask)
+    {
+      uint8_t b;
+
+      result = stream_need(dec, raw, 1);
+      if (result != YAY0_OK)
+        break;
+      b = raw->buf[raw->pos++];
+      dec->window[dec->produced++ & YAY0_WINDOW_MASK] = b;
+      output[out++] = b;
+    }
+    else
+    {
+      const uint8_t *tok;
+      unsigned int length, distance;
+
+      /* Nothing is consumed until the whole backreference is buffered */
+      result = stream_need(dec, comp, 2);
+      if (result != YAY0_OK)
+        break;
+      tok = comp->buf + comp->pos;
+      length = tok[0] >> 4;
+      if (length == 0)
+      {
+        result = stream_need(dec, raw, 1);
+        if (result != YAY0_OK)
+          break;
+        length = (unsigned int)raw->buf[raw->pos++] + 0x12;
+      }
+      else
+        length += 2;
+      distance = ((unsigned int)(tok[0] & 0x0F) << 8 | tok[1]) + 1;
+      comp->pos += 2;
+
+      if (distance > dec->produced)
+      {
+        result = YAY0_ERR_BACKREF;
+        break;
+      }
+      dec->match_dist = distance;
+      dec->match_left = length;
+      if (dec->match_left > dec->total - dec->produced)
+        dec->match_left = dec->total - dec->produced;
+    }
+    dec->flag_mask >>= 1;
+  }
+  *written = out;
+
+  return result;
+}
+
+yay0_result yay0_decoder_pull(yay0_decoder_t *dec, uint8_t *output,
+  size_t output_size, size_t *written)
+{
+  yay0_result result;
+
+  if (!written)
+    return YAY0_ERR_FORMAT;
+  *written = 0;
+  if (!dec || (!output && output_size))
+    return YAY0_ERR_FORMAT;
+  else if (dec->error != YAY0_OK)
+    return dec->error;
+
+  if (!dec->want)
+  {
+    result = decoder_read_header(dec);
+    if (result != YAY0_OK)
+    {
+      if (result != YAY0_NEED_INPUT)
+        dec->error = result;
+      return result;
+    }
+  }
+
+  result = decoder_run(dec, output, output_size, written);
+  if (result != YAY0_OK && result != YAY0_NEED_INPUT)
+    dec->error = result;
+
+  return result;
+}
+
+/* Initial capacity, in entries, of each of the encoder's scratch buffers */
+#define YAY0_ENC_CHUNK 4096u
+
+/* Hash chain match finder: 3-byte prefixes hashed into 2^15 chain heads */
+#define YAY0_HASH_BITS 15
+#define YAY0_HASH_SIZE (1u << YAY0_HASH_BITS)
+#define YAY0_CHAIN_DEFAULT 256u
+
+/* Runs stmt when the encoder is collecting statistics */
+#ifndef YAY0_NO_STATS
+#define YAY0_STAT(enc, stmt) do { if ((enc)->stats) { stmt; } } while (0)
+#else
+#define YAY0_STAT(enc, stmt) do { if (0) { stmt; } } while (0)
+#endif
+
+struct yay0_encoder_s
+{
+  /**
+   * Input currently being compressed. Only [start, insize) is encoded; the
+   * bytes before start are history that matches may point back into.
+   */
+  const uint8_t *bz;
+  unsigned int start;
+  unsigned int insize;
+
+  /* Match finder in use and its chain depth limit */
+  yay0_search search;
+  unsigned int max_chain;
+
+  /**
+   * Positions past a match the parser looks at for a longer one, and the
+   * match length at which searching stops early
+   */
+  unsigned int lazy_depth;
+  unsigned int nice_len;
+
+  /* Boyer-Moore-like skip table used by enc_mischarsearch() */
+  unsigned short skip[256];
+
+  /**
+   * Hash chains over the 4 KB window: head[] holds the most recent position
+   * (plus one, zero meaning empty) for each 3-byte prefix hash, prev[] links
+   * each position in the window to the previous one with the same hash.
+   * Positions below 'ins' have been inserted.
+   */
+  uint32_t head[YAY0_HASH_SIZE];
+  uint32_t prev[YAY0_WINDOW_SIZE];
+  unsigned int ins;
+
+  /* Chain positions gathered by enc_exact_search(), newest first */
+  uint32_t cand[YAY0_WINDOW_SIZE];
+
+  /**
+   * Last answer of the single-byte run shortcut, enc_run_search(): the
+   * earliest position where 'run_len' copies of 'run_byte' start. Zero
+   * run_len means nothing is cached.
+   */
+  unsigned int run_pos, run_len;
+  uint8_t run_byte;
+
+  /* Parsing strategy */
+  yay0_parse parse;
+
+  /**
+   * Optimal parse scratch, one entry per input position: the longest match
+   * there, its position, and the cheapest encoding cost in bits of the
+   * rest of the input from there on
+   */
+  uint32_t *opt_pos;
+  uint16_t *opt_len;
+  uint32_t *opt_cost;
+  unsigned int nopt_pos, nopt_len, nopt_cost;
+
+  /* 32-bit flag words */
+  uint32_t *cmd;
+  unsigned int cp, ncp;
+  /* Bit within cmd[cp] the next literal/backreference flag goes to */
+  uint32_t mask;
+  /* Flag bits used so far */
+  unsigned int items;
+
+  /* Compressed tokens */
+  uint16_t *pol;
+  unsigned int pp, npp;
+
+  /* Literals and extra length bytes */
+  uint8_t *def;
+  unsigned int dp, ndp;
+
+  /**
+   * Preset dictionary, and the scratch it is copied into with the input
+   * after it, so that it is history for the match finders
+   */
+  const uint8_t *dict;
+  unsigned int dict_size;
+  uint8_t *join;
+  unsigned int njoin;
+
+  /**
+   * Set when the context and its buffers live in caller memory given to
+   * yay0_encoder_create_in, so they are never grown or freed
+   */
+  int fixed;
+
+  /**
+   * Where the context and its buffers come from. With a caller's
+   * allocator, 'exact' is set and buffers are sized for the whole input
+   * rather than doubled, to keep peak memory down to the scratch size.
+   */
+  yay0_allocator mem;
+  int exact;
+
+  /* Statistics being collected, or NULL */
+  yay0_stats *stats;
+};
+
+yay0_encoder_t *yay0_encoder_create(void)
+{
+  return yay0_encoder_create_with(NULL);
+}
+
+yay0_encoder_t *yay0_encoder_create_with(const yay0_allocator *allocator)
+{
+  const yay0_allocator *a = allocator ? allocator : &yay0_mem;
+  yay0_encoder_t *enc = (yay0_encoder_t*)mem_calloc(a, 1,
+                                                    sizeof(yay0_encoder_t));
+
+  if (enc)
+  {
+    yay0_params params;
+
+    enc->mem = *a;
+    enc->exact = a->alloc != heap_alloc;
+    yay0_params_init(&params, YAY0_LEVEL_DEFAULT);
+    yay0_encoder_set_params(enc, &params);
+  }
+
+  return enc;
+}
+
+void yay0_params_init(yay0_params *p, int level)
+{
+  /* search, chain depth, lazy depth, nice length for levels 1 to 9 */
+  static const struct
+  {
+    yay0_search search;
+    unsigned short max_chain, lazy_depth, nice_len;
+  } levels[9] =
+  {
+    { YAY0_SEARCH_CHAIN,    4, 0,  16 },
+    { YAY0_SEARCH_CHAIN,    8, 0,  32 },
+    { YAY0_SEARCH_CHAIN,   16, 1,  64 },
+    { YAY0_SEARCH_CHAIN,   32, 1, 128 },
+    { YAY0_SEARCH_CHAIN,   64, 1, YAY0_MATCH_LEN_MAX },
+    { YAY0_SEARCH_CHAIN,  256, 1, YAY0_MATCH_LEN_MAX },
+    { YAY0_SEARCH_CHAIN, 1024, 1, YAY0_MATCH_LEN_MAX },
+    { YAY0_SEARCH_EXACT,    0, 1, YAY0_MATCH_LEN_MAX },
+    { YAY0_SEARCH_EXACT,    0, 1, YAY0_MATCH_LEN_MAX }
+  };
+
+  if (!p)
+    return;
+  memset(p, 0, sizeof(*p));
+  if (level < YAY0_LEVEL_MIN || level > YAY0_LEVEL_MAX)
+  {
+    /* Same matches as the original encoder */
+    p->search = YAY0_SEARCH_EXACT;
+    p->parse = YAY0_PARSE_LAZY;
+    p->lazy_depth = 1;
+    p->nice_len = YAY0_MATCH_LEN_MAX;
+    return;
+  }
+  p->search = levels[level - 1].search;
+  p->max_chain = levels[level - 1].max_chain;
+  p->lazy_depth = levels[level - 1].lazy_depth;
+  p->nice_len = levels[level - 1].nice_len;
+  p->parse = level == YAY0_LEVEL_MAX ? YAY0_PARSE_OPTIMAL : YAY0_PARSE_LAZY;
+}
+
+/* The part of the parameters' dictionary that backreferences can reach */
+static const uint8_t *enc_dict(const yay0_params *p, unsigned int *size)
+{
+  size_t n = p->dict ? p->dict_size : 0;
+
+  if (n > YAY0_DICT_SIZE_MAX)
+    n = YAY0_DICT_SIZE_MAX;
+  *size = (unsigned int)n;
+
+  return n ? p->dict + p->dict_size - n : NULL;
+}
+
+void yay0_encoder_set_params(yay0_encoder_t *enc, const yay0_params *p)
+{
+  if (!enc || !p)
+    return;
+  yay0_encoder_set_search(enc, p->search, p->max_chain);
+  enc->parse = p->parse;
+  enc->lazy_depth = p->lazy_depth;
+  enc->nice_len = p->nice_len && p->nice_len < YAY0_MATCH_LEN_MAX ?
+    p->nice_len : YAY0_MATCH_LEN_MAX;
+  enc->stats = p->stats;
+  enc->dict = enc_dict(p, &enc->dict_size);
+}
+
+void yay0_encoder_set_search(yay0_encoder_t *enc, yay0_search search,
+  unsigned int max_chain)
+{
+  if (!enc)
+    return;
+  enc->search = search;
+  enc->max_chain = max_chain ? max_chain : YAY0_CHAIN_DEFAULT;
+}
+
+void yay0_encoder_set_parse(yay0_encoder_t *enc, yay0_parse parse)
+{
+  if (enc)
+    enc->parse = parse;
+}
+
+void yay0_encoder_reset(yay0_encoder_t *enc)
+{
+  if (!enc || enc->fixed)
+    return;
+  mem_free(&enc->mem, enc->cmd);
+  mem_free(&enc->mem, enc->pol);
+  mem_free(&enc->mem, enc->def);
+  mem_free(&enc->mem, enc->opt_pos);
+  mem_free(&enc->mem, enc->opt_len);
+  mem_free(&enc->mem, enc->opt_cost);
+  mem_free(&enc->mem, enc->join);
+  enc->cmd = NULL;
+  enc->pol = NULL;
+  enc->def = NULL;
+  enc->opt_pos = NULL;
+  enc->opt_len = NULL;
+  enc->opt_cost = NULL;
+  enc->join = NULL;
+  enc->ncp = 0;
+  enc->npp = 0;
+  enc->ndp = 0;
+  enc->nopt_pos = 0;
+  enc->nopt_len = 0;
+  enc->nopt_cost = 0;
+  enc->njoin = 0;
+}
+
+void yay0_encoder_destroy(yay0_encoder_t *enc)
+{
+  if (enc && !enc->fixed)
+  {
+    yay0_allocator mem = enc->mem;
+
+    yay0_encoder_reset(enc);
+    mem_free(&mem, enc);
+  }
+}
+
+/* Worst case entries of each buffer for an input of n bytes */
+#define YAY0_BOUND_CMD(n) ((n) / 32u + 2u)
+#define YAY0_BOUND_POL(n) ((n) / 3u + 1u)
+#define YAY0_BOUND_DEF(n) ((n) + 1u)
+
+size_t yay0_compress_bound(size_t input_size)
+{
+  /* Every item costs a flag bit and at most as many bytes as it covers */
+  return YAY0_HEADER_SIZE + 4 * ((input_size + 31) / 32) + input_size;
+}
+
+size_t yay0_compress_scratch_size_ex(size_t input_size, const yay0_params *p)
+{
+  unsigned int dict_size = 0;
+  size_t size;
+
+  if (input_size > INT_MAX)
+    return 0;
+  size = YAY0_ALIGN(sizeof(yay0_encoder_t)) +
+         YAY0_ALIGN(YAY0_BOUND_CMD(input_size) * sizeof(uint32_t)) +
+         YAY0_ALIGN(YAY0_BOUND_POL(input_size) * sizeof(uint16_t)) +
+         YAY0_ALIGN(YAY0_BOUND_DEF(input_size));
+  if (p && p->parse == YAY0_PARSE_OPTIMAL)
+    size += YAY0_ALIGN(input_size * sizeof(uint32_t)) +
+            YAY0_ALIGN(input_size * sizeof(uint16_t)) +
+            YAY0_ALIGN((input_size + 1) * sizeof(uint32_t));
+  if (p && enc_dict(p, &dict_size))
+    size += YAY0_ALIGN(dict_size + input_size);
+
+  return size;
+}
+
+size_t yay0_compress_scratch_size(size_t input_size)
+{
+  return yay0_compress_scratch_size_ex(input_size, NULL);
+}
+
+/* Hand out the next 'size' bytes of scratch memory */
+static void *enc_carve(uint8_t **mem, size_t size)
+{
+  void *p = *mem;
+
+  *mem += YAY0_ALIGN(size);
+
+  return p;
+}
+
+yay0_encoder_t *yay0_encoder_create_in(void *mem, size_t mem_size,
+  size_t max_input, const yay0_params *p)
+{
+  yay0_encoder_t *enc = (yay0_encoder_t*)mem;
+  yay0_params params;
+  uint8_t *next;
+  size_t need = yay0_compress_scratch_size_ex(max_input, p);
+
+  if (!mem || !need || mem_size < need)
+    return NULL;
+  if (!p)
+  {
+    yay0_params_init(&params, YAY0_LEVEL_DEFAULT);
+    p = &params;
+  }
+
+  memset(enc, 0, sizeof(*enc));
+  enc->mem = yay0_mem;
+  yay0_encoder_set_params(enc, p);
+  next = (uint8_t*)mem + YAY0_ALIGN(sizeof(yay0_encoder_t));
+  enc->ncp = YAY0_BOUND_CMD((unsigned int)max_input);
+  enc->cmd = (uint32_t*)enc_carve(&next, enc->ncp * sizeof(uint32_t));
+  enc->npp = YAY0_BOUND_POL((unsigned int)max_input);
+  enc->pol = (uint16_t*)enc_carve(&next, enc->npp * sizeof(uint16_t));
+  enc->ndp = YAY0_BOUND_DEF((unsigned int)max_input);
+  enc->def = (uint8_t*)enc_carve(&next, enc->ndp);
+  if (p->parse == YAY0_PARSE_OPTIMAL)
+  {
+    enc->nopt_pos = (unsigned int)max_input;
+    enc->opt_pos = (uint32_t*)enc_carve(&next, max_input * sizeof(uint32_t));
+    enc->nopt_len = (unsigned int)max_input;
+    enc->opt_len = (uint16_t*)enc_carve(&next, max_input * sizeof(uint16_t));
+    enc->nopt_cost = (unsigned int)max_input + 1;
+    enc->opt_cost = (uint32_t*)enc_carve(&next,
+      (max_input + 1) * sizeof(uint32_t));
+  }
+  if (enc->dict_size)
+  {
+    enc->njoin = enc->dict_size + (unsigned int)max_input;
+    enc->join = (uint8_t*)enc_carve(&next, enc->njoin);
+  }
+  enc->fixed = 1;
+
+  return enc;
+}
+
+/* Grow a scratch buffer so it holds at least 'need' entries */
+static int enc_reserve(yay0_encoder_t *enc, void **buf, unsigned int *cap,
+  unsigned int need, size_t entry_size)
+{
+  unsigned int new_cap;
+  void *p;
+
+  if (need <= *cap && *buf)
+    return 1;
+  else if (enc->fixed)
+    return 0;
+  new_cap = *cap ? *cap : YAY0_ENC_CHUNK;
+  while (new_cap < need)
+    new_cap *= 2;
+  if (enc->exact)
+    new_cap = need;
+  p = mem_realloc(&enc->mem, *buf, (size_t)*cap * entry_size,
+                  (size_t)new_cap * entry_size);
+  if (!p)
+    return 0;
+  *buf = p;
+  *cap = new_cap;
+  YAY0_STAT(enc, ++enc->stats->reallocs;
+            enc->stats->realloc_bytes += (size_t)new_cap * entry_size);
+
+  return 1;
+}
+
+/* Get ready to encode input[start..end), with input[0..start) as history */
+static int enc_begin(yay0_encoder_t *enc, const uint8_t *input,
+  unsigned int start, unsigned int end)
+{
+  unsigned int n;
+
+  enc->bz = input;
+  enc->start = start;
+  enc->insize = end;
+  enc->cp = 0;
+  enc->pp = 0;
+  enc->dp = 0;
+  enc->mask = 0x80000000u;
+  enc->items = 0;
+  /* Every searcher goes through enc_run_search(), whose cache is per input */
+  enc->run_len = 0;
+  if (enc->search != YAY0_SEARCH_SCAN)
+  {
+    memset(enc->head, 0, sizeof(enc->head));
+    enc->ins = start > YAY0_WINDOW_SIZE ? start - YAY0_WINDOW_SIZE : 0;
+  }
+
+  /* Exact contexts take the worst case now so they never grow */
+  n = enc->exact ? end - start : 0;
+  if (!enc_reserve(enc, (void**)&enc->cmd, &enc->ncp,
+                   n ? YAY0_BOUND_CMD(n) : 1, sizeof(uint32_t)) ||
+      !enc_reserve(enc, (void**)&enc->pol, &enc->npp,
+                   n ? YAY0_BOUND_POL(n) : 1, sizeof(uint16_t)) ||
+      !enc_reserve(enc, (void**)&enc->def, &enc->ndp,
+                   n ? YAY0_BOUND_DEF(n) : 1, sizeof(uint8_t)))
+    return 0;
+  enc->cmd[0] = 0;
+
+  return 1;
+}
+
+/**
+ * Get ready to encode a whole input. With a dictionary, it goes in front
+ * of a copy of the input as history, and only the input is encoded.
+ */
+static int enc_begin_input(yay0_encoder_t *enc, const uint8_t *input,
+  unsigned int size)
+{
+  if (!enc->dict_size)
+    return enc_begin(enc, input, 0, size);
+  if (!enc_reserve(enc, (void**)&enc->join, &enc->njoin,
+                   enc->dict_size + size, 1))
+    return 0;
+  memcpy(enc->join, enc->dict, enc->dict_size);
+  memcpy(enc->join + enc->dict_size, input, size);
+
+  return enc_begin(enc, enc->join, enc->dict_size, enc->dict_size + size);
+}
+
+/* Move on to the next flag bit, starting a new flag word when needed */
+static int enc_next_flag(yay0_encoder_t *enc)
+{
+  ++enc->items;
+  enc->mask >>= 1;
+  if (!enc->mask)
+  {
+    enc->mask = 0x80000000u;
+    if (!enc_reserve(enc, (void**)&enc->cmd, &enc->ncp, enc->cp + 2,
+                     sizeof(uint32_t)))
+      return 0;
+    enc->cmd[++enc->cp] = 0;
+  }
+
+  return 1;
+}
+
+static int enc_emit_literal(yay0_encoder_t *enc, uint8_t value)
+{
+  if (!enc_reserve(enc, (void**)&enc->def, &enc->ndp, enc->dp + 1, 1))
+    return 0;
+  enc->cmd[enc->cp] |= enc->mask;
+  enc->def[enc->dp++] = value;
+
+  return enc_next_flag(enc);
+}
+
+/* 'distance' is the encoded distance, i.e. one less than the real one */
+static int enc_emit_match(yay0_encoder_t *enc, unsigned int distance,
+  unsigned int length)
+{
+  if (!enc_reserve(enc, (void**)&enc->pol, &enc->npp, enc->pp + 1,
+                   sizeof(uint16_t)))
+    return 0;
+
+  if (length > 0x11u)
+  {
+    /* store long form: distance then extra length byte in def */
+    if (!enc_reserve(enc, (void**)&enc->def, &enc->ndp, enc->dp + 1, 1))
+      return 0;
+    enc->pol[enc->pp++] = (uint16_t)distance;
+    enc->def[enc->dp++] = (uint8_t)(length - 18);
+  }
+  else
+  {
+    /* store packed 16-bit token: distance (low 12) | ((len-2) << 12) */
+    enc->pol[enc->pp++] = (uint16_t)(distance | ((length - 2) << 12));
+  }
+
+  return enc_next_flag(enc);
+}
+
+static void enc_initskip(yay0_encoder_t *enc, const unsigned char *pattern,
+  int len)
+{
+  int i;
+  for (i = 0; i < 256; ++i)
+    enc->skip[i] = (unsigned short)len;
+  for (i = 0; i < len; ++i)
+    enc->skip[(unsigned char)pattern[i]] = (unsigned short)(len - i - 1);
+}
+
+/* Find the first occurrence of 'pattern' (length patternlen) in data
+   (length datalen) using a simple skip heuristic. Returns index within
+   'data' (0..datalen-1) where the pattern starts, or datalen if not found. */
+static int enc_mischarsearch(yay0_encoder_t *enc,
+                             const unsigned char *pattern, int patternlen,
+                             const unsigned char *data, int datalen)
+{
+  const unsigned short *skip = enc->skip;
+  int result = datalen;
+  int i, j, v6;
+
+  YAY0_STAT(enc, ++enc->stats->mischar_searches);
+  if (patternlen <= datalen) {
+    enc_initskip(enc, pattern, patternlen);
+    i = patternlen - 1;
+    for (;;) {
+      if (pattern[patternlen - 1] == data[i]) {
+        --i;
+        j = patternlen - 2;
+        if (j < 0) {
+          return i + 1;
+        }
+        while (pattern[j] == data[i]) {
+          --i;
+          --j;
+          if (j < 0)
+            return i + 1;
+        }
+        v6 = patternlen - j;
+        if (skip[data[i]] > (unsigned)v6)
+          v6 = skip[data[i]];
+        /* increment i by v6 below via loop increment */
+        i += v6;
+      } else {
+        v6 = skip[data[i]];
+        i += v6;
+      }
+      if (i >= datalen)
+        break;
+    }
+  }
+  return result;
+}
+
+/* Number of leading bytes, in memory order, that are zero in word */
+static unsigned int enc_zero_bytes(uint64_t word)
+{
+#if defined(__GNUC__) && YAY0_BIG_ENDIAN
+  return (unsigned int)__builtin_clzll(word) >> 3;
+#elif defined(__GNUC__)
+  return (unsigned int)__builtin_ctzll(word) >> 3;
+#else
+  uint8_t bytes[8];
+  unsigned int n = 0;
+
+  memcpy(bytes, &word, 8);
+  while (!bytes[n])
+    ++n;
+
+  return n;
+#endif
+}
+
+/**
+ * Number of equal bytes at a and b, up to max. Both must have max bytes
+ * readable. Compares 16 bytes per step with SSE2 where the compiler
+ * targets it (every x86-64), then 8 bytes per step with XOR, finding the
+ * first difference from the lowest set byte, and the tail bytewise.
+ */
+static unsigned int enc_match_len(const uint8_t *a, const uint8_t *b,
+  unsigned int max)
+{
+  unsigned int len = 0;
+  uint64_t x, y;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+  while (len + 16 <= max)
+  {
+    unsigned int eq = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i*)(a + len)),
+      _mm_loadu_si128((const __m128i*)(b + len))));
+
+    if (eq != 0xFFFFu)
+      return len + (unsigned int)__builtin_ctz(~eq);
+    len += 16;
+  }
+#endif
+  while (len + 8 <= max)
+  {
+    memcpy(&x, a + len, 8);
+    memcpy(&y, b + len, 8);
+    if (x != y)
+      return len + enc_zero_bytes(x ^ y);
+    len += 8;
+  }
+  while (len < max && a[len] == b[len])
+    ++len;
+
+  return len;
+}
+
+/**
+ * Padding and fills: if the next max_match_len bytes at cur_pos are all
+ * the same, the longest match is max_match_len long and the earliest spot
+ * in the window where that many copies start is where both the scan and
+ * the exact finder settle. A plain pass over the window finds it, and it
+ * stays the answer until it slides out. Returns 0 for anything else.
+ */
+static int enc_run_search(yay0_encoder_t *enc, unsigned cur_pos,
+  unsigned int limit, unsigned int max_match_len, int *match_pos_out,
+  unsigned *match_len_out)
+{
+  const uint8_t *bz = enc->bz;
+  const uint8_t *cur = &bz[cur_pos];
+
+  if (cur[1] != cur[0] || cur[max_match_len - 1] != cur[0] ||
+      enc_match_len(cur, cur + 1, max_match_len - 1) != max_match_len - 1)
+    return 0;
+
+  /* In a fill longer than the window the answer slides along with it */
+  if (enc->run_len == max_match_len && enc->run_byte == cur[0] &&
+      enc->run_pos < limit &&
+      enc_match_len(&bz[limit], cur, max_match_len) == max_match_len)
+    enc->run_pos = limit;
+  if (enc->run_len != max_match_len || enc->run_byte != cur[0] ||
+      enc->run_pos < limit)
+  {
+    unsigned int p, run = 0;
+
+    enc->run_len = 0;
+    for (p = limit; p < cur_pos; ++p)
+    {
+      if (bz[p] != cur[0])
+        run = 0;
+      else if (++run == max_match_len)
+        break;
+    }
+    /* A run reaching cur_pos continues into the bytes being matched */
+    if (run)
+    {
+      enc->run_pos = p - run + (p < cur_pos);
+      enc->run_len = max_match_len;
+      enc->run_byte = cur[0];
+    }
+  }
+  if (!enc->run_len)
+    return 0;
+  *match_pos_out = (int)enc->run_pos;
+  *match_len_out = max_match_len;
+
+  return 1;
+}
+
+static void enc_search(yay0_encoder_t *enc, unsigned cur_pos, int buf_end,
+  int *match_pos_out, unsigned *match_len_out)
+{
+  const uint8_t *bz = enc->bz;
+  unsigned match_len = 3;        /* Starting minimum match length */
+  unsigned search_start = 0;     /* Earliest position to search from */
+  unsigned mismatch_offset;      /* Where mismatch happens in search window */
+  unsigned best_match_pos = 0;   /* Best match position found so far */
+  unsigned max_match_len;        /* Maximum possible match length */
+
+  /* Limit search window to 4 KB before current position */
+  if (cur_pos > 0x1000)
+    search_start = cur_pos - 0x1000;
+
+  /* Calculate the maximum match length possible based on remaining bytes */
+  max_match_len = YAY0_MATCH_LEN_MAX;
+  if ((unsigned)(buf_end - (int)cur_pos) <= 0x111)
+      max_match_len = (unsigned)(buf_end - (int)cur_pos);
+
+  /* Skip if not enough data for a match */
+  if (max_match_len < match_len)
+  {
+    *match_len_out = 0;
+    *match_pos_out = 0;
+
+    return;
+  }
+
+  /* Fills would otherwise extend a maximum length match at every position */
+  if (enc_run_search(enc, cur_pos, search_start, max_match_len,
+                     match_pos_out, match_len_out))
+    return;
+
+  /* Search backwards for the best match */
+  while (cur_pos > search_start)
+  {
+    mismatch_offset = (unsigned)enc_mischarsearch(
+      enc,
+      &bz[cur_pos],
+      match_len,
+      &bz[search_start],
+      match_len + cur_pos - search_start
+    );
+
+    /* No more candidates in range */
+    if (mismatch_offset >= cur_pos - search_start)
+      break;
+
+    /* Extend match length as far as possible */
+    match_len += enc_match_len(&bz[match_len + search_start + mismatch_offset],
+                               &bz[match_len + cur_pos], max_match_len - match_len);
+
+    /* Found the longest possible match */
+    if (match_len == max_match_len)
+    {
+      *match_pos_out = (int)(search_start + mismatch_offset);
+      *match_len_out = match_len;
+
+      return;
+    }
+
+    /* Store this as current best match */
+    best_match_pos = search_start + mismatch_offset;
     ++match_len;
     search_start += mismatch_offset + 1;
 
-    if (cur_pos <= search_start)
-      break;
+    if (cur_pos <= search_start)
+      break;
+  }
+
+  /* Return result if match length is valid */
+  if (match_len > 3)
+  {
+    *match_pos_out = best_match_pos;
+    *match_len_out = match_len - 1;
+  }
+  else
+  {
+    *match_len_out = 0;
+    *match_pos_out = 0;
+  }
+}
+
+static unsigned int enc_hash(const uint8_t *p)
+{
+  uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+
+  return (unsigned int)((v * 2654435761u) >> (32 - YAY0_HASH_BITS));
+}
+
+/* Link every position below 'target' that can start a match into the chains */
+static void enc_chain_insert(yay0_encoder_t *enc, unsigned int target)
+{
+  unsigned int last = enc->insize >= 3 ? enc->insize - 2 : 0;
+  unsigned int h;
+
+  if (target > last)
+    target = last;
+  while (enc->ins < target)
+  {
+    h = enc_hash(&enc->bz[enc->ins]);
+    enc->prev[enc->ins & YAY0_WINDOW_MASK] = enc->head[h];
+    enc->head[h] = ++enc->ins;
+  }
+}
+
+/**
+ * Walk the hash chain for cur_pos from the most recent position backwards,
+ * visiting at most max_chain candidates. Returns the longest match found,
+ * preferring the nearest one on ties, with the same conventions as
+ * enc_search().
+ */
+static void enc_chain_search(yay0_encoder_t *enc, unsigned cur_pos,
+  int buf_end, int *match_pos_out, unsigned *match_len_out)
+{
+  const uint8_t *bz = enc->bz;
+  const uint8_t *cur = &bz[cur_pos];
+  unsigned int limit = 0, max_match_len, best_len = 2, best_pos = 0, len;
+  unsigned int depth = enc->max_chain, nice;
+  uint32_t cand;
+
+  *match_len_out = 0;
+  *match_pos_out = 0;
+
+  max_match_len = YAY0_MATCH_LEN_MAX;
+  if ((unsigned)(buf_end - (int)cur_pos) <= 0x111)
+    max_match_len = (unsigned)(buf_end - (int)cur_pos);
+  if (max_match_len < 3)
+    return;
+  nice = enc->nice_len < max_match_len ? enc->nice_len : max_match_len;
+
+  if (cur_pos > YAY0_WINDOW_SIZE)
+    limit = cur_pos - YAY0_WINDOW_SIZE;
+  enc_chain_insert(enc, cur_pos);
+
+  cand = enc->head[enc_hash(cur)];
+  while (cand && depth--)
+  {
+    unsigned int c = cand - 1;
+
+    if (c < limit)
+      break;
+    cand = enc->prev[c & YAY0_WINDOW_MASK];
+    /* Entries past a skipped-ahead insert point are not ours to use */
+    if (c >= cur_pos)
+      continue;
+    if (cand > c)
+      cand = 0;
+
+    /* Cheap reject: a longer match must also agree at best_len */
+    if (bz[c + best_len] != cur[best_len] || bz[c] != cur[0])
+      continue;
+    len = enc_match_len(&bz[c], cur, max_match_len);
+    if (len > best_len)
+    {
+      best_len = len;
+      best_pos = c;
+      if (len >= nice)
+        break;
+    }
+  }
+
+  if (best_len >= 3)
+  {
+    *match_pos_out = (int)best_pos;
+    *match_len_out = best_len;
+  }
+}
+
+/**
+ * Drop-in replacement for enc_search(): returns the longest match in the
+ * window, and among equally long ones the earliest, which is exactly what
+ * the Boyer-Moore rescan settles on. Every chain entry in the window is
+ * gathered first and then tried oldest first, so the first candidate to
+ * reach the length limit can end the search just like in enc_search().
+ */
+static void enc_exact_search(yay0_encoder_t *enc, unsigned cur_pos,
+  int buf_end, int *match_pos_out, unsigned *match_len_out)
+{
+  const uint8_t *bz = enc->bz;
+  const uint8_t *cur = &bz[cur_pos];
+  unsigned int limit = 0, max_match_len, best_len = 2, best_pos = 0, len;
+  unsigned int count = 0, nice;
+  uint32_t cand;
+
+  *match_len_out = 0;
+  *match_pos_out = 0;
+
+  max_match_len = YAY0_MATCH_LEN_MAX;
+  if ((unsigned)(buf_end - (int)cur_pos) <= 0x111)
+    max_match_len = (unsigned)(buf_end - (int)cur_pos);
+  if (max_match_len < 3)
+    return;
+  nice = enc->nice_len < max_match_len ? enc->nice_len : max_match_len;
+
+  if (cur_pos > YAY0_WINDOW_SIZE)
+    limit = cur_pos - YAY0_WINDOW_SIZE;
+  enc_chain_insert(enc, cur_pos);
+
+  /* Fills would otherwise walk a window-long chain at every position */
+  if (enc_run_search(enc, cur_pos, limit, max_match_len, match_pos_out,
+                     match_len_out))
+    return;
+
+  cand = enc->head[enc_hash(cur)];
+  while (cand && cand - 1 >= limit)
+  {
+    unsigned int c = cand - 1;
+
+    cand = enc->prev[c & YAY0_WINDOW_MASK];
+    if (c < cur_pos)
+      enc->cand[count++] = c;
+    if (cand > c)
+      break;
+  }
+
+  while (count)
+  {
+    unsigned int c = enc->cand[--count];
+
+    /* Only a strictly longer match can replace an earlier one */
+    if (bz[c + best_len] != cur[best_len] || bz[c] != cur[0])
+      continue;
+    len = enc_match_len(&bz[c], cur, max_match_len);
+    if (len > best_len)
+    {
+      best_len = len;
+      best_pos = c;
+      if (len >= nice)
+        break;
+    }
+  }
+
+  if (best_len >= 3)
+  {
+    *match_pos_out = (int)best_pos;
+    *match_len_out = best_len;
+  }
+}
+
+static void enc_find(yay0_encoder_t *enc, unsigned cur_pos, int buf_end,
+  int *match_pos_out, unsigned *match_len_out)
+{
+  double start = 0;
+
+  YAY0_STAT(enc, ++enc->stats->searches; start = yay0_time_now());
+  if (enc->search == YAY0_SEARCH_EXACT)
+    enc_exact_search(enc, cur_pos, buf_end, match_pos_out, match_len_out);
+  else if (enc->search == YAY0_SEARCH_CHAIN)
+    enc_chain_search(enc, cur_pos, buf_end, match_pos_out, match_len_out);
+  else
+    enc_search(enc, cur_pos, buf_end, match_pos_out, match_len_out);
+  YAY0_STAT(enc, enc->stats->time_search += yay0_time_now() - start);
+}
+
+/**
+ * Greedy parse with lazy matching: after finding a match, the next
+ * lazy_depth positions are searched too, and a match there is taken
+ * instead (after literals up to it) if it is longer by more than the
+ * number of positions skipped. One step of this is the original encoder.
+ */
+static int enc_parse_lazy(yay0_encoder_t *enc)
+{
+  const uint8_t *bz = enc->bz;
+  int end = (int)enc->insize;
+  unsigned int pos = enc->start, step, skip;
+  unsigned int len, next_len;
+  int match, next_match;
+
+  while (pos < enc->insize)
+  {
+    enc_find(enc, pos, end, &match, &len);
+    if (len <= 2u)
+    {
+      if (!enc_emit_literal(enc, bz[pos++]))
+        return 0;
+      continue;
+    }
+
+    /* Prefer literals if a later position has a sufficiently longer match */
+    skip = 0;
+    for (step = 1; step <= enc->lazy_depth && len < enc->nice_len; ++step)
+    {
+      if (pos + step + 3u > enc->insize)
+        break;
+      enc_find(enc, pos + step, end, &next_match, &next_len);
+      if (next_len > len + (step - skip))
+      {
+        YAY0_STAT(enc, ++enc->stats->lazy_wins);
+        skip = step;
+        len = next_len;
+        match = next_match;
+      }
+    }
+    while (skip--)
+      if (!enc_emit_literal(enc, bz[pos++]))
+        return 0;
+    if (!enc_emit_match(enc, pos - (unsigned)match - 1u, len))
+      return 0;
+    pos += len;
+  }
+
+  return 1;
+}
+
+/* Encoded size in bits: flag bit plus raw byte, or flag bit plus token */
+#define YAY0_COST_LITERAL 9u
+#define YAY0_COST_MATCH(len) ((len) > 0x11u ? 25u : 17u)
+
+/**
+ * Minimum-size parse. Yay0 charges the same for every distance, so the
+ * longest match at a position stands in for all of them: any shorter
+ * length is a prefix of it at the same distance. A backward pass then
+ * picks, for each position, the literal or match length that minimizes
+ * the bits needed for the rest of the input.
+ *
+ * Costs are kept modulo 2^32. Candidates at one position never differ by
+ * more than a few thousand bits, so comparing wrapped differences is exact
+ * even when the totals overflow.
+ */
+static int enc_parse_optimal(yay0_encoder_t *enc)
+{
+  const uint8_t *bz = enc->bz;
+  unsigned int n = enc->insize - enc->start, pos, len;
+  uint32_t *cost;
+  int match;
+
+  /* Scratch arrays are indexed from the start of the encoded range */
+  if (!n)
+    return 1;
+  bz += enc->start;
+  if (!enc_reserve(enc, (void**)&enc->opt_pos, &enc->nopt_pos, n,
+                   sizeof(uint32_t)) ||
+      !enc_reserve(enc, (void**)&enc->opt_len, &enc->nopt_len, n,
+                   sizeof(uint16_t)) ||
+      !enc_reserve(enc, (void**)&enc->opt_cost, &enc->nopt_cost, n + 1,
+                   sizeof(uint32_t)))
+    return 0;
+  cost = enc->opt_cost;
+
+  /* Longest match at every position */
+  for (pos = 0; pos < n; ++pos)
+  {
+    enc_find(enc, enc->start + pos, (int)enc->insize, &match, &len);
+    enc->opt_pos[pos] = (uint32_t)match;
+    enc->opt_len[pos] = (uint16_t)len;
+  }
+
+  /* Cheapest way to encode each suffix; opt_len becomes the choice */
+  cost[n] = 0;
+  pos = n;
+  while (pos--)
+  {
+    unsigned int max = enc->opt_len[pos], best = 1, l;
+    uint32_t c;
+
+    cost[pos] = cost[pos + 1] + YAY0_COST_LITERAL;
+    for (l = 3; l <= max; ++l)
+    {
+      c = cost[pos + l] + YAY0_COST_MATCH(l);
+      if ((int32_t)(c - cost[pos]) <= 0)
+      {
+        cost[pos] = c;
+        best = l;
+      }
+    }
+    enc->opt_len[pos] = (uint16_t)best;
+  }
+
+  for (pos = 0; pos < n; pos += len)
+  {
+    len = enc->opt_len[pos];
+    if (len < 3)
+    {
+      if (!enc_emit_literal(enc, bz[pos]))
+        return 0;
+    }
+    else if (!enc_emit_match(enc, enc->start + pos - enc->opt_pos[pos] - 1u,
+                             len))
+      return 0;
+  }
+
+  return 1;
+}
+
+static int enc_parse(yay0_encoder_t *enc)
+{
+  double start = 0, searched = 0;
+  int ok;
+
+  YAY0_STAT(enc, start = yay0_time_now();
+            searched = enc->stats->time_search);
+  if (enc->parse == YAY0_PARSE_OPTIMAL)
+    ok = enc_parse_optimal(enc);
+  else
+    ok = enc_parse_lazy(enc);
+
+  /* Count the last, partially filled flag word */
+  if (ok && enc->mask != 0x80000000u)
+    ++enc->cp;
+
+  /* Whatever the parse spent outside the match finder */
+  YAY0_STAT(enc, enc->stats->time_emit += yay0_time_now() - start -
+            (enc->stats->time_search - searched));
+
+  return ok;
+}
+
+/* Size of the serialized file: header, flag words, tokens, raw bytes */
+static size_t enc_output_size(const yay0_encoder_t *enc)
+{
+  return 16 + 4 * (size_t)enc->cp + 2 * (size_t)enc->pp + (size_t)enc->dp;
+}
+
+static void enc_write_header(uint8_t *outbuf, const char *magic,
+  unsigned int size, unsigned int cp, unsigned int pp)
+{
+  memcpy(outbuf, magic, 4);
+  be_write_u32(outbuf + 4, size);
+  /* compressedDataPointer (offset to pol area) = 4*cp + 16 */
+  be_write_u32(outbuf + 8, 4u * cp + 16u);
+  /* uncompressedDataPointer (offset to def area) = 2*pp + 4*cp + 16 */
+  be_write_u32(outbuf + 12, 2u * pp + 4u * cp + 16u);
+}
+
+static void enc_serialize(const yay0_encoder_t *enc, uint8_t *outbuf)
+{
+  size_t outpos;
+  unsigned int i;
+  double start = 0;
+
+  YAY0_STAT(enc, start = yay0_time_now());
+  enc_write_header(outbuf, "Yay0", enc->insize - enc->start, enc->cp,
+                   enc->pp);
+
+  /* write cmd[] (flag words) big-endian starting at offset 16 */
+  outpos = 16;
+  for (i = 0; i < enc->cp; ++i)
+  {
+    be_write_u32(outbuf + outpos, enc->cmd[i]);
+    outpos += 4;
+  }
+
+  /* write pol[] (compressed tokens) big-endian */
+  for (i = 0; i < enc->pp; ++i)
+  {
+    be_write_u16(outbuf + outpos, enc->pol[i]);
+    outpos += 2;
+  }
+
+  /* write def[] (literals and extra length bytes) */
+  if (enc->dp > 0)
+    memcpy(outbuf + outpos, enc->def, (size_t)enc->dp);
+
+  YAY0_STAT(enc, enc->stats->time_serialize += yay0_time_now() - start);
+  if (enc->stats)
+    dec_walk(outbuf, enc_output_size(enc), enc->start, enc->stats, NULL,
+             NULL);
+}
+
+/**
+ * The flag words, tokens and raw bytes a parse leaves behind are the one
+ * token stream every format is written from: Yay0 takes the streams as
+ * they are, and the other formats read them back a token at a time.
+ */
+typedef struct
+{
+  const yay0_encoder_t *enc;
+  unsigned int item, pp, dp;
+} enc_cursor_t;
+
+/**
+ * Reads the next token: a literal, with *length 0, or a match of *length
+ * bytes from *distance + 1 back. Returns 0 after the last one.
+ */
+static int enc_next_token(enc_cursor_t *c, unsigned int *length,
+  unsigned int *distance, uint8_t *literal)
+{
+  const yay0_encoder_t *enc = c->enc;
+  unsigned int token;
+
+  if (c->item >= enc->items)
+    return 0;
+  if (enc->cmd[c->item >> 5] & (0x80000000u >> (c->item & 31)))
+  {
+    *length = 0;
+    *literal = enc->def[c->dp++];
+  }
+  else
+  {
+    token = enc->pol[c->pp++];
+    *distance = token & 0xFFFu;
+    *length = token >> 12 ? (token >> 12) + 2u : enc->def[c->dp++] + 18u;
+  }
+  ++c->item;
+
+  return 1;
+}
+
+/* Longest match MIO0 can express */
+#define YAY0_MIO0_LEN_MAX 18u
+
+/* First piece of a match of 'left' bytes cut for MIO0, leaving at least 3 */
+static unsigned int enc_mio0_piece(unsigned int left)
+{
+  if (left <= YAY0_MIO0_LEN_MAX)
+    return left;
+
+  return left - YAY0_MIO0_LEN_MAX >= 3 ? YAY0_MIO0_LEN_MAX : left - 3;
+}
+
+/* Number of MIO0 tokens the parse's matches take */
+static unsigned int enc_mio0_tokens(const yay0_encoder_t *enc)
+{
+  enc_cursor_t c = { NULL, 0, 0, 0 };
+  unsigned int length, distance, tokens = 0;
+  uint8_t literal;
+
+  c.enc = enc;
+  while (enc_next_token(&c, &length, &distance, &literal))
+    for (; length; ++tokens)
+      length -= enc_mio0_piece(length);
+
+  return tokens;
+}
+
+/* Size of the parse written in 'format'; 'tokens' from enc_mio0_tokens */
+static size_t enc_format_size(const yay0_encoder_t *enc, yay0_format format,
+  unsigned int tokens)
+{
+  size_t literals = (size_t)(enc->items - enc->pp), flags;
+
+  if (format == YAY0_FORMAT_YAZ0)
+    return 16 + ((size_t)enc->items + 7) / 8 + 2 * (size_t)enc->pp +
+           (size_t)enc->dp;
+  if (format == YAY0_FORMAT_MIO0)
+  {
+    flags = (literals + tokens + 31) / 32;
+    return 16 + 4 * flags + 2 * (size_t)tokens + literals;
+  }
+
+  return enc_output_size(enc);
+}
+
+/* Flag bytes each lead the up to 8 literals and tokens they describe */
+static void enc_serialize_yaz0(const yay0_encoder_t *enc, uint8_t *outbuf)
+{
+  enc_cursor_t c = { NULL, 0, 0, 0 };
+  unsigned int length, distance, n = 0;
+  size_t pos = 16, group = 16;
+  uint8_t literal;
+
+  c.enc = enc;
+  memcpy(outbuf, "Yaz0", 4);
+  be_write_u32(outbuf + 4, enc->insize - enc->start);
+  memset(outbuf + 8, 0, 8);
+  for (; enc_next_token(&c, &length, &distance, &literal); ++n)
+  {
+    if (!(n & 7))
+    {
+      group = pos++;
+      outbuf[group] = 0;
+    }
+    if (!length)
+    {
+      outbuf[group] |= (uint8_t)(0x80u >> (n & 7));
+      outbuf[pos++] = literal;
+    }
+    else if (length < 18)
+    {
+      outbuf[pos++] = (uint8_t)(((length - 2) << 4) | (distance >> 8));
+      outbuf[pos++] = (uint8_t)(distance & 0xFF);
+    }
+    else
+    {
+      outbuf[pos++] = (uint8_t)(distance >> 8);
+      outbuf[pos++] = (uint8_t)(distance & 0xFF);
+      outbuf[pos++] = (uint8_t)(length - 18);
+    }
   }
+}
 
-  /* Return result if match length is valid */
-  if (match_len > 3)
+/* Yay0's layout, with every match cut into tokens of up to 18 bytes */
+static void enc_serialize_mio0(const yay0_encoder_t *enc, uint8_t *outbuf,
+  unsigned int tokens)
+{
+  enc_cursor_t c = { NULL, 0, 0, 0 };
+  unsigned int length, distance, piece, items, words, bit = 0;
+  uint8_t *flags, *tok, *raw, literal;
+
+  c.enc = enc;
+  items = enc->items - enc->pp + tokens;
+  words = (items + 31) / 32;
+  enc_write_header(outbuf, "MIO0", enc->insize - enc->start, words, tokens);
+  flags = outbuf + 16;
+  tok = flags + 4 * (size_t)words;
+  raw = tok + 2 * (size_t)tokens;
+  memset(flags, 0, 4 * (size_t)words);
+  while (enc_next_token(&c, &length, &distance, &literal))
   {
-    *match_pos_out = best_match_pos;
-    *match_len_out = match_len - 1;
+    if (!length)
+    {
+      flags[bit >> 3] |= (uint8_t)(0x80u >> (bit & 7));
+      ++bit;
+      *raw++ = literal;
+    }
+    for (; length; ++bit)
+    {
+      piece = enc_mio0_piece(length);
+      be_write_u16(tok, (unsigned short)(distance | ((piece - 3) << 12)));
+      tok += 2;
+      length -= piece;
+    }
   }
-  else
+}
+
+yay0_result yay0_compress_formats(yay0_encoder_t *enc, const uint8_t *input,
+  size_t input_size, const yay0_format *formats, size_t count,
+  uint8_t **outputs, size_t *output_sizes)
+{
+  unsigned int tokens = 0;
+  size_t i, k;
+
+  if (!enc || !input || !formats || !outputs || !output_sizes)
+    return YAY0_ERR_FORMAT;
+  if (input_size > INT_MAX)
+    return YAY0_ERR_FORMAT;
+  for (i = 0; i < count; ++i)
   {
-    *match_len_out = 0;
-    *match_pos_out = 0;
+    if ((unsigned int)formats[i] >= YAY0_FORMAT_COUNT ||
+        (formats[i] != YAY0_FORMAT_YAY0 && enc->dict_size))
+      return YAY0_ERR_FORMAT;
+    outputs[i] = NULL;
+  }
+
+  if (!enc_begin_input(enc, input, (unsigned int)input_size) ||
+      !enc_parse(enc))
+    return YAY0_ERR_FORMAT;
+
+  for (i = 0; i < count; ++i)
+  {
+    if (formats[i] == YAY0_FORMAT_MIO0 && !tokens)
+      tokens = enc_mio0_tokens(enc);
+    output_sizes[i] = enc_format_size(enc, formats[i], tokens);
+    outputs[i] = (uint8_t*)mem_alloc(&enc->mem, output_sizes[i]);
+    if (!outputs[i])
+    {
+      for (k = 0; k < i; ++k)
+      {
+        mem_free(&enc->mem, outputs[k]);
+        outputs[k] = NULL;
+      }
+      return YAY0_ERR_FORMAT;
+    }
+    if (formats[i] == YAY0_FORMAT_YAZ0)
+      enc_serialize_yaz0(enc, outputs[i]);
+    else if (formats[i] == YAY0_FORMAT_MIO0)
+      enc_serialize_mio0(enc, outputs[i], tokens);
+    else
+      enc_serialize(enc, outputs[i]);
   }
+
+  return YAY0_OK;
 }
 
-yay0_result yay0_compress(const uint8_t *input, size_t input_size,
-  uint8_t **output, size_t *output_size)
+yay0_result yay0_compress_ctx(yay0_encoder_t *enc, const uint8_t *input,
+  size_t input_size, uint8_t **output, size_t *output_size)
 {
-  /* local variables modeled after your program */
-  unsigned int v0;
-  unsigned int v1;
-  int a3;
-  unsigned int a4;
-  unsigned int v6;
-  unsigned int v7;
-  int v8;
-  int v2;
-  int v3;
-  unsigned char v5;
-
-  /* dynamic arrays */
-  unsigned int *cmd = NULL;      /* 32-bit flag words */
-  unsigned short *pol = NULL;    /* compressed tokens (words) */
-  unsigned char *def = NULL;     /* literals and extra lengths */
-
-  unsigned int dp = 0;
-  unsigned int pp = 0;
-  unsigned int cp = 0;
-  unsigned int npp = 4096;
-  unsigned int ndp = 4096;
-  unsigned int ncp = 4096;
-  unsigned int insz;
   size_t total_size;
   uint8_t *outbuf;
-  size_t outpos;
-  unsigned int i;
 
   /* validate args */
-  if (!input || !output || !output_size) return YAY0_ERR_FORMAT;
-  if (input_size > INT_MAX) return YAY0_ERR_FORMAT; /* our code uses int in places */
-
-  /* init encoder state */
-  enc_bz = input;
-  enc_insize = (int)input_size;
-  insz = (unsigned int)enc_insize;
-
-  dp = 0;
-  pp = 0;
-  cp = 0;
-  npp = 4096;
-  ndp = 4096;
-  ncp = 4096;
-
-  /* allocate initial buffers (same sizes as your program used): */
-  cmd = (unsigned int *) calloc(0x4000u, sizeof(unsigned int)); /* 0x4000 * 4 bytes like your code */
-  if (!cmd) return YAY0_ERR_FORMAT;
-  pol = (unsigned short *) malloc(2 * npp);
-  if (!pol) { free(cmd); return YAY0_ERR_FORMAT; }
-  def = (unsigned char *) malloc(4 * ndp);
-  if (!def) { free(cmd); free(pol); return YAY0_ERR_FORMAT; }
-
-  v0 = 0;
-  v6 = 1024u;
-  v1 = 0x80000000u;
-
-  /* ensure first cmd entry exists and is zero-initialized */
-  cmd[0] = 0;
-
-  while ((unsigned)v0 < insz) {
-    if (v6 < v0)
-      v6 += 1024u;
-    enc_search(v0, enc_insize, &a3, &a4);
-    if (a4 <= 2u) {
-      cmd[cp] |= v1;
-      def[dp++] = enc_bz[v0++];
-      if (ndp == dp) {
-        ndp = dp + 4096u;
-        def = (unsigned char *) realloc(def, (size_t)(dp + 4096u));
-        if (!def) goto err_cleanup;
-      }
-    } else {
-      enc_search(v0 + 1u, enc_insize, &v8, &v7);
-      if (v7 > a4 + 1u) {
-        cmd[cp] |= v1;
-        def[dp++] = enc_bz[v0++];
-        if (ndp == dp) {
-          ndp = dp + 4096u;
-          def = (unsigned char *) realloc(def, (size_t)(dp + 4096u));
-          if (!def) goto err_cleanup;
-        }
-        v1 >>= 1;
-        if (!v1) {
-          v1 = 0x80000000u;
-          v2 = (int)cp++;
-          if (cp == ncp) {
-            ncp = (unsigned int)(v2 + 1025);
-            cmd = (unsigned int *) realloc(cmd, 4 * (size_t)(v2 + 1025));
-            if (!cmd) goto err_cleanup;
-          }
-          cmd[cp] = 0;
-        }
-        a4 = v7;
-        a3 = v8;
-      }
-      v3 = (int)(v0 - a3 - 1);
-      a3 = v0 - a3 - 1;
-      v5 = (unsigned char)a4;
-      if (a4 > 0x11u) {
-        /* store long form: distance then extra length byte in def */
-        if (pp >= npp) {
-          npp = pp + 4096u;
-          pol = (unsigned short *) realloc(pol, 2 * (size_t)(pp + 4096u));
-          if (!pol) goto err_cleanup;
-        }
-        pol[pp++] = (unsigned short)v3;
-        def[dp++] = (unsigned char)(v5 - 18);
-        if (ndp == dp) {
-          ndp = dp + 4096u;
-          def = (unsigned char *) realloc(def, (size_t)(dp + 4096u));
-          if (!def) goto err_cleanup;
-        }
-      } else {
-        /* store packed 16-bit token: distance (low 12) | ((len-2) << 12) */
-        if (pp >= npp) {
-          npp = pp + 4096u;
-          pol = (unsigned short *) realloc(pol, 2 * (size_t)(pp + 4096u));
-          if (!pol) goto err_cleanup;
-        }
-        pol[pp++] = (unsigned short)(v3 | ((((unsigned short)a4) - 2) << 12));
-      }
-      v0 += a4;
-    }
-    v1 >>= 1;
-    if (!v1) {
-      v1 = 0x80000000u;
-      /* start new flag word */
-      {
-        int tmp = (int)cp++;
-        if (cp == ncp) {
-          ncp = (unsigned int)(tmp + 1025);
-          cmd = (unsigned int *) realloc(cmd, 4 * (size_t)(tmp + 1025));
-          if (!cmd) goto err_cleanup;
-        }
-        cmd[cp] = 0;
-      }
+  if (!enc || !input || !output || !output_size)
+    return YAY0_ERR_FORMAT;
+  if (input_size > INT_MAX)
+    return YAY0_ERR_FORMAT; /* our code uses int in places */
+
+  if (!enc_begin_input(enc, input, (unsigned int)input_size) ||
+      !enc_parse(enc))
+    return YAY0_ERR_FORMAT;
+
+  total_size = enc_output_size(enc);
+  outbuf = (uint8_t*)mem_alloc(&enc->mem, total_size);
+  if (!outbuf)
+    return YAY0_ERR_FORMAT;
+  enc_serialize(enc, outbuf);
+
+  /* success: return buffer */
+  *output = outbuf;
+  *output_size = total_size;
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_compress_ctx_to(yay0_encoder_t *enc, const uint8_t *input,
+  size_t input_size, uint8_t *output, size_t output_capacity,
+  size_t *written)
+{
+  size_t total_size;
+
+  if (!enc || !input || !output || !written)
+    return YAY0_ERR_FORMAT;
+  if (input_size > INT_MAX)
+    return YAY0_ERR_FORMAT;
+
+  if (!enc_begin_input(enc, input, (unsigned int)input_size) ||
+      !enc_parse(enc))
+    return YAY0_ERR_FORMAT;
+
+  total_size = enc_output_size(enc);
+  if (total_size > output_capacity)
+    return YAY0_ERR_OUTPUT_SMALL;
+  enc_serialize(enc, output);
+  *written = total_size;
+
+  return YAY0_OK;
+}
+
+yay0_result yay0_compress_to(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t output_capacity, size_t *written)
+{
+  size_t scratch_size = yay0_compress_scratch_size(input_size);
+  void *scratch;
+  yay0_result result;
+
+  if (!scratch_size)
+    return YAY0_ERR_FORMAT;
+  scratch = mem_alloc(&yay0_mem, scratch_size);
+  if (!scratch)
+    return YAY0_ERR_FORMAT;
+  result = yay0_compress_ctx_to(
+    yay0_encoder_create_in(scratch, scratch_size, input_size, NULL),
+    input, input_size, output, output_capacity, written);
+  mem_free(&yay0_mem, scratch);
+
+  return result;
+}
+
+/* Encoded form of one block of a split input */
+typedef struct
+{
+  uint32_t *cmd;
+  uint16_t *pol;
+  uint8_t *def;
+  unsigned int items, pp, dp;
+  int ok;
+} yay0_block_t;
+
+typedef struct
+{
+  /* Dictionary, if any, then the input, which starts at 'base' */
+  const uint8_t *input;
+  size_t input_size;
+  size_t base;
+  size_t block_size;
+  yay0_encoder_t **encs;
+  yay0_block_t *blocks;
+} yay0_block_job_t;
+
+/**
+ * Encode one block with the worker's context. The window is primed with up
+ * to 4 KB of the preceding input, so matches reach back across the block
+ * boundary just as in a serial encode; only matches running forward across
+ * it are cut short.
+ */
+static void enc_block_task(void *arg, size_t index, unsigned int worker)
+{
+  yay0_block_job_t *job = (yay0_block_job_t*)arg;
+  yay0_encoder_t *enc = job->encs[worker];
+  yay0_block_t *block = &job->blocks[index];
+  size_t start = job->base + index * job->block_size;
+  size_t end = start + job->block_size;
+  size_t words;
+  uint8_t *mem;
+
+  if (end > job->input_size)
+    end = job->input_size;
+  block->ok = enc_begin(enc, job->input, (unsigned int)start,
+                        (unsigned int)end) && enc_parse(enc);
+  if (!block->ok)
+    return;
+
+  /* Keep the result, since the context moves on to another block */
+  words = enc->cp;
+  mem = (uint8_t*)mem_alloc(&yay0_mem,
+                            4 * words + 2 * (size_t)enc->pp + enc->dp + 1);
+  if (!mem)
+  {
+    block->ok = 0;
+    return;
+  }
+  block->cmd = (uint32_t*)mem;
+  memcpy(block->cmd, enc->cmd, 4 * words);
+  block->pol = (uint16_t*)(mem + 4 * words);
+  memcpy(block->pol, enc->pol, 2 * (size_t)enc->pp);
+  block->def = mem + 4 * words + 2 * (size_t)enc->pp;
+  memcpy(block->def, enc->def, enc->dp);
+  block->items = enc->items;
+  block->pp = enc->pp;
+  block->dp = enc->dp;
+}
+
+/* Append the first 'bits' bits of word to the flag words at bit offset pos */
+static void enc_append_bits(uint32_t *words, size_t pos, uint32_t word,
+  unsigned int bits)
+{
+  unsigned int shift = (unsigned int)(pos & 31);
+
+  if (bits < 32)
+    word &= ~(0xFFFFFFFFu >> bits);
+  words[pos >> 5] |= word >> shift;
+  if (shift && bits > 32 - shift)
+    words[(pos >> 5) + 1] |= word << (32 - shift);
+}
+
+/**
+ * Split the input into fixed size blocks, encode them concurrently and
+ * stitch the per-block flag, token and raw streams into a single file.
+ * The output depends only on the block size, not on the thread count.
+ */
+static yay0_result enc_compress_blocks(const uint8_t *input,
+  size_t input_size, const yay0_params *p, uint8_t **output,
+  size_t *output_size)
+{
+  yay0_block_job_t job;
+  size_t count = (input_size + p->block_size - 1) / p->block_size;
+  size_t i, items = 0, pp = 0, dp = 0, bitpos = 0, words, total, pos;
+  unsigned int threads = yay0_parallel_threads(p->threads, count), t, k;
+  yay0_result result = YAY0_ERR_FORMAT;
+  yay0_stats *stats = NULL;
+  uint32_t *cmd = NULL;
+  uint8_t *outbuf, *joined = NULL;
+  const uint8_t *dict = enc_dict(p, &k);
+  double start = 0;
+
+  job.input = input;
+  job.input_size = input_size;
+  job.base = k;
+  job.block_size = p->block_size;
+  job.encs = (yay0_encoder_t**)mem_calloc(&yay0_mem, threads,
+                                          sizeof(yay0_encoder_t*));
+  job.blocks = (yay0_block_t*)mem_calloc(&yay0_mem, count,
+                                         sizeof(yay0_block_t));
+  if (!job.encs || !job.blocks)
+    goto cleanup;
+  /* The first block sees the dictionary as its history */
+  if (dict)
+  {
+    joined = (uint8_t*)mem_alloc(&yay0_mem, job.base + input_size);
+    if (!joined)
+      goto cleanup;
+    memcpy(joined, dict, job.base);
+    memcpy(joined + job.base, input, input_size);
+    job.input = joined;
+    job.input_size += job.base;
+  }
+  /* Workers count into their own copy, summed up afterwards */
+  if (p->stats)
+  {
+    stats = (yay0_stats*)mem_calloc(&yay0_mem, threads, sizeof(yay0_stats));
+    if (!stats)
+      goto cleanup;
+  }
+  for (t = 0; t < threads; ++t)
+  {
+    job.encs[t] = yay0_encoder_create();
+    if (!job.encs[t])
+      goto cleanup;
+    yay0_encoder_set_params(job.encs[t], p);
+    job.encs[t]->stats = stats ? &stats[t] : NULL;
+  }
+
+  mem_parallel_for(threads, count, enc_block_task, &job);
+  if (stats)
+  {
+    for (t = 0; t < threads; ++t)
+    {
+      p->stats->searches += stats[t].searches;
+      p->stats->mischar_searches += stats[t].mischar_searches;
+      p->stats->lazy_wins += stats[t].lazy_wins;
+      p->stats->reallocs += stats[t].reallocs;
+      p->stats->realloc_bytes += stats[t].realloc_bytes;
+      p->stats->time_search += stats[t].time_search;
+      p->stats->time_emit += stats[t].time_emit;
     }
+    start = yay0_time_now();
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    if (!job.blocks[i].ok)
+      goto cleanup;
+    items += job.blocks[i].items;
+    pp += job.blocks[i].pp;
+    dp += job.blocks[i].dp;
   }
 
-  if (v1 != 0x80000000u)
-    ++cp;
+  /* Re-pack the flag bits of all blocks back to back */
+  words = (items + 31) / 32;
+  cmd = (uint32_t*)mem_calloc(&yay0_mem, words + 1, sizeof(uint32_t));
+  if (!cmd)
+    goto cleanup;
+  for (i = 0; i < count; ++i)
+  {
+    const yay0_block_t *b = &job.blocks[i];
+    unsigned int left = b->items;
+
+    for (k = 0; left; ++k)
+    {
+      unsigned int bits = left < 32 ? left : 32;
+
+      enc_append_bits(cmd, bitpos, b->cmd[k], bits);
+      bitpos += bits;
+      left -= bits;
+    }
+  }
 
-  /* compute output size and build final buffer:
-       header (16) + cmd words (4*cp) + pol words (2*pp) + def bytes (dp) */
-  total_size = 16 + 4 * (size_t)cp + 2 * (size_t)pp + (size_t)dp;
-  outbuf = (uint8_t*)malloc(total_size);
+  total = YAY0_HEADER_SIZE + 4 * words + 2 * pp + dp;
+  outbuf = (uint8_t*)mem_alloc(&yay0_mem, total);
   if (!outbuf)
-    goto err_cleanup;
+    goto cleanup;
+  enc_write_header(outbuf, "Yay0", (unsigned int)input_size,
+                   (unsigned int)words, (unsigned int)pp);
+  pos = YAY0_HEADER_SIZE;
+  for (i = 0; i < words; ++i, pos += 4)
+    be_write_u32(outbuf + pos, cmd[i]);
+  for (i = 0; i < count; ++i)
+    for (k = 0; k < job.blocks[i].pp; ++k, pos += 2)
+      be_write_u16(outbuf + pos, job.blocks[i].pol[k]);
+  for (i = 0; i < count; ++i)
+  {
+    memcpy(outbuf + pos, job.blocks[i].def, job.blocks[i].dp);
+    pos += job.blocks[i].dp;
+  }
+  if (stats)
+  {
+    p->stats->time_serialize += yay0_time_now() - start;
+    dec_walk(outbuf, total, job.base, p->stats, NULL, NULL);
+  }
 
-  /* Write header */
-  memcpy(outbuf, "Yay0", 4);
-  be_write_u32(outbuf + 4, (unsigned int)insz);
-  /* compressedDataPointer (offset to pol area) = 4*cp + 16 */
-  be_write_u32(outbuf + 8, 4u * cp + 16u);
-  /* uncompressedDataPointer (offset to def area) = 2*pp + 4*cp + 16 */
-  be_write_u32(outbuf + 12, 2u * pp + 4u * cp + 16u);
+  *output = outbuf;
+  *output_size = total;
+  result = YAY0_OK;
+
+cleanup:
+  mem_free(&yay0_mem, cmd);
+  mem_free(&yay0_mem, joined);
+  if (job.blocks)
+    for (i = 0; i < count; ++i)
+      mem_free(&yay0_mem, job.blocks[i].cmd);
+  if (job.encs)
+    for (t = 0; t < threads; ++t)
+      yay0_encoder_destroy(job.encs[t]);
+  mem_free(&yay0_mem, job.blocks);
+  mem_free(&yay0_mem, job.encs);
+  mem_free(&yay0_mem, stats);
 
-  /* write cmd[] (flag words) big-endian starting at offset 16 */
-  outpos = 16;
-  for (i = 0; i < cp; ++i)
+  return result;
+}
+
+yay0_result yay0_compress_ex(const uint8_t *input, size_t input_size,
+  const yay0_params *p, uint8_t **output, size_t *output_size)
+{
+  yay0_encoder_t *enc;
+  yay0_result result;
+
+  if (p && p->block_size && input_size > p->block_size)
   {
-    be_write_u32(outbuf + outpos, cmd[i]);
-    outpos += 4;
+    if (!input || !output || !output_size || input_size > INT_MAX)
+      return YAY0_ERR_FORMAT;
+    return enc_compress_blocks(input, input_size, p, output, output_size);
   }
 
-  /* write pol[] (compressed tokens) big-endian */
-  for (i = 0; i < pp; ++i)
+  enc = yay0_encoder_create();
+  if (!enc)
+    return YAY0_ERR_FORMAT;
+  if (p)
+    yay0_encoder_set_params(enc, p);
+  result = yay0_compress_ctx(enc, input, input_size, output, output_size);
+  yay0_encoder_destroy(enc);
+
+  return result;
+}
+
+yay0_result yay0_compress(const uint8_t *input, size_t input_size,
+  uint8_t **output, size_t *output_size)
+{
+  return yay0_compress_ex(input, input_size, NULL, output, output_size);
+}
+
+/**
+ * Batches: jobs are sorted largest first and handed to the pool by their
+ * position in that order, so the long ones start early and the short ones
+ * fill in the gaps at the end.
+ */
+typedef struct
+{
+  size_t size;
+  size_t index;
+} yay0_batch_order_t;
+
+typedef struct
+{
+  yay0_batch_job *jobs;
+  yay0_batch_order_t *order;
+  /* One encoder per worker, made on its first job and kept for the rest */
+  yay0_encoder_t **encs;
+  const yay0_params *params;
+} yay0_batch_t;
+
+static int batch_by_size(const void *a, const void *b)
+{
+  const yay0_batch_order_t *x = (const yay0_batch_order_t*)a;
+  const yay0_batch_order_t *y = (const yay0_batch_order_t*)b;
+
+  if (x->size != y->size)
+    return x->size > y->size ? -1 : 1;
+
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void batch_compress_task(void *arg, size_t index, unsigned int worker)
+{
+  yay0_batch_t *batch = (yay0_batch_t*)arg;
+  yay0_batch_job *job = &batch->jobs[batch->order[index].index];
+  yay0_encoder_t *enc = batch->encs[worker];
+
+  if (!enc)
   {
-    be_write_u16(outbuf + outpos, pol[i]);
-    outpos += 2;
+    enc = batch->encs[worker] = yay0_encoder_create();
+    if (enc)
+      yay0_encoder_set_params(enc, batch->params);
   }
+  job->output_size = 0;
+  if (!enc)
+    job->result = YAY0_ERR_FORMAT;
+  else if (job->output)
+    job->result = yay0_compress_ctx_to(enc, job->input, job->input_size,
+      job->output, job->output_capacity, &job->output_size);
+  else
+    job->result = yay0_compress_ctx(enc, job->input, job->input_size,
+      &job->output, &job->output_size);
+}
 
-  /* write def[] (literals and extra length bytes) */
-  if (dp > 0)
+static void batch_decompress_task(void *arg, size_t index,
+  unsigned int worker)
+{
+  yay0_batch_t *batch = (yay0_batch_t*)arg;
+  yay0_batch_job *job = &batch->jobs[batch->order[index].index];
+  size_t size = job->output_capacity;
+  int owned = !job->output;
+
+  (void)worker;
+  job->output_size = 0;
+  if (owned)
+  {
+    job->result = yay0_measure(job->input, job->input_size, NULL, &size);
+    if (job->result != YAY0_OK)
+      return;
+    job->output = (uint8_t*)mem_alloc(&yay0_mem, size ? size : 1);
+    if (!job->output)
+    {
+      job->result = YAY0_ERR_FORMAT;
+      return;
+    }
+  }
+  job->result = yay0_decompress(job->input, job->input_size, job->output,
+                                &size);
+  if (job->result == YAY0_OK)
+    job->output_size = size;
+  else if (owned)
+  {
+    mem_free(&yay0_mem, job->output);
+    job->output = NULL;
+  }
+}
+
+static yay0_result batch_run(yay0_batch_job *jobs, size_t count,
+  const yay0_params *p, const yay0_batch_pool *pool,
+  yay0_batch_report *report, int decode)
+{
+  yay0_batch_t batch;
+  yay0_params params;
+  yay0_result result = YAY0_OK;
+  double start = yay0_time_now();
+  yay0_batch_fn fn = decode ? batch_decompress_task : batch_compress_task;
+  unsigned int workers, w;
+  size_t i, size;
+
+  if (report)
+    memset(report, 0, sizeof(*report));
+  if (!jobs && count)
+    return YAY0_ERR_FORMAT;
+  if (pool && pool->run)
+    workers = pool->workers ? pool->workers : yay0_cpu_count();
+  else
+    workers = yay0_parallel_threads(pool ? pool->workers : 0, count);
+
+  /* Statistics would be shared by every worker */
+  if (p)
   {
-    memcpy(outbuf + outpos, def, (size_t)dp);
-    outpos += dp;
+    params = *p;
+    params.stats = NULL;
+    batch.params = &params;
+  }
+  else
+    batch.params = NULL;
+  batch.jobs = jobs;
+  batch.order = (yay0_batch_order_t*)mem_alloc(&yay0_mem,
+    (count ? count : 1) * sizeof(yay0_batch_order_t));
+  batch.encs = (yay0_encoder_t**)mem_calloc(&yay0_mem, workers,
+                                            sizeof(yay0_encoder_t*));
+  if (!batch.order || !batch.encs)
+  {
+    for (i = 0; i < count; ++i)
+    {
+      jobs[i].output_size = 0;
+      jobs[i].result = YAY0_ERR_FORMAT;
+    }
+    if (report)
+      report->failed = count;
+    result = YAY0_ERR_FORMAT;
+    goto cleanup;
   }
 
-  /* sanity check */
-  if (outpos != total_size)
+  for (i = 0; i < count; ++i)
   {
-    free(outbuf);
-    goto err_cleanup;
+    /* Decoding costs about as much as its output is large */
+    if (!decode || yay0_get_decompressed_size(jobs[i].input,
+                     jobs[i].input_size, &size) != YAY0_OK)
+      size = jobs[i].input_size;
+    batch.order[i].size = size;
+    batch.order[i].index = i;
   }
+  qsort(batch.order, count, sizeof(yay0_batch_order_t), batch_by_size);
 
-  /* success: return buffer */
-  *output = outbuf;
-  *output_size = total_size;
+  if (pool && pool->run)
+    pool->run(pool->pool, workers, count, fn, &batch);
+  else
+    mem_parallel_for(workers, count, fn, &batch);
 
-  /* cleanup */
-  free(cmd);
-  free(pol);
-  free(def);
-  return YAY0_OK;
+  for (i = 0; i < count; ++i)
+  {
+    if (jobs[i].result != YAY0_OK)
+    {
+      if (result == YAY0_OK)
+        result = jobs[i].result;
+      if (report)
+        report->failed++;
+    }
+    else if (report)
+    {
+      report->input_bytes += jobs[i].input_size;
+      report->output_bytes += jobs[i].output_size;
+    }
+  }
+
+cleanup:
+  if (batch.encs)
+    for (w = 0; w < workers; ++w)
+      yay0_encoder_destroy(batch.encs[w]);
+  mem_free(&yay0_mem, batch.encs);
+  mem_free(&yay0_mem, batch.order);
+  if (report)
+  {
+    report->jobs = count;
+    report->seconds = yay0_time_now() - start;
+  }
+
+  return result;
+}
+
+yay0_result yay0_compress_batch(yay0_batch_job *jobs, size_t count,
+  const yay0_params *p, const yay0_batch_pool *pool,
+  yay0_batch_report *report)
+{
+  return batch_run(jobs, count, p, pool, report, 0);
+}
+
+yay0_result yay0_decompress_batch(yay0_batch_job *jobs, size_t count,
+  const yay0_batch_pool *pool, yay0_batch_report *report)
+{
+  return batch_run(jobs, count, NULL, pool, report, 1);
+}
 
-err_cleanup:
-  if (cmd) free(cmd);
-  if (pol) free(pol);
-  if (def) free(def);
-  return YAY0_ERR_FORMAT;
+/**
+ * Dictionary training: a sample's segments are scored by how many other
+ * samples share each of their k-byte substrings, counted through a hash
+ * table, and the best segment is taken until the dictionary is full. The
+ * substrings of a taken segment then score nothing, so the next pick adds
+ * something new.
+ */
+#define YAY0_DICT_SEGMENT 64u
+#define YAY0_DICT_KMER 6u
+#define YAY0_DICT_HASH_BITS 18
+#define YAY0_DICT_HASH_SIZE (1u << YAY0_DICT_HASH_BITS)
+
+static unsigned int dict_hash(const uint8_t *p)
+{
+  uint32_t a = read_be_u32(p), b = ((uint32_t)p[4] << 8) | p[5];
+
+  return (unsigned int)(((a * 2654435761u) ^ (b * 2246822519u)) >>
+                        (32 - YAY0_DICT_HASH_BITS));
+}
+
+yay0_result yay0_dict_train(const uint8_t *const *samples,
+  const size_t *sample_sizes, size_t count, uint8_t *dict,
+  size_t dict_capacity, size_t *dict_size)
+{
+  uint32_t *freq, *seen;
+  size_t i, p, room, fill = 0;
+
+  if (!samples || !sample_sizes || !dict || !dict_size)
+    return YAY0_ERR_FORMAT;
+  *dict_size = 0;
+  room = dict_capacity < YAY0_DICT_SIZE_MAX ? dict_capacity
+                                            : YAY0_DICT_SIZE_MAX;
+
+  freq = (uint32_t*)mem_calloc(&yay0_mem, YAY0_DICT_HASH_SIZE,
+                               sizeof(uint32_t));
+  seen = (uint32_t*)mem_calloc(&yay0_mem, YAY0_DICT_HASH_SIZE,
+                               sizeof(uint32_t));
+  if (!freq || !seen)
+  {
+    mem_free(&yay0_mem, freq);
+    mem_free(&yay0_mem, seen);
+    return YAY0_ERR_FORMAT;
+  }
+
+  /* Samples each substring occurs in, counting a sample once */
+  for (i = 0; i < count; ++i)
+    for (p = 0; samples[i] && p + YAY0_DICT_KMER <= sample_sizes[i]; ++p)
+    {
+      unsigned int h = dict_hash(samples[i] + p);
+
+      if (seen[h] != (uint32_t)i + 1)
+      {
+        seen[h] = (uint32_t)i + 1;
+        ++freq[h];
+      }
+    }
+  /* Something in one sample only is no use to the others */
+  for (p = 0; p < YAY0_DICT_HASH_SIZE; ++p)
+    if (freq[p] < 2)
+      freq[p] = 0;
+
+  /* Fill from the end, so the best segments are nearest the input */
+  while (fill < room)
+  {
+    size_t best_sample = 0, best_pos = 0, best_len = 0, len;
+    unsigned long best = 0, score;
+
+    for (i = 0; i < count; ++i)
+    {
+      const uint8_t *d = samples[i];
+      size_t n = d ? sample_sizes[i] : 0;
+
+      if (n < YAY0_DICT_KMER)
+        continue;
+      len = n < YAY0_DICT_SEGMENT ? n : YAY0_DICT_SEGMENT;
+      if (len > room - fill)
+        len = room - fill;
+      if (len < YAY0_DICT_KMER)
+        continue;
+
+      /* Sliding sum over the substrings of each segment */
+      score = 0;
+      for (p = 0; p + YAY0_DICT_KMER <= len; ++p)
+        score += freq[dict_hash(d + p)];
+      for (p = 0;; ++p)
+      {
+        if (score > best)
+        {
+          best = score;
+          best_sample = i;
+          best_pos = p;
+          best_len = len;
+        }
+        if (p + len >= n)
+          break;
+        score -= freq[dict_hash(d + p)];
+        score += freq[dict_hash(d + p + len - YAY0_DICT_KMER + 1)];
+      }
+    }
+    if (!best)
+      break;
+
+    fill += best_len;
+    memcpy(dict + room - fill, samples[best_sample] + best_pos, best_len);
+    for (p = 0; p + YAY0_DICT_KMER <= best_len; ++p)
+      freq[dict_hash(samples[best_sample] + best_pos + p)] = 0;
+  }
+
+  mem_free(&yay0_mem, freq);
+  mem_free(&yay0_mem, seen);
+  if (fill < room)
+    memmove(dict, dict + room - fill, fill);
+  *dict_size = fill;
+
+  return YAY0_OK;
 }
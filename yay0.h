@@ -21,10 +21,104 @@ typedef enum
   YAY0_ERR_OUTPUT_SMALL,
   /* Invalid back-reference (distance too large) */
   YAY0_ERR_BACKREF,
+  /* Streaming decoder needs more input before it can go on */
+  YAY0_NEED_INPUT,
 
   YAY0_ERR_SIZE
 } yay0_result;
 
+/**
+ * Where the library gets memory. alloc returns size bytes aligned as for
+ * malloc, or NULL, and free gives back a block alloc returned; both get
+ * ctx. Entry points that take no allocator use the one set with
+ * yay0_set_allocator, by default malloc and free, and the parallel ones
+ * call it from several threads at once. Buffers the library returns, such
+ * as yay0_compress's output, come from that allocator and go back to it.
+ */
+typedef struct
+{
+  void *(*alloc)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+} yay0_allocator;
+
+/* Copies *allocator for later calls to use; NULL goes back to malloc */
+void yay0_set_allocator(const yay0_allocator *allocator);
+
+/**
+ * Bump allocator over caller memory (aligned as for malloc), for targets
+ * without a heap. Every block is rounded up to 16 bytes, so an arena of
+ * yay0_compress_scratch_size(n) bytes runs yay0_compress_to on n bytes.
+ * Only the newest block is really freed; the rest comes back on reset.
+ * Not safe for several threads at once. Pass &arena.allocator.
+ */
+typedef struct
+{
+  yay0_allocator allocator;
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  /* Offset of the newest block */
+  size_t last;
+  /* Most ever in use at once, kept across resets */
+  size_t peak;
+} yay0_arena;
+
+void yay0_arena_init(yay0_arena *arena, void *mem, size_t size);
+
+/* Frees every block at once */
+void yay0_arena_reset(yay0_arena *arena);
+
+/**
+ * Worst-case peak memory of each operation, taken from the allocator on
+ * top of the caller's buffers, for n input and m decoded bytes. In an
+ * arena each block is rounded up to 16 bytes, which the scratch sizes
+ * already include.
+ *
+ *   yay0_decompress, _ex, _any, _headerless, yay0_measure, _any, _dict,
+ *   yay0_validate, size and format queries, yay0_index_save,
+ *   yay0_decoder_feed and yay0_decoder_pull: nothing
+ *   yay0_decoder_create: yay0_decoder_scratch_size()
+ *   yay0_decompress_dict: m + the dictionary, of which at most 4 KB counts
+ *   yay0_decompress_range: under 4 KB + interval + 8736 + length
+ *   yay0_index_build: 4 KB * P + 16 * P + 1 + the index itself, for
+ *   P = m / interval rounded up, but at most m / 32 + 1 checkpoints, and
+ *   while building, under 4 KB + interval + 8736 but at most 4 KB + m
+ *   yay0_index_load: 4 KB + 16 per checkpoint, + 17 + the index itself;
+ *   a built or loaded index keeps all but the building buffer until
+ *   destroyed
+ *   yay0_decompress_parallel: 36 per segment + 64, and deferred copies,
+ *   which depend on the data: 16 bytes for each backreference that reads
+ *   from before its segment or from a deferred copy, three times that
+ *   while a list grows, and 1 KB at least for a segment with any
+ *   yay0_encoder_create_in, yay0_compress_ctx_to: nothing
+ *   yay0_compress_to: yay0_compress_scratch_size(n), in one block
+ *   yay0_encoder_create_with: yay0_compress_scratch_size_ex(n, p) once it
+ *   has had an input of n bytes, if no earlier one was larger
+ *   yay0_compress_ctx, yay0_compress_formats: that, plus each output, at
+ *   most yay0_compress_bound(n) in any format
+ *   yay0_compress, yay0_compress_ex serially:
+ *   yay0_compress_scratch_size_ex(n, p) + yay0_compress_bound(n)
+ *   yay0_compress_ex in blocks of B bytes on T threads:
+ *   T * yay0_compress_scratch_size_ex(B, p) + 3 * yay0_compress_bound(n) +
+ *   128 * (blocks + T), + T * sizeof(yay0_stats) with statistics, and
+ *   + n + 4 KB + 16 with a dictionary
+ *   yay0_compress_batch on W workers: W * yay0_compress_scratch_size_ex of
+ *   the largest input, if the pool hands jobs out in order, + 16 per job +
+ *   8 * W + 32, + the outputs it allocates
+ *   yay0_decompress_batch: 16 per job + 8 * W + 32 + the outputs it
+ *   allocates
+ *   yay0_dict_train: 2 MB
+ *
+ * Whatever runs on T > 1 threads (yay0_decompress_parallel, yay0_compress_ex
+ * in blocks, the batch calls without a pool) also takes one block of under
+ * 32 bytes per thread for the thread handles, from the same allocator.
+ * Built with YAY0_NO_THREADS, everything runs on the calling thread.
+ *
+ * With malloc, encoders grow their buffers by doubling instead of sizing
+ * them up front, and can take up to three times the scratch size.
+ */
+
 yay0_result yay0_get_decompressed_size(const uint8_t *input, size_t input_size,
   size_t *out_size);
 
@@ -34,6 +128,440 @@ yay0_result yay0_decompress(const uint8_t *input, size_t input_size,
 yay0_result yay0_compress(const uint8_t *input, size_t input_size,
   uint8_t **output, size_t *output_size);
 
+/**
+ * Checks that a file would decode, without decoding it, and finds where it
+ * ends: the furthest byte any of its streams is read to. Trailing bytes
+ * are allowed, so this can size a file found inside a larger image.
+ */
+yay0_result yay0_measure(const uint8_t *input, size_t input_size,
+  size_t *compressed_size, size_t *decompressed_size);
+
+/**
+ * Like yay0_measure, for a file compressed with a preset dictionary of
+ * dict_size bytes, whose early matches may reach back into it.
+ */
+yay0_result yay0_measure_dict(const uint8_t *input, size_t input_size,
+  size_t dict_size, size_t *compressed_size, size_t *decompressed_size);
+
+/**
+ * Strict check for untrusted files, without allocating or writing output:
+ * every read must stay inside its stream and every backreference inside
+ * the output made so far, the decoded size must come out exactly, and the
+ * streams must end exactly where the next one (or the input) begins,
+ * allowing only the padding of the last 32-bit flag word. Takes about the
+ * time of a walk over the flags and tokens, well below a full decode.
+ */
+yay0_result yay0_validate(const uint8_t *input, size_t input_size,
+  size_t *decompressed_size);
+
+/**
+ * Encoder context holding all match-finder state and scratch buffers. Each
+ * context may only be used by one thread at a time, but any number of
+ * contexts can compress in parallel. Scratch buffers are kept between calls
+ * to yay0_compress_ctx so a context can be reused across many inputs.
+ */
+typedef struct yay0_encoder_s yay0_encoder_t;
+
+yay0_encoder_t *yay0_encoder_create(void);
+
+/**
+ * Like yay0_encoder_create, taking the context and its buffers from
+ * allocator (copied; NULL for the default). Such a context sizes each
+ * buffer for the whole input at once instead of growing it.
+ */
+yay0_encoder_t *yay0_encoder_create_with(const yay0_allocator *allocator);
+
+typedef enum
+{
+  /* Boyer-Moore rescan of the whole window for every position */
+  YAY0_SEARCH_SCAN = 0,
+  /* Hash chains over the window, visiting a bounded number of candidates */
+  YAY0_SEARCH_CHAIN,
+  /**
+   * Indexed window that picks the same matches as YAY0_SEARCH_SCAN, so the
+   * output is byte for byte identical, only faster (default)
+   */
+  YAY0_SEARCH_EXACT
+} yay0_search;
+
+/**
+ * Selects the match finder used by the context. max_chain bounds how many
+ * candidates YAY0_SEARCH_CHAIN visits per position; 0 picks the default.
+ */
+void yay0_encoder_set_search(yay0_encoder_t *enc, yay0_search search,
+  unsigned int max_chain);
+
+typedef enum
+{
+  /* Greedy matching with one step of lazy evaluation (default) */
+  YAY0_PARSE_LAZY = 0,
+  /**
+   * Minimum-size parse under the Yay0 cost model. Much slower and needs
+   * about 10 bytes of scratch per input byte, but gives the smallest output
+   * the match finder allows.
+   */
+  YAY0_PARSE_OPTIMAL
+} yay0_parse;
+
+void yay0_encoder_set_parse(yay0_encoder_t *enc, yay0_parse parse);
+
+/* Compression levels, from fastest to smallest output */
+#define YAY0_LEVEL_MIN 1
+#define YAY0_LEVEL_MAX 9
+/* Reproduces the original encoder's output exactly */
+#define YAY0_LEVEL_DEFAULT 0
+
+/* Match lengths 3 to 17 get a bucket each; the last holds 18 to 273 */
+#define YAY0_STATS_LEN_BUCKETS 16
+/* Bucket k holds distances from 2^k to 2^(k+1) - 1, up to 4096 */
+#define YAY0_STATS_DIST_BUCKETS 13
+
+/**
+ * Counters filled in by the entry points that take one, adding to what is
+ * already there, so clear it with yay0_stats_init first. Token counts come
+ * from walking the finished file. The encoder only does the extra work of
+ * counting and timing when it has a yay0_stats, and builds with
+ * YAY0_NO_STATS leave its search counters and times out entirely.
+ * Times are in seconds, summed over threads.
+ */
+typedef struct
+{
+  /* Tokens in the file */
+  unsigned long literals;
+  unsigned long matches;
+  unsigned long match_bytes;
+  unsigned long len_hist[YAY0_STATS_LEN_BUCKETS];
+  unsigned long dist_hist[YAY0_STATS_DIST_BUCKETS];
+
+  /* Encoder work: match finder calls, scans by the original finder, and
+   * matches the lazy parser deferred for a longer one */
+  unsigned long searches;
+  unsigned long mischar_searches;
+  unsigned long lazy_wins;
+
+  /* Scratch buffer growth */
+  unsigned long reallocs;
+  unsigned long realloc_bytes;
+
+  /* Wall time finding matches, emitting tokens, writing the file, and
+   * decoding */
+  double time_search;
+  double time_emit;
+  double time_serialize;
+  double time_decode;
+} yay0_stats;
+
+void yay0_stats_init(yay0_stats *s);
+
+typedef struct
+{
+  yay0_search search;
+  yay0_parse parse;
+  /* Candidates visited per position by YAY0_SEARCH_CHAIN, 0 for default */
+  unsigned int max_chain;
+  /* Positions past a match checked for a longer one, 0 for pure greedy */
+  unsigned int lazy_depth;
+  /* Match length that is good enough to stop searching, at most 273 */
+  unsigned int nice_len;
+  /**
+   * yay0_compress_ex only: inputs larger than block_size are cut into
+   * blocks of that size and encoded on up to 'threads' threads (0 for one
+   * per processor). Each block still sees the 4 KB before it as history,
+   * and the result depends on block_size but not on the thread count.
+   * 0 encodes the whole input serially.
+   */
+  size_t block_size;
+  unsigned int threads;
+  /* Where to collect statistics, or NULL */
+  yay0_stats *stats;
+  /**
+   * Preset dictionary, or NULL: output before the start of the input that
+   * early matches may point into. Only its last YAY0_DICT_SIZE_MAX bytes
+   * can be reached, and the file must be decoded with
+   * yay0_decompress_dict and the same dictionary. The bytes must stay
+   * valid while the parameters are in use.
+   */
+  const uint8_t *dict;
+  size_t dict_size;
+} yay0_params;
+
+/* Most dictionary a backreference can reach (12-bit distance) */
+#define YAY0_DICT_SIZE_MAX 0x1000u
+
+/* Block size that keeps the ratio within a fraction of a percent of serial */
+#define YAY0_BLOCK_SIZE_DEFAULT (1024u * 1024u)
+
+/**
+ * Fills in the parameters for a level between YAY0_LEVEL_MIN and
+ * YAY0_LEVEL_MAX; any other value gives YAY0_LEVEL_DEFAULT.
+ */
+void yay0_params_init(yay0_params *p, int level);
+
+void yay0_encoder_set_params(yay0_encoder_t *enc, const yay0_params *p);
+
+/* Like yay0_compress, with the given parameters (NULL for the default) */
+yay0_result yay0_compress_ex(const uint8_t *input, size_t input_size,
+  const yay0_params *p, uint8_t **output, size_t *output_size);
+
+/* Largest possible compressed size of input_size bytes */
+size_t yay0_compress_bound(size_t input_size);
+
+/**
+ * Compresses into caller memory of output_capacity bytes, which
+ * yay0_compress_bound(input_size) always satisfies. Makes exactly one
+ * scratch allocation of yay0_compress_scratch_size(input_size) bytes.
+ */
+yay0_result yay0_compress_to(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t output_capacity, size_t *written);
+
+/**
+ * Memory needed by yay0_encoder_create_in for inputs of up to input_size
+ * bytes, with the given parameters (NULL for the default). Returns 0 if
+ * input_size is too large.
+ */
+size_t yay0_compress_scratch_size(size_t input_size);
+size_t yay0_compress_scratch_size_ex(size_t input_size, const yay0_params *p);
+
+/**
+ * Builds an encoder context inside caller memory (aligned as for malloc),
+ * with every buffer sized for inputs of up to max_input bytes, so that
+ * compressing never allocates. Returns NULL if mem_size is too small.
+ * The context must not be given larger inputs or different parameters
+ * that need more memory; yay0_encoder_destroy leaves the memory alone.
+ */
+yay0_encoder_t *yay0_encoder_create_in(void *mem, size_t mem_size,
+  size_t max_input, const yay0_params *p);
+
+/* Like yay0_compress_to, using the context's parameters and buffers */
+yay0_result yay0_compress_ctx_to(yay0_encoder_t *enc, const uint8_t *input,
+  size_t input_size, uint8_t *output, size_t output_capacity,
+  size_t *written);
+
+/* Releases the scratch buffers held by the context, leaving it reusable */
+void yay0_encoder_reset(yay0_encoder_t *enc);
+
+void yay0_encoder_destroy(yay0_encoder_t *enc);
+
+yay0_result yay0_compress_ctx(yay0_encoder_t *enc, const uint8_t *input,
+  size_t input_size, uint8_t **output, size_t *output_size);
+
+/**
+ * Sibling formats that take the same tokens: up to 273-byte matches at up
+ * to 4 KB back. Yaz0 interleaves each flag byte with the literals and
+ * tokens it covers. MIO0 has Yay0's three-stream layout but no long form,
+ * so longer matches are written as several tokens of up to 18 bytes.
+ */
+typedef enum
+{
+  YAY0_FORMAT_YAY0 = 0,
+  YAY0_FORMAT_YAZ0,
+  YAY0_FORMAT_MIO0,
+
+  YAY0_FORMAT_COUNT
+} yay0_format;
+
+/**
+ * Encodes input once and writes it in 'count' formats, each to a buffer
+ * from the context's allocator in outputs[i] of output_sizes[i] bytes:
+ * the match search runs once and each further format only costs its
+ * serialization. On failure
+ * no buffers are returned. Only Yay0 can be written with a dictionary.
+ */
+yay0_result yay0_compress_formats(yay0_encoder_t *enc, const uint8_t *input,
+  size_t input_size, const yay0_format *formats, size_t count,
+  uint8_t **outputs, size_t *output_sizes);
+
+/* Names the format of a file from its magic and reads its decoded size */
+yay0_result yay0_format_detect(const uint8_t *input, size_t input_size,
+  yay0_format *format, size_t *decompressed_size);
+
+/**
+ * Like yay0_measure, for a file in any of the formats: walks its tokens
+ * so that a bogus header cannot size the output.
+ */
+yay0_result yay0_measure_any(const uint8_t *input, size_t input_size,
+  yay0_format *format, size_t *compressed_size, size_t *decompressed_size);
+
+/* Like yay0_decompress, for a file in any of the formats */
+yay0_result yay0_decompress_any(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t *output_size);
+
+/**
+ * Like yay0_decompress, for a file compressed with a preset dictionary.
+ * Needs a temporary buffer the size of the output.
+ */
+yay0_result yay0_decompress_dict(const uint8_t *input, size_t input_size,
+  const uint8_t *dict, size_t dict_size, uint8_t *output,
+  size_t *output_size);
+
+/**
+ * Builds a dictionary of up to dict_capacity bytes (at most
+ * YAY0_DICT_SIZE_MAX are useful) from 'count' sample inputs. It is made of
+ * the sample segments whose substrings occur in the most samples, with the
+ * most common ones last, where they stay in the window longest.
+ */
+yay0_result yay0_dict_train(const uint8_t *const *samples,
+  const size_t *sample_sizes, size_t count, uint8_t *dict,
+  size_t dict_capacity, size_t *dict_size);
+
+/* Like yay0_decompress, adding to *stats if it is not NULL */
+yay0_result yay0_decompress_ex(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t *output_size, yay0_stats *stats);
+
+/**
+ * Checkpoint index for reading parts of a file. Every 'interval' bytes of
+ * output it keeps the stream positions and the 4 KB of output before
+ * them, so a range can be decoded starting from the nearest checkpoint:
+ * reading n bytes costs about n + interval bytes of decoding. Indexes take
+ * about 4 KB per checkpoint and can be saved next to the file.
+ */
+typedef struct yay0_index_s yay0_index_t;
+
+#define YAY0_INDEX_INTERVAL_DEFAULT (64u * 1024u)
+
+/**
+ * Walks the whole file and decodes it once, one checkpoint to the next,
+ * to build its index (interval 0: default)
+ */
+yay0_result yay0_index_build(const uint8_t *input, size_t input_size,
+  size_t interval, yay0_index_t **index);
+
+void yay0_index_destroy(yay0_index_t *index);
+
+size_t yay0_index_serialized_size(const yay0_index_t *index);
+
+yay0_result yay0_index_save(const yay0_index_t *index, uint8_t *output,
+  size_t output_capacity, size_t *written);
+
+yay0_result yay0_index_load(const uint8_t *input, size_t input_size,
+  yay0_index_t **index);
+
+/**
+ * Decodes output bytes [offset, offset + length) of the file the index
+ * was built for into output. Returns YAY0_ERR_OUTPUT_SMALL if the range
+ * runs past the end of the decompressed data.
+ */
+yay0_result yay0_decompress_range(const uint8_t *input, size_t input_size,
+  const yay0_index_t *index, size_t offset, size_t length, uint8_t *output);
+
+/**
+ * Like yay0_decompress, on up to 'threads' threads (0 for one per
+ * processor). A quick pass over the flags and tokens finds where each
+ * segment of segment_size output bytes (0 to pick one) starts in the
+ * streams, then the segments are decoded at the same time. Backreferences
+ * into a segment that was still being decoded are copied afterwards.
+ * Long runs of matches without literals, as in zero-filled data, leave
+ * most of that copying to the end, so such files gain little.
+ */
+yay0_result yay0_decompress_parallel(const uint8_t *input, size_t input_size,
+  uint8_t *output, size_t *output_size, unsigned int threads,
+  size_t segment_size);
+
+/**
+ * One buffer of a batch. 'output' is caller memory of output_capacity
+ * bytes, or NULL to have the result allocated and stored there for the
+ * caller to free. The batch call fills in output_size and result.
+ */
+typedef struct
+{
+  const uint8_t *input;
+  size_t input_size;
+  uint8_t *output;
+  size_t output_capacity;
+  size_t output_size;
+  yay0_result result;
+} yay0_batch_job;
+
+typedef void (*yay0_batch_fn)(void *arg, size_t index, unsigned int worker);
+
+/**
+ * Where a batch runs. With run left NULL, the library starts up to
+ * 'workers' threads (0 for one per processor) for the call, and idle
+ * threads take the next job as soon as they finish one. A caller's pool
+ * supplies run instead: it must call fn(arg, i, worker) for every i below
+ * count and return when all calls are done, with 'worker' below 'workers'
+ * and never the same for two calls running at once. Handing out i in
+ * increasing order runs the largest jobs first.
+ */
+typedef struct
+{
+  void (*run)(void *pool, unsigned int workers, size_t count,
+    yay0_batch_fn fn, void *arg);
+  void *pool;
+  unsigned int workers;
+} yay0_batch_pool;
+
+/* Totals for a batch; input_bytes / seconds is its throughput */
+typedef struct
+{
+  size_t jobs;
+  size_t failed;
+  /* Bytes read and written by the jobs that succeeded */
+  size_t input_bytes;
+  size_t output_bytes;
+  /* Wall time of the whole call */
+  double seconds;
+} yay0_batch_report;
+
+/**
+ * Compresses every job with the given parameters (NULL for the default;
+ * block_size, threads and stats are ignored), largest input first. Each
+ * worker keeps one encoder context for all of its jobs. pool and report
+ * may be NULL. Returns YAY0_OK if every job succeeded, else the result of
+ * the first job in the array that failed.
+ */
+yay0_result yay0_compress_batch(yay0_batch_job *jobs, size_t count,
+  const yay0_params *p, const yay0_batch_pool *pool,
+  yay0_batch_report *report);
+
+/**
+ * Like yay0_compress_batch, decompressing each job. Outputs the library
+ * allocates are sized by a walk over the file, never by its header alone.
+ */
+yay0_result yay0_decompress_batch(yay0_batch_job *jobs, size_t count,
+  const yay0_batch_pool *pool, yay0_batch_report *report);
+
+/**
+ * Incremental decoder using constant memory (about 6 KB): a 4 KB history
+ * window and a small buffer for each of the flag, token and raw streams.
+ *
+ * Call yay0_decoder_pull to decode into a buffer of any size. Whenever it
+ * returns YAY0_NEED_INPUT, read input starting at the file offset given by
+ * yay0_decoder_want and pass it to yay0_decoder_feed, which takes as much
+ * of it as fits and returns how much that was. The three streams live at
+ * different offsets, so the offset asked for jumps around. Feeding zero
+ * bytes reports the end of the input at that offset. Pull returns YAY0_OK
+ * when the output buffer is full or the whole file has been decoded, which
+ * yay0_decoder_done tells apart.
+ */
+typedef struct yay0_decoder_s yay0_decoder_t;
+
+yay0_decoder_t *yay0_decoder_create(void);
+
+/* Like yay0_decoder_create, from allocator (NULL for the default) */
+yay0_decoder_t *yay0_decoder_create_with(const yay0_allocator *allocator);
+
+/* Memory yay0_decoder_create takes */
+size_t yay0_decoder_scratch_size(void);
+
+/* Gets the decoder ready for a new file */
+void yay0_decoder_reset(yay0_decoder_t *dec);
+
+void yay0_decoder_destroy(yay0_decoder_t *dec);
+
+size_t yay0_decoder_want(const yay0_decoder_t *dec);
+
+size_t yay0_decoder_feed(yay0_decoder_t *dec, const uint8_t *data,
+  size_t len);
+
+yay0_result yay0_decoder_pull(yay0_decoder_t *dec, uint8_t *output,
+  size_t output_size, size_t *written);
+
+/* Decompressed size, once the header has been fed (else YAY0_NEED_INPUT) */
+yay0_result yay0_decoder_size(const yay0_decoder_t *dec, size_t *out_size);
+
+int yay0_decoder_done(const yay0_decoder_t *dec);
+
 #ifdef __cplusplus
 }
 #endif
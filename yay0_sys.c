@@ -0,0 +1,165 @@
+#ifndef YAY0_NO_THREADS
+  #define _POSIX_C_SOURCE 200112L
+  #include <pthread.h>
+  #include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <time.h>
+
+#include "yay0_sys.h"
+
+/* Upper limit on threads started by yay0_parallel_for */
+#define YAY0_THREADS_MAX 256u
+
+double yay0_time_now(void)
+{
+#if !defined(YAY0_NO_THREADS) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+unsigned int yay0_cpu_count(void)
+{
+#if !defined(YAY0_NO_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? (unsigned int)n : 1u;
+#else
+  return 1;
+#endif
+}
+
+unsigned int yay0_parallel_threads(unsigned int threads, size_t count)
+{
+#ifdef YAY0_NO_THREADS
+  (void)threads;
+  (void)count;
+  return 1;
+#else
+  if (!threads)
+    threads = yay0_cpu_count();
+  if (threads > YAY0_THREADS_MAX)
+    threads = YAY0_THREADS_MAX;
+  if ((size_t)threads > count)
+    threads = count ? (unsigned int)count : 1u;
+
+  return threads;
+#endif
+}
+
+#ifndef YAY0_NO_THREADS
+typedef struct
+{
+  pthread_mutex_t lock;
+  size_t next;
+  size_t count;
+  yay0_task_fn fn;
+  void *arg;
+} yay0_for_t;
+
+typedef struct
+{
+  yay0_for_t *job;
+  unsigned int worker;
+} yay0_for_worker_t;
+
+/* What yay0_parallel_for_in keeps in its scratch for each thread */
+typedef struct
+{
+  pthread_t tid;
+  yay0_for_worker_t worker;
+} yay0_for_slot_t;
+
+static void for_run(yay0_for_t *job, unsigned int worker)
+{
+  size_t i;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->count)
+      break;
+    job->fn(job->arg, i, worker);
+  }
+}
+
+static void *for_thread(void *arg)
+{
+  yay0_for_worker_t *w = (yay0_for_worker_t*)arg;
+
+  for_run(w->job, w->worker);
+
+  return NULL;
+}
+#endif
+
+size_t yay0_parallel_scratch_size(unsigned int threads, size_t count)
+{
+#ifndef YAY0_NO_THREADS
+  threads = yay0_parallel_threads(threads, count);
+  if (threads > 1)
+    return threads * sizeof(yay0_for_slot_t);
+#else
+  (void)threads;
+  (void)count;
+#endif
+
+  return 0;
+}
+
+void yay0_parallel_for_in(unsigned int threads, size_t count,
+  yay0_task_fn fn, void *arg, void *scratch)
+{
+  size_t i;
+#ifndef YAY0_NO_THREADS
+  yay0_for_t job;
+  yay0_for_slot_t *slots = (yay0_for_slot_t*)scratch;
+  unsigned int started = 0, t;
+
+  threads = yay0_parallel_threads(threads, count);
+  if (threads > 1 && slots && pthread_mutex_init(&job.lock, NULL) == 0)
+  {
+    job.next = 0;
+    job.count = count;
+    job.fn = fn;
+    job.arg = arg;
+
+    /* Whatever threads fail to start, the others pick up the work */
+    for (t = 1; t < threads; ++t)
+    {
+      slots[started].worker.job = &job;
+      slots[started].worker.worker = t;
+      if (pthread_create(&slots[started].tid, NULL, for_thread,
+                         &slots[started].worker) == 0)
+        ++started;
+    }
+    for_run(&job, 0);
+    for (t = 0; t < started; ++t)
+      pthread_join(slots[t].tid, NULL);
+    pthread_mutex_destroy(&job.lock);
+    return;
+  }
+#else
+  (void)threads;
+  (void)scratch;
+#endif
+
+  for (i = 0; i < count; ++i)
+    fn(arg, i, 0);
+}
+
+void yay0_parallel_for(unsigned int threads, size_t count, yay0_task_fn fn,
+  void *arg)
+{
+  size_t size = yay0_parallel_scratch_size(threads, count);
+  void *scratch = size ? malloc(size) : NULL;
+
+  yay0_parallel_for_in(threads, count, fn, arg, scratch);
+  free(scratch);
+}
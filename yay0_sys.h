@@ -0,0 +1,53 @@
+#ifndef YAY0_SYS_H
+#define YAY0_SYS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Platform helpers shared by the library and the tool. Building with
+ * YAY0_NO_THREADS (as on N64/GEKKO) runs all parallel work on the calling
+ * thread.
+ */
+
+/* Monotonic wall clock in seconds, for timing */
+double yay0_time_now(void);
+
+/* Number of processors available, at least 1 */
+unsigned int yay0_cpu_count(void);
+
+typedef void (*yay0_task_fn)(void *arg, size_t index, unsigned int worker);
+
+/**
+ * Calls fn(arg, i, worker) for every i below count, spread over at most
+ * 'threads' threads (0 for one per processor), and returns once all calls
+ * have finished. 'worker' is below the thread count and no two calls with
+ * the same worker run at once, so it can index per-thread state. Indices
+ * are handed out in increasing order. The calling thread is worker 0.
+ */
+void yay0_parallel_for(unsigned int threads, size_t count, yay0_task_fn fn,
+  void *arg);
+
+/**
+ * Like yay0_parallel_for, keeping its thread handles in caller memory of
+ * yay0_parallel_scratch_size(threads, count) bytes, aligned as for
+ * malloc, instead of the heap. Runs on the calling thread alone if
+ * scratch is NULL.
+ */
+void yay0_parallel_for_in(unsigned int threads, size_t count,
+  yay0_task_fn fn, void *arg, void *scratch);
+
+/* Bytes of scratch yay0_parallel_for_in needs; 0 when it runs serially */
+size_t yay0_parallel_scratch_size(unsigned int threads, size_t count);
+
+/* Thread count yay0_parallel_for will actually use for 'count' items */
+unsigned int yay0_parallel_threads(unsigned int threads, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif